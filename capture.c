@@ -0,0 +1,212 @@
+#include "capture.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CAPTURE_BUFFER (64 * 1024)
+
+static FILE *capture_file = NULL;
+static int64_t last_ns = 0;
+static int64_t last_flush_ns = 0;
+static int next_conn = 1;
+
+/* Connection number by fd, grown on demand. */
+static int *conn_of = NULL;
+static int conn_cap = 0;
+
+static int put_varint(unsigned char *p, uint64_t v) {
+  int n = 0;
+  while (v >= 0x80) {
+    p[n++] = (unsigned char)(v | 0x80);
+    v >>= 7;
+  }
+  p[n++] = (unsigned char)v;
+  return n;
+}
+
+static int get_varint(FILE *f, uint64_t *v) {
+  uint64_t x = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int c = fgetc(f);
+    if (c == EOF)
+      return -1;
+    x |= (uint64_t)(c & 0x7f) << shift;
+    if (!(c & 0x80)) {
+      *v = x;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static int open_file(const char *path, const char *mode) {
+  capture_file = fopen(path, mode);
+  if (!capture_file)
+    return -1;
+  setvbuf(capture_file, NULL, _IOFBF, CAPTURE_BUFFER);
+  return 0;
+}
+
+int capture_open(const char *path, const CaptureHeader *header) {
+  if (open_file(path, "wb") < 0)
+    return -1;
+  CaptureHeader h = *header;
+  h.magic = CAPTURE_MAGIC;
+  h.version = CAPTURE_VERSION;
+  fwrite(&h, sizeof(h), 1, capture_file);
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  last_ns = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  last_flush_ns = last_ns;
+  next_conn = 1;
+  return 0;
+}
+
+int capture_resume(const char *path, const CaptureCursor *cursor) {
+  if (open_file(path, "ab") < 0)
+    return -1;
+  last_ns = cursor->last_ns;
+  last_flush_ns = last_ns;
+  next_conn = cursor->next_conn;
+  return 0;
+}
+
+void capture_cursor(CaptureCursor *cursor) {
+  memset(cursor, 0, sizeof(*cursor));
+  cursor->last_ns = last_ns;
+  cursor->next_conn = next_conn;
+}
+
+void capture_flush(void) {
+  if (capture_file)
+    fflush(capture_file);
+}
+
+void capture_close(void) {
+  if (capture_file)
+    fclose(capture_file);
+  capture_file = NULL;
+  free(conn_of);
+  conn_of = NULL;
+  conn_cap = 0;
+}
+
+void capture_bind(int fd, int conn) {
+  if (!capture_file || fd < 0)
+    return;
+  if (fd >= conn_cap) {
+    int cap = conn_cap ? conn_cap : 1024;
+    while (cap <= fd)
+      cap *= 2;
+    int *p = realloc(conn_of, cap * sizeof(int));
+    if (!p) {
+      perror("realloc");
+      exit(1);
+    }
+    memset(p + conn_cap, 0, (cap - conn_cap) * sizeof(int));
+    conn_of = p;
+    conn_cap = cap;
+  }
+  conn_of[fd] = conn;
+}
+
+int capture_conn(int fd) {
+  return fd >= 0 && fd < conn_cap ? conn_of[fd] : 0;
+}
+
+static void put(int type, int conn, int round, int64_t t_ns, const char *data,
+                int len, int value) {
+  if (!capture_file)
+    return;
+  /* Events of one wakeup share a timestamp, and a live upgrade may hand over
+   * a stamp taken just before the old process's last one. */
+  int64_t delta = t_ns > last_ns ? t_ns - last_ns : 0;
+  last_ns += delta;
+
+  unsigned char rec[4 * 10 + 1 + CAPTURE_DATA_LEN];
+  int n = 0;
+  rec[n++] = (unsigned char)type;
+  n += put_varint(rec + n, (uint64_t)delta);
+  n += put_varint(rec + n, (uint64_t)conn);
+  n += put_varint(rec + n, (uint64_t)(round + 1));
+  if (type == CAP_DATA || type == CAP_TOKEN) {
+    if (len > CAPTURE_DATA_LEN)
+      len = CAPTURE_DATA_LEN;
+    n += put_varint(rec + n, (uint64_t)len);
+    memcpy(rec + n, data, len);
+    n += len;
+  } else if (type == CAP_RESULT) {
+    n += put_varint(rec + n, (uint32_t)value);
+  }
+  fwrite(rec, 1, n, capture_file);
+
+  if (last_ns - last_flush_ns >= CAPTURE_FLUSH_NS) {
+    fflush(capture_file);
+    last_flush_ns = last_ns;
+  }
+}
+
+void capture_accept(int fd, int round, int64_t t_ns) {
+  if (!capture_file)
+    return;
+  capture_bind(fd, next_conn++);
+  put(CAP_ACCEPT, capture_conn(fd), round, t_ns, NULL, 0, 0);
+}
+
+void capture_data(int fd, int round, int64_t t_ns, const char *data,
+                  int len) {
+  put(CAP_DATA, capture_conn(fd), round, t_ns, data, len, 0);
+}
+
+void capture_closed(int fd, int round, int64_t t_ns) {
+  put(CAP_CLOSED, capture_conn(fd), round, t_ns, NULL, 0, 0);
+}
+
+void capture_round(int round, int64_t t_ns) {
+  put(CAP_ROUND, 0, round, t_ns, NULL, 0, 0);
+}
+
+void capture_token(int fd, int round, int64_t t_ns, const char *token) {
+  put(CAP_TOKEN, capture_conn(fd), round, t_ns, token, strlen(token), 0);
+}
+
+void capture_result(int fd, int64_t t_ns, int score) {
+  put(CAP_RESULT, capture_conn(fd), -1, t_ns, NULL, 0, score);
+}
+
+int capture_read_header(FILE *f, CaptureHeader *header) {
+  if (fread(header, sizeof(*header), 1, f) != 1)
+    return -1;
+  if (header->magic != CAPTURE_MAGIC || header->version != CAPTURE_VERSION)
+    return -1;
+  header->category[CAPTURE_CATEGORY_LEN - 1] = '\0';
+  return 0;
+}
+
+int capture_read(FILE *f, CaptureEvent *ev) {
+  int type = fgetc(f);
+  if (type == EOF)
+    return 0;
+  uint64_t delta, conn, round, len = 0, value = 0;
+  if (get_varint(f, &delta) < 0 || get_varint(f, &conn) < 0 ||
+      get_varint(f, &round) < 0)
+    return 0;
+  if (type == CAP_DATA || type == CAP_TOKEN) {
+    if (get_varint(f, &len) < 0 || len > CAPTURE_DATA_LEN ||
+        fread(ev->data, 1, len, f) != len)
+      return 0;
+  } else if (type == CAP_RESULT) {
+    if (get_varint(f, &value) < 0)
+      return 0;
+  } else if (type < CAP_ACCEPT || type > CAP_RESULT) {
+    return 0;
+  }
+  ev->type = type;
+  ev->t_ns += (int64_t)delta;
+  ev->conn = (int)conn;
+  ev->round = (int)round - 1;
+  ev->len = (int)len;
+  ev->value = (int)(uint32_t)value;
+  return 1;
+}
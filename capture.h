@@ -0,0 +1,83 @@
+#ifndef QUIZRUSH_CAPTURE_H
+#define QUIZRUSH_CAPTURE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define CAPTURE_MAGIC 0x50435251
+#define CAPTURE_VERSION 1
+#define CAPTURE_DATA_LEN 64
+#define CAPTURE_CATEGORY_LEN 64
+#define CAPTURE_FLUSH_NS 1000000000LL
+
+/* Client events as the server handled them, plus the few server-side facts a
+ * replay has to line up with (question sent, token issued, final score). */
+enum {
+  CAP_ACCEPT = 1,
+  CAP_DATA,
+  CAP_CLOSED,
+  CAP_ROUND,  /* the question of `round` went out; conn is 0 */
+  CAP_TOKEN,  /* data is the session token the server gave the connection */
+  CAP_RESULT, /* value is the final score of the player on the connection */
+};
+
+/* Start of the file: what a replay needs to draw the same questions. */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t seed;
+  int32_t game_len;
+  int32_t difficulty;
+  int32_t max_players;
+  int32_t compensate_latency;
+  char category[CAPTURE_CATEGORY_LEN];
+} CaptureHeader;
+
+/* Records are a type byte followed by varints: nanoseconds since the
+ * previous record, connection number (in accept order, from 1), round + 1,
+ * then the length and bytes of the data or the value. A data chunk usually
+ * takes under 10 bytes plus its payload. */
+typedef struct {
+  int type;
+  int64_t t_ns; /* since the capture started */
+  int conn;
+  int round; /* the server's round when it handled the event, -1: lobby */
+  int value;
+  int len;
+  char data[CAPTURE_DATA_LEN];
+} CaptureEvent;
+
+/* Where the writer stands, for a live upgrade to carry on the same file. */
+typedef struct {
+  int64_t last_ns;
+  int32_t next_conn;
+  int32_t reserved;
+} CaptureCursor;
+
+/* Writer, used by the server. All calls are no-ops while no capture is
+ * open; t_ns are CLOCK_MONOTONIC timestamps. */
+int capture_open(const char *path, const CaptureHeader *header);
+int capture_resume(const char *path, const CaptureCursor *cursor);
+void capture_cursor(CaptureCursor *cursor);
+void capture_flush(void);
+void capture_close(void);
+
+void capture_accept(int fd, int round, int64_t t_ns);
+void capture_data(int fd, int round, int64_t t_ns, const char *data, int len);
+void capture_closed(int fd, int round, int64_t t_ns);
+void capture_round(int round, int64_t t_ns);
+void capture_token(int fd, int round, int64_t t_ns, const char *token);
+void capture_result(int fd, int64_t t_ns, int score);
+
+/* Connection number of a socket (0 if none) and the reverse for sockets
+ * passed to a new process. */
+int capture_conn(int fd);
+void capture_bind(int fd, int conn);
+
+/* Reader, used by the replay driver. Times are deltas, so capture_read()
+ * adds to ev->t_ns: start from a zeroed event and keep passing the same one.
+ * Returns 1 for an event, 0 at the end of the file or at a torn record. */
+int capture_read_header(FILE *f, CaptureHeader *header);
+int capture_read(FILE *f, CaptureEvent *ev);
+
+#endif
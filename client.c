@@ -4,9 +4,15 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "cluster.h"
+
 #define SERVER_PORT 5000
 #define MAX_NAME_LEN 50
 #define BUFFER_SIZE 4096
+#define TOKEN_LEN 64
+#define RECONNECT_ATTEMPTS 10
+
+const char *room = NULL;
 
 int is_latin(const char *str) {
   for (int i = 0; str[i]; i++) {
@@ -17,15 +23,7 @@ int is_latin(const char *str) {
   return 1;
 }
 
-int main(int argc, char *argv[]) {
-  if (argc != 2) {
-    printf("Использование: %s <IP или hostname>\n", argv[0]);
-    return 1;
-  }
-
-  char name[MAX_NAME_LEN];
-  char buffer[BUFFER_SIZE];
-
+int connect_to_server(const char *host) {
   struct addrinfo hints, *res, *rp;
   memset(&hints, 0, sizeof(hints));
   int sock = -1;
@@ -33,7 +31,7 @@ int main(int argc, char *argv[]) {
   snprintf(port_str, sizeof(port_str), "%d", SERVER_PORT);
   hints.ai_family = AF_INET;
   hints.ai_socktype = SOCK_STREAM;
-  int err = getaddrinfo(argv[1], port_str, &hints, &res);
+  int err = getaddrinfo(host, port_str, &hints, &res);
   if (err != 0) {
     fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
     return -1;
@@ -49,6 +47,83 @@ int main(int argc, char *argv[]) {
     sock = -1;
   }
   freeaddrinfo(res);
+  return sock;
+}
+
+/* The server sends "/token <token>\n" once after joining. The line is cut out
+ * of the buffer so the player never sees it. It may arrive over several
+ * reads: a line that is or may become it is moved to `held` until its
+ * newline comes, and the caller puts it in front of the next read. */
+void take_token(char *buffer, char *held, size_t held_len, char *token,
+                size_t token_len) {
+  char *line = strstr(buffer, "/token ");
+  if (line) {
+    char *end = strchr(line, '\n');
+    if (!end) {
+      snprintf(held, held_len, "%s", line);
+      *line = '\0';
+      return;
+    }
+    snprintf(token, token_len, "%.*s", (int)(end - line - 7), line + 7);
+    memmove(line, end + 1, strlen(end + 1) + 1);
+    return;
+  }
+  char *tail = strrchr(buffer, '\n');
+  tail = tail ? tail + 1 : buffer;
+  size_t len = strlen(tail);
+  if (len > 0 && len < 7 && strncmp(tail, "/token ", len) == 0) {
+    snprintf(held, held_len, "%s", tail);
+    *tail = '\0';
+  }
+}
+
+/* After these messages the server closes the connection on purpose. */
+int is_final_message(const char *buffer) {
+  return strstr(buffer, "ИГРА ОКОНЧЕНА") ||
+         strstr(buffer, "Сервер завершает работу") ||
+         strstr(buffer, "Игра уже идет") ||
+         strstr(buffer, "Сессия не найдена");
+}
+
+/* Through router.out the first message of every connection names the room. */
+void send_first(int sock, const char *msg) {
+  char buf[BUFFER_SIZE];
+  if (room)
+    snprintf(buf, sizeof(buf), CLUSTER_ROOM_PREFIX "%s\n%s", room, msg);
+  else
+    snprintf(buf, sizeof(buf), "%s", msg);
+  send(sock, buf, strlen(buf), 0);
+}
+
+int reconnect(const char *host, const char *token) {
+  char msg[TOKEN_LEN + 16];
+  snprintf(msg, sizeof(msg), "/resume %s", token);
+  for (int i = 0; i < RECONNECT_ATTEMPTS; i++) {
+    sleep(1);
+    int sock = connect_to_server(host);
+    if (sock < 0)
+      continue;
+    send_first(sock, msg);
+    return sock;
+  }
+  return -1;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2 && argc != 3) {
+    printf("Использование: %s <IP или hostname> [комната]\n", argv[0]);
+    return 1;
+  }
+  if (argc == 3)
+    room = argv[2];
+
+  char name[MAX_NAME_LEN];
+  char buffer[BUFFER_SIZE];
+  char token[TOKEN_LEN] = "";
+  char held[TOKEN_LEN + 16] = "";
+  int finished = 0;
+
+  int sock = connect_to_server(argv[1]);
   if (sock == -1) {
     perror("connect");
     return -1;
@@ -75,7 +150,7 @@ int main(int argc, char *argv[]) {
     break;
   } while (1);
 
-  send(sock, name, strlen(name), 0);
+  send_first(sock, name);
 
   struct pollfd fds[2];
   fds[0].fd = STDIN_FILENO;
@@ -90,13 +165,29 @@ int main(int argc, char *argv[]) {
       break;
     }
 
-    if (fds[1].revents & POLLIN) {
-      int n = recv(sock, buffer, sizeof(buffer) - 1, 0);
+    if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+      size_t kept = strlen(held);
+      memcpy(buffer, held, kept);
+      held[0] = '\0';
+      int n = recv(sock, buffer + kept, sizeof(buffer) - 1 - kept, 0);
       if (n <= 0) {
+        close(sock);
+        if (token[0] && !finished) {
+          printf("\nСоединение потеряно, переподключаемся...\n");
+          sock = reconnect(argv[1], token);
+          if (sock >= 0) {
+            fds[1].fd = sock;
+            continue;
+          }
+        }
+        sock = -1;
         printf("\nСервер закрыл соединение.\n");
         break;
       }
-      buffer[n] = '\0';
+      buffer[kept + n] = '\0';
+      take_token(buffer, held, sizeof(held), token, sizeof(token));
+      if (is_final_message(buffer))
+        finished = 1;
       printf("%s", buffer);
     }
 
@@ -109,7 +200,8 @@ int main(int argc, char *argv[]) {
     }
   }
 
-  close(sock);
+  if (sock >= 0)
+    close(sock);
   printf("Соединение закрыто.\n");
   return 0;
 }
@@ -0,0 +1,156 @@
+#include "cluster.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+static int ctl_fd = -1;
+static char ctl_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static int ctl_port = 0;
+static char rooms[CLUSTER_MAX_ROOMS][CLUSTER_ROOM_LEN];
+static int room_count = 0;
+static char inbuf[512];
+static size_t inbuf_len = 0;
+static int64_t last_report_ms = 0;
+static int64_t last_try_ms = 0;
+static int reported[3] = {-1, -1, -1};
+
+static int64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* FNV-1a alone leaves keys that differ in the last character close together;
+ * the final mix spreads them over the whole ring. */
+uint32_t cluster_hash(const char *s) {
+  uint32_t h = 2166136261u;
+  while (*s) {
+    h ^= (unsigned char)*s++;
+    h *= 16777619u;
+  }
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return h;
+}
+
+static void drop_control(void) {
+  if (ctl_fd >= 0)
+    close(ctl_fd);
+  ctl_fd = -1;
+  inbuf_len = 0;
+}
+
+static int open_control(void) {
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", ctl_path);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  ctl_fd = fd;
+  reported[0] = -1;
+  return 0;
+}
+
+static void add_room(const char *id) {
+  for (int i = 0; i < room_count; i++) {
+    if (strcmp(rooms[i], id) == 0)
+      return;
+  }
+  if (room_count == CLUSTER_MAX_ROOMS)
+    return;
+  snprintf(rooms[room_count++], CLUSTER_ROOM_LEN, "%s", id);
+  reported[0] = -1;
+}
+
+static void read_control(void) {
+  while (ctl_fd >= 0) {
+    ssize_t n = recv(ctl_fd, inbuf + inbuf_len, sizeof(inbuf) - inbuf_len - 1,
+                     MSG_DONTWAIT);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+      drop_control();
+      return;
+    }
+    if (n < 0)
+      return;
+    inbuf_len += n;
+    inbuf[inbuf_len] = '\0';
+    char *line = inbuf;
+    char *end;
+    while ((end = strchr(line, '\n'))) {
+      *end = '\0';
+      if (strncmp(line, "room ", 5) == 0)
+        add_room(line + 5);
+      line = end + 1;
+    }
+    inbuf_len -= line - inbuf;
+    memmove(inbuf, line, inbuf_len);
+    /* A line longer than the buffer isn't from the router. */
+    if (inbuf_len == sizeof(inbuf) - 1)
+      inbuf_len = 0;
+  }
+}
+
+int cluster_join(const char *path, int port) {
+  snprintf(ctl_path, sizeof(ctl_path), "%s", path);
+  ctl_port = port;
+  last_try_ms = now_ms();
+  return open_control();
+}
+
+void cluster_tick(int players, int max_players, int lobby) {
+  if (!ctl_path[0])
+    return;
+  int64_t now = now_ms();
+  if (ctl_fd < 0) {
+    if (now - last_try_ms < CLUSTER_REPORT_MS)
+      return;
+    last_try_ms = now;
+    if (open_control() < 0)
+      return;
+  }
+  read_control();
+  if (ctl_fd < 0)
+    return;
+  if (players == reported[0] && max_players == reported[1] &&
+      lobby == reported[2] && now - last_report_ms < CLUSTER_REPORT_MS)
+    return;
+
+  char msg[128 + CLUSTER_MAX_ROOMS * CLUSTER_ROOM_LEN];
+  int len = snprintf(msg, sizeof(msg), "load %d %d %d %d", ctl_port, players,
+                     max_players, lobby);
+  for (int i = 0; i < room_count; i++)
+    len += snprintf(msg + len, sizeof(msg) - len, " %s", rooms[i]);
+  msg[len++] = '\n';
+  if (send(ctl_fd, msg, len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 &&
+      errno != EAGAIN) {
+    drop_control();
+    return;
+  }
+  reported[0] = players;
+  reported[1] = max_players;
+  reported[2] = lobby;
+  last_report_ms = now;
+}
+
+void cluster_leave(void) {
+  if (ctl_fd >= 0)
+    send(ctl_fd, "leave\n", 6, MSG_DONTWAIT | MSG_NOSIGNAL);
+  drop_control();
+  ctl_path[0] = '\0';
+}
@@ -0,0 +1,39 @@
+#ifndef QUIZRUSH_CLUSTER_H
+#define QUIZRUSH_CLUSTER_H
+
+#include <stdint.h>
+
+/* Cluster mode: router.out takes the clients on the game port and forwards
+ * each one to a backend server.out chosen by room; backends report their load
+ * to it over a Unix socket.
+ *
+ * A client names its room with a first line "/room <id>\n" in front of its
+ * name or resume token; the router takes that line off.
+ *
+ * Control protocol, one text line per message:
+ *   backend -> router  "load <port> <players> <max_players> <lobby 0/1>
+ *                       [<room> ...]\n" on connect, on change and every
+ *                       CLUSTER_REPORT_MS;
+ *   backend -> router  "leave\n" when it shuts down;
+ *   router -> backend  "room <id>\n" when it places a room there. */
+#define CLUSTER_CONTROL_PATH "/tmp/quizrush.ctl"
+#define CLUSTER_ROOM_PREFIX "/room "
+#define CLUSTER_ROOM_LEN 32
+#define CLUSTER_MAX_ROOMS 16
+#define CLUSTER_REPORT_MS 1000
+
+/* FNV-1a, which is what the router's hash ring is built on. */
+uint32_t cluster_hash(const char *s);
+
+/* Backend side. Returns -1 if the router isn't there yet; cluster_tick()
+ * keeps trying, so the router can be started or restarted at any time. */
+int cluster_join(const char *path, int port);
+/* Reports the load when it changed or CLUSTER_REPORT_MS passed, and takes the
+ * rooms the router placed here. Cheap enough for every loop tick. */
+void cluster_tick(int players, int max_players, int lobby);
+/* Tells the router this server is going away, so its rooms are free at once
+ * rather than after the grace period. Not for a live upgrade: the new process
+ * takes the rooms over. */
+void cluster_leave(void);
+
+#endif
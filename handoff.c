@@ -0,0 +1,208 @@
+#include "handoff.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+typedef struct {
+  uint64_t len;
+  uint32_t nfds;
+  uint32_t reserved;
+} HandoffHeader;
+
+static int write_full(int fd, const void *buf, size_t len) {
+  const char *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int read_full(int fd, void *buf, size_t len) {
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* The new binary must not inherit our copies of the client sockets, or
+ * closing a socket there would not close the connection. */
+static void close_other_fds(int keep) {
+#ifdef __NR_close_range
+  if (syscall(__NR_close_range, 3, keep - 1, 0) == 0 &&
+      syscall(__NR_close_range, keep + 1, ~0U, 0) == 0)
+    return;
+#endif
+  struct rlimit rl;
+  int max = 1024;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+    max = (int)rl.rlim_cur;
+  for (int fd = 3; fd < max; fd++) {
+    if (fd != keep)
+      close(fd);
+  }
+}
+
+pid_t handoff_spawn(const char *path, char *const argv[], int *chan) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+    perror("socketpair");
+    return -1;
+  }
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    close(sv[0]);
+    close(sv[1]);
+    return -1;
+  }
+
+  if (pid == 0) {
+    int argc = 0;
+    while (argv[argc])
+      argc++;
+    char **args = malloc((argc + 3) * sizeof(char *));
+    char fd_str[16];
+    if (!args)
+      _exit(127);
+    snprintf(fd_str, sizeof(fd_str), "%d", sv[1]);
+    memcpy(args, argv, argc * sizeof(char *));
+    args[argc] = "-H";
+    args[argc + 1] = fd_str;
+    args[argc + 2] = NULL;
+
+    close(sv[0]);
+    close_other_fds(sv[1]);
+    execv(path, args);
+    perror("execv");
+    _exit(127);
+  }
+
+  close(sv[1]);
+  *chan = sv[0];
+  return pid;
+}
+
+int handoff_send(int chan, const void *data, size_t len, const int *fds,
+                 int nfds) {
+  HandoffHeader h = {len, (uint32_t)nfds, 0};
+  if (write_full(chan, &h, sizeof(h)) < 0 || write_full(chan, data, len) < 0)
+    return -1;
+
+  for (int sent = 0; sent < nfds; sent += HANDOFF_FDS_PER_MSG) {
+    int batch = nfds - sent;
+    if (batch > HANDOFF_FDS_PER_MSG)
+      batch = HANDOFF_FDS_PER_MSG;
+
+    char byte = 'F';
+    struct iovec iov = {&byte, 1};
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_PER_MSG)];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * batch);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * batch);
+    memcpy(CMSG_DATA(cmsg), fds + sent, sizeof(int) * batch);
+
+    ssize_t n;
+    do {
+      n = sendmsg(chan, &msg, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+      perror("sendmsg");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int handoff_recv(int chan, void **data, size_t *len, int **fds, int *nfds) {
+  HandoffHeader h;
+  if (read_full(chan, &h, sizeof(h)) < 0)
+    return -1;
+
+  *data = malloc(h.len ? h.len : 1);
+  *fds = malloc((h.nfds ? h.nfds : 1) * sizeof(int));
+  if (!*data || !*fds)
+    return -1;
+  if (read_full(chan, *data, h.len) < 0)
+    return -1;
+  *len = h.len;
+
+  int got = 0;
+  while (got < (int)h.nfds) {
+    char byte;
+    struct iovec iov = {&byte, 1};
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_PER_MSG)];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    do {
+      n = recvmsg(chan, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0)
+      return -1;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        continue;
+      int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      if (got + count > (int)h.nfds)
+        return -1;
+      memcpy(*fds + got, CMSG_DATA(cmsg), count * sizeof(int));
+      got += count;
+    }
+  }
+  *nfds = got;
+  return 0;
+}
+
+int handoff_ack(int chan) { return write_full(chan, "1", 1); }
+
+int handoff_wait_ack(int chan, int timeout_ms) {
+  struct pollfd pfd = {chan, POLLIN, 0};
+  int r;
+  do {
+    r = poll(&pfd, 1, timeout_ms);
+  } while (r < 0 && errno == EINTR);
+  if (r <= 0)
+    return -1;
+  char c;
+  return read(chan, &c, 1) == 1 && c == '1' ? 0 : -1;
+}
@@ -0,0 +1,29 @@
+#ifndef QUIZRUSH_HANDOFF_H
+#define QUIZRUSH_HANDOFF_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* File descriptors per SCM_RIGHTS message, below the kernel's SCM_MAX_FD. */
+#define HANDOFF_FDS_PER_MSG 250
+#define HANDOFF_ACK_TIMEOUT_MS 5000
+
+/* Execs `path` (the new server binary) with `argv` and "-H <fd>" appended,
+ * fd being the other end of a Unix socket pair; argv[0] is only the name the
+ * process shows. Returns the pid and stores our end in *chan. */
+pid_t handoff_spawn(const char *path, char *const argv[], int *chan);
+
+/* One handoff message: a blob of serialized state plus any number of file
+ * descriptors, sent in batches of HANDOFF_FDS_PER_MSG. */
+int handoff_send(int chan, const void *data, size_t len, const int *fds,
+                 int nfds);
+
+/* Receives what handoff_send() sent. *data and *fds are malloc'ed. */
+int handoff_recv(int chan, void **data, size_t *len, int **fds, int *nfds);
+
+/* The new process says it is serving; the old one waits for that before
+ * leaving. */
+int handoff_ack(int chan);
+int handoff_wait_ack(int chan, int timeout_ms);
+
+#endif
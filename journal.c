@@ -0,0 +1,428 @@
+#include "journal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define JOURNAL_PATH_LEN 512
+
+JournalStats journal_stats;
+
+static int journal_fd = -1;
+static char journal_path[JOURNAL_PATH_LEN];
+static int commit_interval_ms = JOURNAL_COMMIT_MS;
+static long long last_commit_ms = 0;
+static long long journal_size = 0;
+
+static char *pending = NULL;
+static size_t pending_len = 0;
+static size_t pending_cap = 0;
+static int write_failing = 0;
+
+static long long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static long long monotonic_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* FNV-1a */
+static uint32_t checksum(const void *data, size_t len, uint32_t h) {
+  const unsigned char *p = data;
+  for (size_t i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static uint32_t record_checksum(const JournalRecord *r, const char *name) {
+  uint32_t h = checksum((const char *)r + sizeof(r->checksum),
+                        sizeof(*r) - sizeof(r->checksum), 2166136261u);
+  return checksum(name, r->name_len, h);
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+  const char *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static void encode(char **buf, size_t *len, size_t *cap, JournalRecord *r,
+                   const char *name) {
+  size_t name_len = name ? strlen(name) : 0;
+  if (name_len >= JOURNAL_NAME_LEN)
+    name_len = JOURNAL_NAME_LEN - 1;
+  r->name_len = (uint8_t)name_len;
+  r->ts_us = now_us();
+  r->checksum = record_checksum(r, name);
+
+  size_t need = *len + sizeof(*r) + name_len;
+  if (need > *cap) {
+    size_t new_cap = *cap ? *cap : 4096;
+    while (new_cap < need)
+      new_cap *= 2;
+    char *p = realloc(*buf, new_cap);
+    if (!p) {
+      perror("realloc");
+      exit(1);
+    }
+    *buf = p;
+    *cap = new_cap;
+  }
+  memcpy(*buf + *len, r, sizeof(*r));
+  memcpy(*buf + *len + sizeof(*r), name, name_len);
+  *len = need;
+}
+
+static void append(int type, int id, int round, int question, int answer,
+                   int time_spent, int points, const char *name) {
+  if (journal_fd < 0)
+    return;
+  JournalRecord r;
+  memset(&r, 0, sizeof(r));
+  r.type = type;
+  r.player_id = id;
+  r.round = round;
+  r.question = question;
+  r.answer = answer;
+  r.time_spent = time_spent;
+  r.points = points;
+  encode(&pending, &pending_len, &pending_cap, &r, name);
+  journal_stats.records++;
+}
+
+static JournalPlayer *state_player(JournalState *st, int id, int create) {
+  for (int i = 0; i < st->player_count; i++) {
+    if (st->players[i].id == id)
+      return &st->players[i];
+  }
+  if (!create)
+    return NULL;
+  JournalPlayer *p =
+      realloc(st->players, (st->player_count + 1) * sizeof(JournalPlayer));
+  if (!p) {
+    perror("realloc");
+    exit(1);
+  }
+  st->players = p;
+  JournalPlayer *jp = &st->players[st->player_count++];
+  memset(jp, 0, sizeof(*jp));
+  jp->id = id;
+  if (id > st->max_id)
+    st->max_id = id;
+  return jp;
+}
+
+static void state_remove(JournalState *st, int id) {
+  for (int i = 0; i < st->player_count; i++) {
+    if (st->players[i].id == id) {
+      st->players[i] = st->players[--st->player_count];
+      return;
+    }
+  }
+}
+
+static void state_apply(JournalState *st, const JournalRecord *r,
+                        const char *name) {
+  JournalPlayer *p;
+  switch (r->type) {
+  case J_GAME_START:
+    /* Joins from the lobby come before this, so players are kept. */
+    st->next_round = 0;
+    st->in_progress = 1;
+    st->seed = (uint32_t)r->question;
+    break;
+  case J_JOIN:
+  case J_SNAPSHOT:
+    p = state_player(st, r->player_id, 1);
+    memcpy(p->name, name, r->name_len);
+    p->name[r->name_len] = '\0';
+    if (r->type == J_SNAPSHOT) {
+      p->score = r->points;
+      st->next_round = r->round;
+      st->in_progress = 1;
+    }
+    break;
+  case J_LEAVE:
+    state_remove(st, r->player_id);
+    break;
+  case J_ROUND_START:
+    for (int i = 0; i < st->player_count; i++)
+      st->players[i].round_points = 0;
+    break;
+  case J_ANSWER:
+    p = state_player(st, r->player_id, 0);
+    if (p)
+      p->round_points += r->points;
+    break;
+  case J_ROUND_END:
+    /* Answers only count once their round was closed; a round cut short by
+     * a crash is replayed from the start. */
+    for (int i = 0; i < st->player_count; i++) {
+      st->players[i].score += st->players[i].round_points;
+      st->players[i].round_points = 0;
+    }
+    st->next_round = r->round + 1;
+    break;
+  case J_GAME_END:
+    st->in_progress = 0;
+    break;
+  }
+}
+
+int journal_recover(const char *path, JournalState *state) {
+  memset(state, 0, sizeof(*state));
+
+  int fd = open(path, O_RDWR);
+  if (fd < 0)
+    return errno == ENOENT ? 0 : -1;
+
+  struct stat stbuf;
+  if (fstat(fd, &stbuf) < 0) {
+    close(fd);
+    return -1;
+  }
+  char *data = malloc(stbuf.st_size ? stbuf.st_size : 1);
+  if (!data) {
+    close(fd);
+    return -1;
+  }
+  ssize_t got = 0;
+  while (got < stbuf.st_size) {
+    ssize_t n = read(fd, data + got, stbuf.st_size - got);
+    if (n <= 0)
+      break;
+    got += n;
+  }
+
+  size_t off = 0;
+  unsigned long count = 0;
+  while (off + sizeof(JournalRecord) <= (size_t)got) {
+    JournalRecord r;
+    memcpy(&r, data + off, sizeof(r));
+    if (off + sizeof(r) + r.name_len > (size_t)got ||
+        r.name_len >= JOURNAL_NAME_LEN)
+      break;
+    const char *name = data + off + sizeof(r);
+    if (record_checksum(&r, name) != r.checksum)
+      break;
+    state_apply(state, &r, name);
+    off += sizeof(r) + r.name_len;
+    count++;
+  }
+
+  if (off < (size_t)got) {
+    printf("Журнал: отброшен повреждённый хвост (%zu байт)\n",
+           (size_t)got - off);
+    if (ftruncate(fd, off) < 0)
+      perror("ftruncate");
+  }
+  if (state->in_progress)
+    printf("Журнал: прочитано записей %lu, игроков %d, следующий раунд %d\n",
+           count, state->player_count, state->next_round + 1);
+
+  free(data);
+  close(fd);
+  return 0;
+}
+
+void journal_state_free(JournalState *state) {
+  free(state->players);
+  state->players = NULL;
+  state->player_count = 0;
+}
+
+int journal_open(const char *path, int commit_ms, int fresh) {
+  int flags = O_WRONLY | O_CREAT | O_APPEND;
+  if (fresh)
+    flags |= O_TRUNC;
+  journal_fd = open(path, flags, 0644);
+  if (journal_fd < 0) {
+    perror("open journal");
+    return -1;
+  }
+  snprintf(journal_path, sizeof(journal_path), "%s", path);
+  commit_interval_ms = commit_ms;
+  last_commit_ms = now_ms();
+  journal_size = lseek(journal_fd, 0, SEEK_END);
+  return 0;
+}
+
+void journal_close(void) {
+  if (journal_fd < 0)
+    return;
+  journal_commit();
+  if (pending_len > 0)
+    printf("Журнал: %zu байт не записаны\n", pending_len);
+  close(journal_fd);
+  journal_fd = -1;
+  free(pending);
+  pending = NULL;
+  pending_len = pending_cap = 0;
+}
+
+void journal_commit(void) {
+  last_commit_ms = now_ms();
+  if (journal_fd < 0 || pending_len == 0)
+    return;
+  size_t done = 0;
+  while (done < pending_len) {
+    ssize_t n = write(journal_fd, pending + done, pending_len - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      break;
+    done += n;
+  }
+  journal_size += done;
+  if (done < pending_len) {
+    /* Only the first failure of a run is reported; the records wait for the
+     * next commit. */
+    if (!write_failing)
+      perror("write journal");
+    write_failing = 1;
+    journal_stats.write_errors++;
+    memmove(pending, pending + done, pending_len - done);
+    pending_len -= done;
+    return;
+  }
+  if (write_failing)
+    printf("Журнал снова записывается\n");
+  write_failing = 0;
+  pending_len = 0;
+
+  long long start = monotonic_us();
+  if (fdatasync(journal_fd) < 0)
+    perror("fdatasync");
+  long long spent = monotonic_us() - start;
+  journal_stats.sync_us_total += spent;
+  if (spent > journal_stats.sync_us_max)
+    journal_stats.sync_us_max = spent;
+  journal_stats.commits++;
+}
+
+void journal_tick(void) {
+  if (journal_fd < 0 || pending_len == 0)
+    return;
+  if (now_ms() - last_commit_ms >= commit_interval_ms)
+    journal_commit();
+}
+
+void journal_game_start(uint32_t seed) {
+  append(J_GAME_START, 0, 0, (int32_t)seed, 0, 0, 0, NULL);
+  journal_commit();
+}
+
+void journal_join(int id, const char *name) {
+  append(J_JOIN, id, 0, 0, 0, 0, 0, name);
+}
+
+void journal_leave(int id) { append(J_LEAVE, id, 0, 0, 0, 0, 0, NULL); }
+
+void journal_round_start(int round, int question) {
+  append(J_ROUND_START, 0, round, question, 0, 0, 0, NULL);
+}
+
+void journal_answer(int id, int round, int answer, int time_spent,
+                    int points) {
+  append(J_ANSWER, id, round, 0, answer, time_spent, points, NULL);
+}
+
+void journal_round_end(int round) {
+  append(J_ROUND_END, 0, round, 0, 0, 0, 0, NULL);
+  journal_commit();
+}
+
+void journal_game_end(void) {
+  append(J_GAME_END, 0, 0, 0, 0, 0, 0, NULL);
+  journal_commit();
+}
+
+void journal_maybe_compact(const JournalPlayer *players, int count,
+                           int next_round, uint32_t seed) {
+  if (journal_fd < 0 || journal_size < JOURNAL_COMPACT_BYTES)
+    return;
+  /* Records still waiting for a write would land after the snapshot and be
+   * counted twice. */
+  journal_commit();
+  if (pending_len > 0)
+    return;
+
+  char *buf = NULL;
+  size_t len = 0, cap = 0;
+  JournalRecord r;
+  memset(&r, 0, sizeof(r));
+  r.type = J_GAME_START;
+  r.question = (int32_t)seed;
+  encode(&buf, &len, &cap, &r, NULL);
+  for (int i = 0; i < count; i++) {
+    memset(&r, 0, sizeof(r));
+    r.type = J_SNAPSHOT;
+    r.player_id = players[i].id;
+    r.round = next_round;
+    r.points = players[i].score;
+    encode(&buf, &len, &cap, &r, players[i].name);
+  }
+
+  char tmp_path[JOURNAL_PATH_LEN + 8];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", journal_path);
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror("open snapshot");
+    free(buf);
+    return;
+  }
+  if (write_all(fd, buf, len) < 0 || fdatasync(fd) < 0 ||
+      rename(tmp_path, journal_path) < 0) {
+    perror("snapshot");
+    close(fd);
+    unlink(tmp_path);
+    free(buf);
+    return;
+  }
+  free(buf);
+
+  /* The rename itself has to reach the disk too. */
+  char dir_path[JOURNAL_PATH_LEN];
+  snprintf(dir_path, sizeof(dir_path), "%s", journal_path);
+  int dir_fd = open(dirname(dir_path), O_RDONLY);
+  if (dir_fd >= 0) {
+    fsync(dir_fd);
+    close(dir_fd);
+  }
+
+  close(journal_fd);
+  close(fd);
+  journal_fd = open(journal_path, O_WRONLY | O_APPEND);
+  if (journal_fd < 0)
+    perror("open journal");
+  journal_size = len;
+  journal_stats.compactions++;
+}
@@ -0,0 +1,98 @@
+#ifndef QUIZRUSH_JOURNAL_H
+#define QUIZRUSH_JOURNAL_H
+
+#include <stdint.h>
+
+#define JOURNAL_NAME_LEN 64
+#define JOURNAL_COMMIT_MS 200
+#define JOURNAL_COMPACT_BYTES (64 * 1024)
+
+enum {
+  J_GAME_START = 1,
+  J_JOIN,
+  J_LEAVE,
+  J_ROUND_START,
+  J_ANSWER,
+  J_ROUND_END,
+  J_SNAPSHOT,
+  J_GAME_END
+};
+
+/* On-disk record. Followed by name_len bytes of name for J_JOIN and
+ * J_SNAPSHOT. The checksum covers everything after itself, so a torn write
+ * at the tail is detected and cut off on recovery. */
+typedef struct {
+  uint32_t checksum;
+  uint8_t type;
+  uint8_t name_len;
+  uint16_t reserved;
+  int32_t player_id;
+  int32_t round;
+  int32_t question;
+  int32_t answer;
+  int32_t time_spent;
+  int32_t points;
+  int64_t ts_us;
+} JournalRecord;
+
+typedef struct {
+  int id;
+  char name[JOURNAL_NAME_LEN];
+  int score;
+  int round_points;
+} JournalPlayer;
+
+/* What was in the journal when the server started. */
+typedef struct {
+  int in_progress;
+  uint32_t seed; /* question selection seed of the game */
+  int next_round;
+  int max_id;
+  int player_count;
+  JournalPlayer *players;
+} JournalState;
+
+typedef struct {
+  unsigned long records;
+  unsigned long commits;
+  unsigned long compactions;
+  unsigned long write_errors; /* commits that left records in memory */
+  long long sync_us_total;    /* time the loop spent in fdatasync() */
+  long long sync_us_max;
+} JournalStats;
+
+extern JournalStats journal_stats;
+
+/* Rebuilds the state of an unfinished game. Returns -1 only if the file
+ * exists but can't be read; a missing file is an empty state. */
+int journal_recover(const char *path, JournalState *state);
+void journal_state_free(JournalState *state);
+
+/* Opens the journal for appending. With `fresh` the old contents (a finished
+ * game) are dropped. commit_ms is the group commit interval. */
+int journal_open(const char *path, int commit_ms, int fresh);
+void journal_close(void);
+
+void journal_game_start(uint32_t seed);
+void journal_join(int id, const char *name);
+void journal_leave(int id);
+void journal_round_start(int round, int question);
+void journal_answer(int id, int round, int answer, int time_spent,
+                    int points);
+void journal_round_end(int round);
+void journal_game_end(void);
+
+/* Records are buffered and written with one write() + fdatasync() per
+ * commit. journal_tick() commits when commit_ms has passed since the last
+ * one; round ends and game end commit right away. The sync runs on the event
+ * loop on purpose: a round isn't over before its answers are on disk. What
+ * isn't written stays buffered and goes with the next commit. */
+void journal_tick(void);
+void journal_commit(void);
+
+/* Replaces the journal with a snapshot of the current scores once it has
+ * grown past JOURNAL_COMPACT_BYTES, so recovery reads a bounded amount. */
+void journal_maybe_compact(const JournalPlayer *players, int count,
+                           int next_round, uint32_t seed);
+
+#endif
@@ -0,0 +1,51 @@
+#include "latency.h"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+int latency_rtt_us(int fd) {
+#ifdef TCP_INFO
+  struct tcp_info info;
+  socklen_t len = sizeof(info);
+  if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0)
+    return (int)info.tcpi_rtt;
+#else
+  (void)fd;
+#endif
+  return -1;
+}
+
+static int bucket_of(unsigned us) {
+  if (us < 8)
+    return us;
+  int msb = 31 - __builtin_clz(us);
+  return (msb - 2) * 8 + ((us >> (msb - 3)) & 7);
+}
+
+static unsigned bucket_value(int b) {
+  if (b < 8)
+    return b;
+  int msb = b / 8 + 2;
+  return (unsigned)(8 + b % 8) << (msb - 3);
+}
+
+void latency_record(LatencyHist *h, unsigned us) {
+  h->buckets[bucket_of(us)]++;
+  h->count++;
+  if (us > h->max_us)
+    h->max_us = us;
+}
+
+unsigned latency_percentile(const LatencyHist *h, double p) {
+  if (h->count == 0)
+    return 0;
+  unsigned long rank = (unsigned long)(p * (h->count - 1)) + 1;
+  unsigned long seen = 0;
+  for (int b = 0; b < LATENCY_BUCKETS; b++) {
+    seen += h->buckets[b];
+    if (seen >= rank)
+      return bucket_value(b);
+  }
+  return h->max_us;
+}
@@ -0,0 +1,24 @@
+#ifndef QUIZRUSH_LATENCY_H
+#define QUIZRUSH_LATENCY_H
+
+/* Log-linear buckets: values below 8 us are exact, above that every power of
+ * two is split in 8, so a bucket is within 12.5% of the value it holds. */
+#define LATENCY_BUCKETS 240
+
+typedef struct {
+  unsigned long count;
+  unsigned long buckets[LATENCY_BUCKETS];
+  unsigned max_us;
+} LatencyHist;
+
+/* Smoothed round-trip time of a TCP connection in microseconds, as the kernel
+ * keeps it from ACKs (TCP_INFO), or -1 if it isn't available. */
+int latency_rtt_us(int fd);
+
+void latency_record(LatencyHist *h, unsigned us);
+
+/* Value at fraction p (0..1) of the samples, in microseconds (lower edge of
+ * its bucket). */
+unsigned latency_percentile(const LatencyHist *h, double p);
+
+#endif
@@ -0,0 +1,263 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cluster.h"
+
+#define SERVER_PORT 5000
+#define BUFFER_SIZE 4096
+#define TAIL_LEN 64
+#define READY_PROMPT "'/ready'"
+#define ANSWER_PROMPT "Введите номер ответа"
+
+/* A bot is a client.c that types by itself: it joins as botN, sends /ready
+ * when asked and answers every question with a random option after up to
+ * `delay_ms` milliseconds. */
+typedef struct {
+  int sock;
+  int ready_sent;
+  long answer_at;
+  char tail[TAIL_LEN];
+  int tail_len;
+  int questions;
+} Bot;
+
+/* Question delivery: how long after the answer that closed the previous
+ * round each bot had the next question, from the second question on. The
+ * server pauses 5 s between rounds unless it runs with -R, so that is where
+ * the network part shows. */
+typedef struct {
+  long long last_sent_us;
+  long long *base_us; /* per question: last_sent_us when it first arrived */
+  int rounds;
+  long long *samples;
+  int count;
+  int cap;
+} Delivery;
+
+long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+long long now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void *grow_or_die(void *ptr, size_t size) {
+  void *p = realloc(ptr, size);
+  if (!p) {
+    perror("realloc");
+    exit(1);
+  }
+  return p;
+}
+
+void delivery_record(Delivery *d, Bot *bot) {
+  int q = bot->questions++;
+  if (q >= d->rounds) {
+    d->base_us = grow_or_die(d->base_us, (q + 1) * sizeof(long long));
+    for (; d->rounds <= q; d->rounds++)
+      d->base_us[d->rounds] = d->last_sent_us;
+  }
+  if (d->count == d->cap) {
+    d->cap = d->cap ? d->cap * 2 : 1024;
+    d->samples = grow_or_die(d->samples, d->cap * sizeof(long long));
+  }
+  if (q > 0)
+    d->samples[d->count++] = now_us() - d->base_us[q];
+}
+
+int compare_ll(const void *a, const void *b) {
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+void delivery_print(Delivery *d) {
+  if (d->count == 0)
+    return;
+  qsort(d->samples, d->count, sizeof(long long), compare_ll);
+  printf("Доставка вопроса (замеров %d): p50 %.2f мс, p99 %.2f мс, "
+         "макс %.2f мс\n",
+         d->count, d->samples[d->count / 2] / 1000.0,
+         d->samples[(int)(d->count * 0.99)] / 1000.0,
+         d->samples[d->count - 1] / 1000.0);
+}
+
+int connect_to(const char *host) {
+  struct addrinfo hints, *res, *rp;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  char port_str[16];
+  snprintf(port_str, sizeof(port_str), "%d", SERVER_PORT);
+  int err = getaddrinfo(host, port_str, &hints, &res);
+  if (err != 0) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
+    return -1;
+  }
+
+  int sock = -1;
+  for (rp = res; rp != NULL; rp = rp->ai_next) {
+    sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+    if (sock == -1)
+      continue;
+    if (connect(sock, rp->ai_addr, rp->ai_addrlen) == 0)
+      break;
+    close(sock);
+    sock = -1;
+  }
+  freeaddrinfo(res);
+  return sock;
+}
+
+/* Messages can be split across recv() calls, so prompts are searched in the
+ * previous tail plus the new chunk. */
+void scan_chunk(Bot *bot, const char *data, int n, int *saw_ready,
+                int *saw_question) {
+  char window[TAIL_LEN + BUFFER_SIZE + 1];
+  memcpy(window, bot->tail, bot->tail_len);
+  memcpy(window + bot->tail_len, data, n);
+  int len = bot->tail_len + n;
+  window[len] = '\0';
+
+  *saw_ready = strstr(window, READY_PROMPT) != NULL;
+  *saw_question = strstr(window, ANSWER_PROMPT) != NULL;
+
+  int keep = len < TAIL_LEN - 1 ? len : TAIL_LEN - 1;
+  /* A prompt we already reacted to must not match again next time. */
+  if (*saw_ready || *saw_question)
+    keep = 0;
+  memcpy(bot->tail, window + len - keep, keep);
+  bot->tail_len = keep;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    printf("Использование: %s <IP или hostname> <боты> [задержка_мс] "
+           "[комнат]\n",
+           argv[0]);
+    return 1;
+  }
+
+  int bot_count = atoi(argv[2]);
+  int delay_ms = argc > 3 ? atoi(argv[3]) : 500;
+  /* Through router.out the bots spread over rooms r1..rN. */
+  int room_count = argc > 4 ? atoi(argv[4]) : 0;
+  if (bot_count <= 0) {
+    printf("Количество ботов должно быть положительным\n");
+    return 1;
+  }
+
+  Bot *bots = calloc(bot_count, sizeof(Bot));
+  struct pollfd *fds = calloc(bot_count, sizeof(struct pollfd));
+  if (!bots || !fds) {
+    perror("calloc");
+    return 1;
+  }
+
+  srand(time(NULL));
+  long start = now_ms();
+  int alive = 0;
+
+  for (int i = 0; i < bot_count; i++) {
+    bots[i].sock = connect_to(argv[1]);
+    bots[i].answer_at = -1;
+    if (bots[i].sock < 0) {
+      perror("connect");
+      continue;
+    }
+    fcntl(bots[i].sock, F_SETFL, O_NONBLOCK);
+    char name[64];
+    if (room_count > 0)
+      snprintf(name, sizeof(name), CLUSTER_ROOM_PREFIX "r%d\nbot%d",
+               i % room_count + 1, i + 1);
+    else
+      snprintf(name, sizeof(name), "bot%d", i + 1);
+    send(bots[i].sock, name, strlen(name), 0);
+    alive++;
+  }
+  printf("Подключено ботов: %d/%d\n", alive, bot_count);
+
+  long answers = 0;
+  char buffer[BUFFER_SIZE];
+  Delivery delivery = {0};
+
+  while (alive > 0) {
+    long now = now_ms();
+    int timeout = 1000;
+    for (int i = 0; i < bot_count; i++) {
+      fds[i].fd = bots[i].sock;
+      fds[i].events = POLLIN;
+      if (bots[i].sock >= 0 && bots[i].answer_at >= 0) {
+        long wait = bots[i].answer_at - now;
+        if (wait < 0)
+          wait = 0;
+        if (wait < timeout)
+          timeout = (int)wait;
+      }
+    }
+
+    int ret = poll(fds, bot_count, timeout);
+    if (ret < 0 && errno != EINTR) {
+      perror("poll");
+      break;
+    }
+
+    now = now_ms();
+    for (int i = 0; i < bot_count; i++) {
+      Bot *bot = &bots[i];
+      if (bot->sock < 0)
+        continue;
+
+      if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+        int n = recv(bot->sock, buffer, sizeof(buffer) - 1, 0);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+          close(bot->sock);
+          bot->sock = -1;
+          alive--;
+          continue;
+        }
+        if (n > 0) {
+          int saw_ready, saw_question;
+          scan_chunk(bot, buffer, n, &saw_ready, &saw_question);
+          if (saw_ready && !bot->ready_sent) {
+            send(bot->sock, "/ready", 6, 0);
+            bot->ready_sent = 1;
+          }
+          if (saw_question) {
+            delivery_record(&delivery, bot);
+            bot->answer_at = now + (delay_ms > 0 ? rand() % delay_ms : 0);
+          }
+        }
+      }
+
+      if (bot->answer_at >= 0 && bot->answer_at <= now) {
+        char answer[2] = {'1' + rand() % 4, '\0'};
+        send(bot->sock, answer, 1, 0);
+        delivery.last_sent_us = now_us();
+        bot->answer_at = -1;
+        answers++;
+      }
+    }
+  }
+
+  printf("Ботов: %d, ответов отправлено: %ld, время: %.1f с\n", bot_count,
+         answers, (now_ms() - start) / 1000.0);
+  delivery_print(&delivery);
+
+  free(delivery.base_us);
+  free(delivery.samples);
+  free(bots);
+  free(fds);
+  return 0;
+}
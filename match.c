@@ -0,0 +1,326 @@
+#include "match.h"
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "latency.h"
+#include "net.h"
+#include "spectate.h"
+
+#define EVENTS_PER_WAIT 256
+
+typedef struct {
+  int sock;
+  int named;
+  int ready;
+  int picked; /* going into the game being forked */
+  int64_t ready_ns;
+  char name[MATCH_NAME_LEN];
+} Waiting;
+
+static volatile sig_atomic_t stop = 0;
+
+/* Queued players in a dense array; slot_of maps a socket back to its place so
+ * a leaving player is swapped with the last one. */
+static Waiting *waiting = NULL;
+static int waiting_count = 0;
+static int waiting_cap = 0;
+static int *slot_of = NULL;
+static int slot_of_len = 0;
+
+/* Sockets of the ready players, oldest first. Games start as soon as enough
+ * of them are ready, so the list stays about one game long. */
+static int *ready_q = NULL;
+static int ready_count = 0;
+
+static LatencyHist queue_wait;
+static unsigned long games_started = 0;
+static unsigned long games_finished = 0;
+static unsigned long games_failed = 0;
+static unsigned long players_matched = 0;
+static int games_running = 0;
+static int games_peak = 0;
+static int64_t first_ready_ns = 0;
+static int64_t last_start_ns = 0;
+
+static void on_sigint() { stop = 1; }
+
+static void *xrealloc(void *ptr, size_t size) {
+  void *p = realloc(ptr, size);
+  if (!p) {
+    perror("realloc");
+    exit(1);
+  }
+  return p;
+}
+
+static int64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void reply(int fd, const char *msg) { net_send(fd, msg, strlen(msg)); }
+
+static Waiting *find_waiting(int fd) {
+  if (fd < 0 || fd >= slot_of_len || slot_of[fd] < 0)
+    return NULL;
+  return &waiting[slot_of[fd]];
+}
+
+static void add_waiting(int fd) {
+  if (fd >= slot_of_len) {
+    int len = slot_of_len ? slot_of_len : 1024;
+    while (len <= fd)
+      len *= 2;
+    slot_of = xrealloc(slot_of, len * sizeof(int));
+    for (int i = slot_of_len; i < len; i++)
+      slot_of[i] = -1;
+    slot_of_len = len;
+  }
+  if (waiting_count == waiting_cap) {
+    waiting_cap = waiting_cap ? waiting_cap * 2 : 1024;
+    waiting = xrealloc(waiting, waiting_cap * sizeof(Waiting));
+    ready_q = xrealloc(ready_q, waiting_cap * sizeof(int));
+  }
+  Waiting *w = &waiting[waiting_count];
+  memset(w, 0, sizeof(*w));
+  w->sock = fd;
+  slot_of[fd] = waiting_count++;
+}
+
+static void remove_waiting(int fd) {
+  Waiting *w = find_waiting(fd);
+  if (!w)
+    return;
+  if (w->ready) {
+    int i = 0;
+    while (ready_q[i] != fd)
+      i++;
+    memmove(ready_q + i, ready_q + i + 1,
+            (ready_count - i - 1) * sizeof(int));
+    ready_count--;
+  }
+  int slot = slot_of[fd];
+  waiting[slot] = waiting[--waiting_count];
+  slot_of[waiting[slot].sock] = slot;
+  slot_of[fd] = -1;
+}
+
+static void drop(int fd, const char *msg) {
+  if (msg)
+    reply(fd, msg);
+  remove_waiting(fd);
+  net_close(fd);
+}
+
+static void on_message(Waiting *w, const char *data, int game_size) {
+  char buf[MATCH_NAME_LEN];
+  snprintf(buf, sizeof(buf), "%s", data);
+  buf[strcspn(buf, "\r\n")] = '\0';
+
+  if (!w->named) {
+    /* A game lives in its own process, which the queue can't reach. */
+    if (strcmp(buf, SPECTATE_HELLO) == 0) {
+      drop(w->sock, "Зрители в режиме подбора игр не поддерживаются.\n");
+      return;
+    }
+    if (strncmp(buf, "/resume", 7) == 0) {
+      drop(w->sock, "Сессия не найдена или истекла.\n");
+      return;
+    }
+    snprintf(w->name, sizeof(w->name), "%s", buf);
+    w->named = 1;
+    char msg[256];
+    snprintf(msg, sizeof(msg),
+             "Вы в очереди, %s! Для подтверждения готовности введите "
+             "комманду '/ready'\n",
+             w->name);
+    reply(w->sock, msg);
+    return;
+  }
+
+  if (strcmp(buf, "/ready") == 0 && !w->ready) {
+    w->ready = 1;
+    w->ready_ns = now_ns();
+    if (first_ready_ns == 0)
+      first_ready_ns = w->ready_ns;
+    ready_q[ready_count++] = w->sock;
+    char msg[128];
+    snprintf(msg, sizeof(msg), "Ищем игру: готовы %d из %d...\n",
+             ready_count < game_size ? ready_count : game_size, game_size);
+    reply(w->sock, msg);
+  }
+}
+
+static void reap(void) {
+  int status;
+  while (waitpid(-1, &status, WNOHANG) > 0) {
+    games_running--;
+    games_finished++;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      games_failed++;
+  }
+}
+
+/* Forks the k oldest ready players into a game. The queue stops reading their
+ * sockets first, so nothing they send is taken by this process. */
+static int start_game(int k, int listen_fd, MatchPlayer **players) {
+  MatchPlayer *game = xrealloc(NULL, k * sizeof(MatchPlayer));
+  int64_t now = now_ns();
+  int64_t longest = 0;
+  for (int i = 0; i < k; i++) {
+    Waiting *w = find_waiting(ready_q[i]);
+    w->picked = 1;
+    game[i].sock = w->sock;
+    memcpy(game[i].name, w->name, sizeof(game[i].name));
+    if (now - w->ready_ns > longest)
+      longest = now - w->ready_ns;
+    net_unwatch(w->sock);
+  }
+
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    for (int i = 0; i < k; i++) {
+      find_waiting(game[i].sock)->picked = 0;
+      net_watch(game[i].sock);
+    }
+    free(game);
+    return -1;
+  }
+
+  if (pid == 0) {
+    /* The ring and the buffers of the queue belong to the parent: only close
+     * what this process holds, without submitting anything. */
+    for (int i = 0; i < waiting_count; i++) {
+      if (!waiting[i].picked)
+        close(waiting[i].sock);
+    }
+    net_shutdown();
+    memset(&net_stats, 0, sizeof(net_stats));
+    close(listen_fd);
+    free(waiting);
+    free(slot_of);
+    free(ready_q);
+    signal(SIGINT, SIG_DFL);
+    *players = game;
+    return 0;
+  }
+
+  for (int i = 0; i < k; i++) {
+    Waiting *w = find_waiting(game[i].sock);
+    latency_record(&queue_wait, (unsigned)((now - w->ready_ns) / 1000));
+    remove_waiting(game[i].sock);
+    net_close(game[i].sock);
+  }
+  free(game);
+  games_started++;
+  players_matched += k;
+  last_start_ns = now;
+  if (++games_running > games_peak)
+    games_peak = games_running;
+  printf("Игра %lu (pid %d): игроков %d, дольше всех ждал %.0f мс\n",
+         games_started, (int)pid, k, longest / 1e6);
+  return pid;
+}
+
+/* Until the oldest ready player runs out of patience, at most a second. */
+static int next_timeout(int game_size, int wait_ms) {
+  if (ready_count == 0 || ready_count >= game_size)
+    return ready_count ? 0 : 1000;
+  int64_t oldest = find_waiting(ready_q[0])->ready_ns;
+  int64_t left = (oldest + (int64_t)wait_ms * 1000000 - now_ns()) / 1000000;
+  if (left < 0)
+    return 0;
+  return left < 1000 ? (int)left + 1 : 1000;
+}
+
+static void print_match_stats(void) {
+  printf("\nПодбор игр: начато %lu, завершено %lu (с ошибкой %lu), идёт %d, "
+         "максимум одновременно %d\n",
+         games_started, games_finished, games_failed, games_running,
+         games_peak);
+  if (games_started > 0)
+    printf("Игроков в играх: %lu, в среднем %.1f на игру\n", players_matched,
+           (double)players_matched / games_started);
+  double span = (last_start_ns - first_ready_ns) / 1e9;
+  if (games_started > 1 && span > 0)
+    printf("Игр в секунду: %.1f (от первого '/ready' до последнего старта "
+           "%.2f с)\n",
+           games_started / span, span);
+  if (queue_wait.count > 0)
+    printf("Ожидание в очереди (замеров %lu): p50 %.2f мс, p90 %.2f мс, "
+           "p99 %.2f мс, макс %.2f мс\n",
+           queue_wait.count, latency_percentile(&queue_wait, 0.5) / 1000.0,
+           latency_percentile(&queue_wait, 0.9) / 1000.0,
+           latency_percentile(&queue_wait, 0.99) / 1000.0,
+           queue_wait.max_us / 1000.0);
+  printf("Ввод-вывод очереди (%s): системных вызовов %lu, пробуждений %lu, "
+         "accept %lu\n",
+         net_backend_name(), net_stats.syscalls, net_stats.wakeups,
+         net_stats.accepts);
+}
+
+int match_serve(int listen_fd, int backend, int game_size, int wait_ms,
+                MatchPlayer **players, int *game_no) {
+  signal(SIGINT, on_sigint);
+  net_init(backend, listen_fd);
+  printf("Подбор игр (%s): по %d игроков, ожидание не дольше %d мс\n",
+         net_backend_name(), game_size, wait_ms);
+  fflush(stdout);
+
+  NetEvent events[EVENTS_PER_WAIT];
+  while (!stop) {
+    reap();
+    int n =
+        net_wait(events, EVENTS_PER_WAIT, next_timeout(game_size, wait_ms));
+    for (int i = 0; i < n; i++) {
+      NetEvent *ev = &events[i];
+      if (ev->type == NET_EV_ACCEPT) {
+        add_waiting(ev->fd);
+        net_watch(ev->fd);
+        continue;
+      }
+      Waiting *w = find_waiting(ev->fd);
+      if (!w)
+        continue;
+      if (ev->type == NET_EV_CLOSED)
+        drop(ev->fd, NULL);
+      else
+        on_message(w, ev->data, game_size);
+    }
+
+    while (ready_count > 0) {
+      int k = ready_count < game_size ? ready_count : game_size;
+      int64_t oldest = find_waiting(ready_q[0])->ready_ns;
+      if (k < game_size && now_ns() - oldest < (int64_t)wait_ms * 1000000)
+        break;
+      *game_no = (int)games_started + 1;
+      int pid = start_game(k, listen_fd, players);
+      if (pid == 0)
+        return k;
+      if (pid < 0)
+        break;
+    }
+    fflush(stdout);
+  }
+
+  reap();
+  print_match_stats();
+  for (int i = 0; i < waiting_count; i++)
+    net_close(waiting[i].sock);
+  free(waiting);
+  free(slot_of);
+  free(ready_q);
+  net_shutdown();
+  close(listen_fd);
+  return 0;
+}
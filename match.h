@@ -0,0 +1,27 @@
+#ifndef QUIZRUSH_MATCH_H
+#define QUIZRUSH_MATCH_H
+
+#define MATCH_NAME_LEN 50
+#define MATCH_WAIT_MS 5000
+
+/* A queued player handed to a game: the socket stays open, the name is as
+ * typed (the game still makes it unique). */
+typedef struct {
+  int sock;
+  char name[MATCH_NAME_LEN];
+} MatchPlayer;
+
+/* Runs the matchmaking front end on listen_fd until SIGINT. Players join the
+ * queue with their name and '/ready'; as soon as game_size of them are ready,
+ * or the first of the ready ones has waited wait_ms, they are forked off into
+ * a game of their own and the queue goes on.
+ *
+ * Returns twice, like fork(): 0 in the front end once it is stopped (after
+ * printing its stats), and the number of players in a game's child process.
+ * The child gets its players (malloc'ed) and the game's number; its network
+ * layer is shut down and listen_fd closed, so it starts with net_init(..., -1).
+ */
+int match_serve(int listen_fd, int backend, int game_size, int wait_ms,
+                MatchPlayer **players, int *game_no);
+
+#endif
@@ -0,0 +1,503 @@
+#include "net.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "net_uring.h"
+
+NetStats net_stats;
+
+static int backend = NET_BACKEND_POLL;
+static int listen_sock = -1;
+
+/* poll() backend: the watched sockets live in a dense array, slot_of maps an
+ * fd back to its position so removal is a swap with the last one. */
+static int *watched = NULL;
+static int watched_count = 0;
+static int watched_cap = 0;
+static int *slot_of = NULL;
+static int slot_of_len = 0;
+static struct pollfd *pfds = NULL;
+static int pfds_cap = 0;
+/* Where the next recv pass starts, so with more ready sockets than room for
+ * events the same ones don't win every time. */
+static int poll_next = 0;
+
+/* Events handed over from the previous server process or held back by the
+ * read budget, returned by the next net_wait() before anything new. */
+static NetEvent *carried = NULL;
+static int carried_count = 0;
+static int carried_pos = 0;
+static int carried_cap = 0;
+
+static NetLimits limits = {
+    NET_LIMIT_MSGS,
+    NET_LIMIT_MSGS * 2,
+    NET_LIMIT_MSGS * NET_LIMIT_BYTES_PER_MSG,
+    NET_LIMIT_MSGS * 2 * NET_LIMIT_BYTES_PER_MSG,
+    NET_READ_BUDGET,
+    NET_MAX_STRIKES,
+};
+
+static NetTuning tuning;
+static int holding = 0;
+
+/* Input accounting per fd; refill_ns 0 means not in use yet. */
+typedef struct {
+  double msgs;
+  double bytes;
+  int64_t refill_ns;
+  int64_t paused_until_ns;
+  int64_t last_strike_ns;
+  int strikes;
+  int kicked;
+  unsigned epoch;
+  int reads;
+} Limiter;
+
+static Limiter *limiters = NULL;
+static int limiters_len = 0;
+static int *paused = NULL;
+static int paused_count = 0;
+static int paused_cap = 0;
+static unsigned wait_epoch = 0;
+
+static void *grow(void *ptr, int *cap, int need, size_t elem) {
+  if (need <= *cap)
+    return ptr;
+  int new_cap = *cap ? *cap : 16;
+  while (new_cap < need)
+    new_cap *= 2;
+  void *p = realloc(ptr, new_cap * elem);
+  if (!p) {
+    perror("realloc");
+    exit(1);
+  }
+  *cap = new_cap;
+  return p;
+}
+
+static int64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static Limiter *limiter(int fd) {
+  if (fd < 0)
+    return NULL;
+  if (fd >= limiters_len) {
+    int old = limiters_len;
+    limiters = grow(limiters, &limiters_len, fd + 1, sizeof(Limiter));
+    memset(limiters + old, 0, (limiters_len - old) * sizeof(Limiter));
+  }
+  return &limiters[fd];
+}
+
+static int is_paused(int fd) {
+  return fd < limiters_len && limiters[fd].paused_until_ns > 0;
+}
+
+static void poll_watch(int fd) {
+  if (fd >= slot_of_len) {
+    int old = slot_of_len;
+    slot_of = grow(slot_of, &slot_of_len, fd + 1, sizeof(int));
+    for (int i = old; i < slot_of_len; i++)
+      slot_of[i] = -1;
+  }
+  if (slot_of[fd] >= 0)
+    return;
+  watched = grow(watched, &watched_cap, watched_count + 1, sizeof(int));
+  slot_of[fd] = watched_count;
+  watched[watched_count++] = fd;
+}
+
+static void poll_unwatch(int fd) {
+  if (fd < 0 || fd >= slot_of_len || slot_of[fd] < 0)
+    return;
+  int slot = slot_of[fd];
+  int last = watched[--watched_count];
+  watched[slot] = last;
+  slot_of[last] = slot;
+  slot_of[fd] = -1;
+}
+
+static int poll_wait(NetEvent *events, int max, int timeout_ms) {
+  pfds = grow(pfds, &pfds_cap, watched_count + 1, sizeof(struct pollfd));
+  int nfds = 0;
+  pfds[nfds].fd = listen_sock;
+  pfds[nfds].events = POLLIN;
+  nfds++;
+  for (int i = 0; i < watched_count; i++) {
+    if (is_paused(watched[i]))
+      continue;
+    pfds[nfds].fd = watched[i];
+    pfds[nfds].events = POLLIN;
+    nfds++;
+  }
+
+  net_stats.syscalls++;
+  net_stats.wakeups++;
+  int ready = poll(pfds, nfds, timeout_ms);
+  if (ready < 0) {
+    if (errno != EINTR)
+      perror("poll");
+    return 0;
+  }
+
+  int count = 0;
+  if (pfds[0].revents & POLLIN) {
+    while (count < max) {
+      struct sockaddr_storage addr;
+      socklen_t addr_len = sizeof(addr);
+      net_stats.syscalls++;
+      int sock = accept(listen_sock, (struct sockaddr *)&addr, &addr_len);
+      if (sock < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+          perror("accept");
+        break;
+      }
+      fcntl(sock, F_SETFL, O_NONBLOCK);
+      net_stats.accepts++;
+      events[count].type = NET_EV_ACCEPT;
+      events[count].fd = sock;
+      events[count].len = 0;
+      count++;
+    }
+  }
+
+  int conns = nfds - 1;
+  int start = conns > 0 ? poll_next % conns : 0;
+  for (int k = 0; k < conns && count < max; k++) {
+    int i = 1 + (start + k) % conns;
+    poll_next = start + k + 1;
+    if (!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+      continue;
+    NetEvent *ev = &events[count];
+    net_stats.syscalls++;
+    int n = recv(pfds[i].fd, ev->data, sizeof(ev->data) - 1, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+      continue;
+    ev->fd = pfds[i].fd;
+    if (n > 0) {
+      net_stats.recvs++;
+      ev->type = NET_EV_DATA;
+      ev->len = n;
+      ev->data[n] = '\0';
+    } else {
+      if (n < 0)
+        perror("recv");
+      ev->type = NET_EV_CLOSED;
+      ev->len = 0;
+      ev->data[0] = '\0';
+      poll_unwatch(ev->fd);
+    }
+    count++;
+  }
+  return count;
+}
+
+int net_init(int requested, int listen_fd) {
+  listen_sock = listen_fd;
+  backend = NET_BACKEND_POLL;
+  if (requested == NET_BACKEND_URING) {
+    if (net_uring_init(listen_fd) == 0)
+      backend = NET_BACKEND_URING;
+    else
+      printf("io_uring недоступен, используется poll()\n");
+  }
+  return backend;
+}
+
+void net_shutdown(void) {
+  if (backend == NET_BACKEND_URING)
+    net_uring_shutdown();
+  free(watched);
+  free(slot_of);
+  free(pfds);
+  free(carried);
+  free(limiters);
+  free(paused);
+  watched = NULL;
+  slot_of = NULL;
+  pfds = NULL;
+  carried = NULL;
+  limiters = NULL;
+  paused = NULL;
+  carried_count = carried_pos = carried_cap = 0;
+  watched_count = watched_cap = slot_of_len = pfds_cap = 0;
+  limiters_len = paused_count = paused_cap = 0;
+}
+
+const char *net_backend_name(void) {
+  return backend == NET_BACKEND_URING ? "io_uring" : "poll";
+}
+
+void net_watch(int fd) {
+  if (backend == NET_BACKEND_URING)
+    net_uring_watch(fd);
+  else
+    poll_watch(fd);
+}
+
+void net_unwatch(int fd) {
+  if (backend == NET_BACKEND_URING)
+    net_uring_unwatch(fd);
+  else
+    poll_unwatch(fd);
+}
+
+void net_close(int fd) {
+  if (fd < 0)
+    return;
+  net_unwatch(fd);
+  if (fd < limiters_len)
+    limiters[fd].refill_ns = 0;
+  /* Held back chunks must not reach whoever gets the fd number next. */
+  int kept = carried_pos;
+  for (int i = carried_pos; i < carried_count; i++)
+    if (carried[i].fd != fd || carried[i].type == NET_EV_ACCEPT)
+      carried[kept++] = carried[i];
+  carried_count = kept;
+  close(fd);
+}
+
+void net_set_limits(const NetLimits *l) { limits = *l; }
+
+void net_set_tuning(const NetTuning *t) { tuning = *t; }
+
+/* Clears the setting when the kernel refuses it, since the same error
+ * would follow for every connection. */
+static void set_option(int fd, int level, int name, int *setting,
+                       const char *what) {
+  net_stats.syscalls++;
+  if (setsockopt(fd, level, name, setting, sizeof(*setting)) < 0) {
+    perror(what);
+    *setting = 0;
+  }
+}
+
+static void tune(int fd) {
+  if (tuning.nodelay)
+    set_option(fd, IPPROTO_TCP, TCP_NODELAY, &tuning.nodelay, "TCP_NODELAY");
+  if (tuning.busy_poll_us > 0)
+    set_option(fd, SOL_SOCKET, SO_BUSY_POLL, &tuning.busy_poll_us,
+               "SO_BUSY_POLL");
+  if (tuning.sndbuf > 0)
+    set_option(fd, SOL_SOCKET, SO_SNDBUF, &tuning.sndbuf, "SO_SNDBUF");
+}
+
+static void carry(const NetEvent *ev) {
+  if (carried_pos > 0 && carried_count == carried_cap) {
+    memmove(carried, carried + carried_pos,
+            (carried_count - carried_pos) * sizeof(NetEvent));
+    carried_count -= carried_pos;
+    carried_pos = 0;
+  }
+  carried = grow(carried, &carried_cap, carried_count + 1, sizeof(NetEvent));
+  carried[carried_count++] = *ev;
+}
+
+static void pause_reading(int fd, Limiter *l, int64_t now) {
+  double msg_wait = (limits.msg_burst / 2.0 - l->msgs) / limits.msgs_per_sec;
+  double byte_wait =
+      (limits.byte_burst / 2.0 - l->bytes) / limits.bytes_per_sec;
+  double wait = msg_wait > byte_wait ? msg_wait : byte_wait;
+  l->paused_until_ns = now + (int64_t)(wait * 1e9) + 1;
+  paused = grow(paused, &paused_cap, paused_count + 1, sizeof(int));
+  paused[paused_count++] = fd;
+  if (backend == NET_BACKEND_URING)
+    net_uring_pause(fd);
+  net_stats.paused++;
+}
+
+static void wake_paused(int64_t now) {
+  for (int i = 0; i < paused_count; i++) {
+    int fd = paused[i];
+    Limiter *l = &limiters[fd];
+    if (l->paused_until_ns > now)
+      continue;
+    if (l->paused_until_ns > 0 && !l->kicked &&
+        backend == NET_BACKEND_URING)
+      net_uring_unpause(fd);
+    l->paused_until_ns = 0;
+    paused[i--] = paused[--paused_count];
+  }
+}
+
+/* Shortens a wait so paused sockets are picked up again on time. */
+static int pause_timeout(int timeout_ms, int64_t now) {
+  for (int i = 0; i < paused_count; i++) {
+    int64_t left = limiters[paused[i]].paused_until_ns - now;
+    int ms = left > 0 ? (int)((left + 999999) / 1000000) : 0;
+    if (timeout_ms < 0 || ms < timeout_ms)
+      timeout_ms = ms;
+  }
+  return timeout_ms;
+}
+
+static void kick(int fd, Limiter *l, NetEvent *ev) {
+  const char *msg = "Слишком много сообщений, соединение закрыто.\n";
+  send(fd, msg, strlen(msg), MSG_DONTWAIT | MSG_NOSIGNAL);
+  shutdown(fd, SHUT_RDWR);
+  net_unwatch(fd);
+  l->kicked = 1;
+  net_stats.kicked++;
+  ev->type = NET_EV_CLOSED;
+  ev->len = 0;
+  ev->data[0] = '\0';
+}
+
+/* Token buckets for one chunk: 1 keeps it, 0 drops it. A drop pauses the
+ * socket and counts a strike; too many strikes turn the chunk into a
+ * NET_EV_CLOSED for a connection we have shut down. */
+static int admit(NetEvent *ev, Limiter *l, int64_t now) {
+  double dt = (now - l->refill_ns) / 1e9;
+  l->refill_ns = now;
+  l->msgs += dt * limits.msgs_per_sec;
+  l->bytes += dt * limits.bytes_per_sec;
+  if (l->msgs > limits.msg_burst)
+    l->msgs = limits.msg_burst;
+  if (l->bytes > limits.byte_burst)
+    l->bytes = limits.byte_burst;
+  if (l->msgs >= 1 && l->bytes >= ev->len) {
+    l->msgs -= 1;
+    l->bytes -= ev->len;
+    return 1;
+  }
+
+  net_stats.throttled++;
+  if (l->paused_until_ns > 0)
+    return 0;
+  if (now - l->last_strike_ns > (int64_t)NET_STRIKE_RESET_SEC * 1000000000)
+    l->strikes = 0;
+  l->last_strike_ns = now;
+  if (++l->strikes > limits.max_strikes) {
+    kick(ev->fd, l, ev);
+    return 1;
+  }
+  pause_reading(ev->fd, l, now);
+  return 0;
+}
+
+/* Applies the socket options to new connections and the read budget and the
+ * token buckets to what the backend returned, in place. The first `held`
+ * events were held back before and aren't counted as deferred again. */
+static int police(NetEvent *events, int n, int held, int64_t now) {
+  wait_epoch++;
+  int kept = 0;
+  for (int i = 0; i < n; i++) {
+    NetEvent *ev = &events[i];
+    Limiter *l = limiter(ev->fd);
+    if (!l)
+      continue;
+    if (ev->type == NET_EV_ACCEPT || l->refill_ns == 0) {
+      memset(l, 0, sizeof(*l));
+      l->msgs = limits.msg_burst;
+      l->bytes = limits.byte_burst;
+      l->refill_ns = now;
+    }
+    if (ev->type == NET_EV_ACCEPT) {
+      tune(ev->fd);
+      events[kept++] = *ev;
+      continue;
+    }
+    if (l->kicked)
+      continue;
+    if (l->epoch != wait_epoch) {
+      l->epoch = wait_epoch;
+      l->reads = 0;
+    }
+    /* Once a socket is over budget everything after it waits too, a close
+     * included, so its events stay in order. */
+    if (limits.read_budget > 0 && l->reads >= limits.read_budget) {
+      carry(ev);
+      if (i >= held)
+        net_stats.deferred++;
+      continue;
+    }
+    l->reads++;
+    if (ev->type == NET_EV_DATA && limits.msgs_per_sec > 0 &&
+        !admit(ev, l, now))
+      continue;
+    events[kept++] = *ev;
+  }
+  return kept;
+}
+
+int net_wait(NetEvent *events, int max, int timeout_ms) {
+  int64_t now = now_ns();
+  wake_paused(now);
+
+  int count = 0;
+  while (carried_pos < carried_count && count < max)
+    events[count++] = carried[carried_pos++];
+  if (carried_pos == carried_count)
+    carried_pos = carried_count = 0;
+  int held = count;
+  /* Held back events don't stop the backend from being asked, without
+   * waiting, for what the other sockets have. */
+  if (count < max) {
+    int wait = count > 0 ? 0 : pause_timeout(timeout_ms, now);
+    if (backend == NET_BACKEND_URING)
+      count += net_uring_wait(events + count, max - count, wait);
+    else
+      count += poll_wait(events + count, max - count, wait);
+  }
+  return police(events, count, held, now_ns());
+}
+
+ssize_t net_send(int fd, const void *buf, size_t len) {
+  ssize_t res;
+  net_send_many(&fd, 1, buf, len, &res);
+  return res;
+}
+
+void net_hold(int on) { holding = on && tuning.coalesce; }
+
+void net_send_many_timed(const int *fds, int n, const void *buf, size_t len,
+                         ssize_t *res, int64_t *sent_ns) {
+  int flags = holding ? MSG_MORE : 0;
+  if (backend == NET_BACKEND_URING) {
+    net_uring_send_many(fds, n, buf, len, flags, res, sent_ns);
+    return;
+  }
+  for (int i = 0; i < n; i++) {
+    net_stats.syscalls++;
+    net_stats.sends++;
+    res[i] = send(fds[i], buf, len, flags);
+    if (sent_ns)
+      sent_ns[i] = now_ns();
+  }
+}
+
+void net_send_many(const int *fds, int n, const void *buf, size_t len,
+                   ssize_t *res) {
+  net_send_many_timed(fds, n, buf, len, res, NULL);
+}
+
+int net_detach(NetEvent **leftover) {
+  if (backend == NET_BACKEND_URING)
+    return net_uring_detach(leftover);
+  *leftover = NULL;
+  return 0;
+}
+
+void net_resume(void) {
+  if (backend == NET_BACKEND_URING)
+    net_uring_resume();
+}
+
+void net_inject(const NetEvent *events, int n) {
+  for (int i = 0; i < n; i++)
+    carry(&events[i]);
+}
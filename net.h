@@ -0,0 +1,120 @@
+#ifndef QUIZRUSH_NET_H
+#define QUIZRUSH_NET_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define NET_RECV_LEN 64
+
+/* Default input limits per connection. A player sends a name, /ready and
+ * one short answer per round, so real traffic stays far below them. */
+#define NET_LIMIT_MSGS 20
+#define NET_LIMIT_BYTES_PER_MSG 16
+#define NET_READ_BUDGET 4
+#define NET_MAX_STRIKES 5
+#define NET_STRIKE_RESET_SEC 10
+
+enum { NET_BACKEND_POLL, NET_BACKEND_URING };
+
+enum { NET_EV_ACCEPT, NET_EV_DATA, NET_EV_CLOSED };
+
+/* One thing that happened on a socket. For NET_EV_DATA `data` holds a single
+ * received chunk (what one recv() would have returned), NUL-terminated. */
+typedef struct {
+  int type;
+  int fd;
+  int len;
+  char data[NET_RECV_LEN];
+} NetEvent;
+
+typedef struct {
+  unsigned long syscalls;
+  unsigned long accepts;
+  unsigned long recvs;
+  unsigned long sends;
+  unsigned long wakeups;
+  unsigned long throttled; /* chunks dropped over a token bucket */
+  unsigned long paused;    /* times a socket stopped being read */
+  unsigned long deferred;  /* chunks moved to the next wakeup by the budget */
+  unsigned long kicked;    /* connections dropped for flooding */
+} NetStats;
+
+/* Token buckets per connection, checked in net_wait() for every received
+ * chunk: msgs_per_sec chunks and bytes_per_sec bytes, with bursts of
+ * msg_burst and byte_burst. A chunk over either bucket is dropped and the
+ * socket isn't read until the buckets are half full again, so a flooding
+ * client waits in its own TCP window instead of in our loop. max_strikes
+ * such pauses without NET_STRIKE_RESET_SEC of quiet in between close the
+ * connection. read_budget caps the chunks one socket gets per net_wait();
+ * the rest wait for the next call. msgs_per_sec 0 turns the buckets off. */
+typedef struct {
+  int msgs_per_sec;
+  int msg_burst;
+  int bytes_per_sec;
+  int byte_burst;
+  int read_budget;
+  int max_strikes;
+} NetLimits;
+
+/* Socket options for accepted connections. nodelay turns Nagle off, which
+ * alone would put every message in its own segment; coalesce makes the
+ * sends between net_hold(1) and net_hold(0) go out with MSG_MORE so one
+ * logical update still leaves as one segment. busy_poll_us (SO_BUSY_POLL)
+ * and sndbuf (SO_SNDBUF) are left to the kernel when 0. */
+typedef struct {
+  int nodelay;
+  int coalesce;
+  int busy_poll_us;
+  int sndbuf;
+} NetTuning;
+
+extern NetStats net_stats;
+
+/* Picks the backend and starts accepting on listen_fd (-1: none, only the
+ * sockets given to net_watch()). Returns the backend actually in use: asking
+ * for io_uring on a kernel without it falls back to poll(). */
+int net_init(int backend, int listen_fd);
+void net_shutdown(void);
+const char *net_backend_name(void);
+
+void net_set_limits(const NetLimits *limits);
+void net_set_tuning(const NetTuning *tuning);
+
+/* Start/stop delivering NET_EV_DATA for a connected socket. net_close() also
+ * closes it; always use it instead of close() for watched sockets. */
+void net_watch(int fd);
+void net_unwatch(int fd);
+void net_close(int fd);
+
+/* Waits up to timeout_ms and fills at most max events. Returns the number of
+ * events, 0 on timeout. */
+int net_wait(NetEvent *events, int max, int timeout_ms);
+
+ssize_t net_send(int fd, const void *buf, size_t len);
+
+/* Marks the start (1) and the last send (0) of an update made of several
+ * messages. The send after net_hold(0) pushes everything out. */
+void net_hold(int on);
+
+/* Sends the same buffer to n sockets, result of each send goes to res[i].
+ * With io_uring this is one submission for the whole fan-out. */
+void net_send_many(const int *fds, int n, const void *buf, size_t len,
+                   ssize_t *res);
+
+/* The same, also storing in sent_ns[i] the CLOCK_MONOTONIC time the send to
+ * fds[i] returned. io_uring runs a batch of sends in one system call, so
+ * those share the time it returned. */
+void net_send_many_timed(const int *fds, int n, const void *buf, size_t len,
+                         ssize_t *res, int64_t *sent_ns);
+
+/* Live upgrade. net_detach() stops all receiving so no more bytes leave the
+ * sockets; events the backend already took from the kernel are returned in
+ * *leftover (valid until the next net call) and have to be handed to the new
+ * process, which feeds them back with net_inject(). net_resume() undoes a
+ * detach if the handoff failed. */
+int net_detach(NetEvent **leftover);
+void net_resume(void);
+void net_inject(const NetEvent *events, int n);
+
+#endif
@@ -0,0 +1,571 @@
+#include "net_uring.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RING_ENTRIES 4096
+#define BUF_COUNT 4096
+#define BUF_SIZE (NET_RECV_LEN - 1)
+#define BUF_GROUP 0
+
+/* user_data layout: kind in the top byte, then a 24-bit generation of the fd
+ * (so completions of a cancelled recv on a reused fd number are dropped), then
+ * the fd or, for sends, the index into the caller's result array. */
+enum { UD_IGNORE, UD_ACCEPT, UD_RECV, UD_SEND };
+#define UD(kind, gen, val)                                                     \
+  (((uint64_t)(kind) << 56) | ((uint64_t)((gen) & 0xffffff) << 32) |          \
+   (uint32_t)(val))
+#define UD_KIND(ud) ((int)((ud) >> 56))
+#define UD_GEN(ud) ((unsigned)(((ud) >> 32) & 0xffffff))
+#define UD_VAL(ud) ((int)(uint32_t)(ud))
+
+static int ring_fd = -1;
+static int listen_sock = -1;
+
+static void *sq_ptr, *cq_ptr;
+static size_t sq_size, cq_size, sqes_size;
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, sq_entries;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_sqe *sqes;
+static struct io_uring_cqe *cqes;
+static unsigned sq_pending = 0;
+
+static struct io_uring_buf_ring *buf_ring;
+static size_t buf_ring_size;
+static char *buf_mem;
+static unsigned short buf_tail;
+
+/* Per-fd state, indexed by fd. */
+static unsigned *fd_gen = NULL;
+static unsigned char *fd_watched = NULL;
+static int fd_len = 0;
+
+/* Multishot requests in flight, so a detach knows when the kernel has let go
+ * of every socket. */
+static int recvs_armed = 0;
+static int accept_armed = 0;
+static int detaching = 0;
+
+/* Completions that arrived while we were reaping sends; net_uring_wait()
+ * hands them out first. */
+static NetEvent *stash = NULL;
+static int stash_head = 0, stash_count = 0, stash_cap = 0;
+
+static int sys_enter(unsigned to_submit, unsigned min_complete, unsigned flags,
+                     void *arg, size_t argsz) {
+  net_stats.syscalls++;
+  return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                      flags, arg, argsz);
+}
+
+static void fd_reserve(int fd) {
+  if (fd < fd_len)
+    return;
+  int len = fd_len ? fd_len : 64;
+  while (len <= fd)
+    len *= 2;
+  unsigned *gen = realloc(fd_gen, len * sizeof(*gen));
+  unsigned char *w = realloc(fd_watched, len);
+  if (!gen || !w) {
+    perror("realloc");
+    exit(1);
+  }
+  memset(gen + fd_len, 0, (len - fd_len) * sizeof(*gen));
+  memset(w + fd_len, 0, len - fd_len);
+  fd_gen = gen;
+  fd_watched = w;
+  fd_len = len;
+}
+
+static int submit(void) {
+  unsigned n = sq_pending;
+  sq_pending = 0;
+  if (n == 0)
+    return 0;
+  return sys_enter(n, 0, 0, NULL, 0);
+}
+
+static struct io_uring_sqe *get_sqe(void) {
+  unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+  unsigned tail = *sq_tail;
+  if (tail - head >= sq_entries) {
+    submit();
+    head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head >= sq_entries)
+      return NULL;
+  }
+  unsigned idx = tail & *sq_mask;
+  struct io_uring_sqe *sqe = &sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_array[idx] = idx;
+  __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+  sq_pending++;
+  return sqe;
+}
+
+static void buf_recycle(unsigned short bid) {
+  struct io_uring_buf *b = &buf_ring->bufs[buf_tail & (BUF_COUNT - 1)];
+  b->addr = (uint64_t)(uintptr_t)(buf_mem + (size_t)bid * BUF_SIZE);
+  b->len = BUF_SIZE;
+  b->bid = bid;
+  buf_tail++;
+  __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+}
+
+static void arm_accept(void) {
+  if (listen_sock < 0)
+    return;
+  struct io_uring_sqe *sqe = get_sqe();
+  if (!sqe)
+    return;
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listen_sock;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK;
+  sqe->user_data = UD(UD_ACCEPT, 0, listen_sock);
+  accept_armed = 1;
+}
+
+static void arm_recv(int fd) {
+  struct io_uring_sqe *sqe = get_sqe();
+  if (!sqe)
+    return;
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = BUF_GROUP;
+  sqe->user_data = UD(UD_RECV, fd_gen[fd], fd);
+  recvs_armed++;
+}
+
+int net_uring_init(int listen_fd) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = RING_ENTRIES * 4;
+  ring_fd = (int)syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+  if (ring_fd < 0)
+    return -1;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(p.features & IORING_FEAT_EXT_ARG)) {
+    close(ring_fd);
+    ring_fd = -1;
+    return -1;
+  }
+
+  sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (cq_size > sq_size)
+    sq_size = cq_size;
+  cq_size = sq_size;
+  sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  if (sq_ptr == MAP_FAILED)
+    goto fail;
+  cq_ptr = sq_ptr;
+  sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED)
+    goto fail;
+
+  sq_head = (unsigned *)((char *)sq_ptr + p.sq_off.head);
+  sq_tail = (unsigned *)((char *)sq_ptr + p.sq_off.tail);
+  sq_mask = (unsigned *)((char *)sq_ptr + p.sq_off.ring_mask);
+  sq_array = (unsigned *)((char *)sq_ptr + p.sq_off.array);
+  sq_entries = p.sq_entries;
+  cq_head = (unsigned *)((char *)cq_ptr + p.cq_off.head);
+  cq_tail = (unsigned *)((char *)cq_ptr + p.cq_off.tail);
+  cq_mask = (unsigned *)((char *)cq_ptr + p.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *)((char *)cq_ptr + p.cq_off.cqes);
+
+  buf_ring_size = BUF_COUNT * sizeof(struct io_uring_buf);
+  buf_ring = mmap(NULL, buf_ring_size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf_ring == MAP_FAILED)
+    goto fail;
+  buf_mem = malloc((size_t)BUF_COUNT * BUF_SIZE);
+  if (!buf_mem)
+    goto fail;
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)buf_ring;
+  reg.ring_entries = BUF_COUNT;
+  reg.bgid = BUF_GROUP;
+  if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg,
+              1) < 0)
+    goto fail;
+
+  buf_tail = 0;
+  for (int i = 0; i < BUF_COUNT; i++)
+    buf_recycle(i);
+
+  listen_sock = listen_fd;
+  arm_accept();
+  if (submit() < 0)
+    goto fail;
+  return 0;
+
+fail:
+  net_uring_shutdown();
+  return -1;
+}
+
+void net_uring_shutdown(void) {
+  if (ring_fd >= 0)
+    close(ring_fd);
+  ring_fd = -1;
+  if (sq_ptr && sq_ptr != MAP_FAILED)
+    munmap(sq_ptr, sq_size);
+  if (sqes && sqes != MAP_FAILED)
+    munmap(sqes, sqes_size);
+  if (buf_ring && buf_ring != MAP_FAILED)
+    munmap(buf_ring, buf_ring_size);
+  sq_ptr = NULL;
+  sqes = NULL;
+  buf_ring = NULL;
+  free(buf_mem);
+  free(fd_gen);
+  free(fd_watched);
+  free(stash);
+  buf_mem = NULL;
+  fd_gen = NULL;
+  fd_watched = NULL;
+  stash = NULL;
+  fd_len = stash_cap = stash_head = stash_count = 0;
+  sq_pending = 0;
+  recvs_armed = accept_armed = detaching = 0;
+}
+
+void net_uring_watch(int fd) {
+  fd_reserve(fd);
+  if (fd_watched[fd])
+    return;
+  fd_watched[fd] = 1;
+  arm_recv(fd);
+}
+
+/* Cancels by exact user_data: a hash lookup in the kernel, while
+ * IORING_ASYNC_CANCEL_ALL walks every request for every match. */
+static void cancel(uint64_t user_data) {
+  struct io_uring_sqe *sqe = get_sqe();
+  if (!sqe)
+    return;
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = user_data;
+  sqe->user_data = UD(UD_IGNORE, 0, 0);
+}
+
+void net_uring_unwatch(int fd) {
+  if (fd >= fd_len || !fd_watched[fd])
+    return;
+  cancel(UD(UD_RECV, fd_gen[fd], fd));
+  fd_watched[fd] = 0;
+  fd_gen[fd]++;
+  /* The pending recv holds a reference to the socket, so the peer would not
+   * see the close until the cancel reaches the kernel. */
+  submit();
+}
+
+/* Stops reading a socket without forgetting it: the new generation drops
+ * whatever the cancelled recv still completes with. */
+void net_uring_pause(int fd) {
+  if (fd >= fd_len || !fd_watched[fd])
+    return;
+  cancel(UD(UD_RECV, fd_gen[fd], fd));
+  fd_gen[fd]++;
+  submit();
+}
+
+void net_uring_unpause(int fd) {
+  if (fd >= fd_len || !fd_watched[fd])
+    return;
+  arm_recv(fd);
+  submit();
+}
+
+/* Turns one completion into at most one event. */
+static int handle_cqe(const struct io_uring_cqe *cqe, NetEvent *ev) {
+  uint64_t ud = cqe->user_data;
+  int more = cqe->flags & IORING_CQE_F_MORE;
+
+  switch (UD_KIND(ud)) {
+  case UD_ACCEPT:
+    if (!more) {
+      accept_armed = 0;
+      if (!detaching)
+        arm_accept();
+    }
+    if (cqe->res < 0) {
+      if (cqe->res != -EAGAIN && cqe->res != -ECANCELED)
+        fprintf(stderr, "accept: %s\n", strerror(-cqe->res));
+      return 0;
+    }
+    net_stats.accepts++;
+    ev->type = NET_EV_ACCEPT;
+    ev->fd = cqe->res;
+    ev->len = 0;
+    return 1;
+
+  case UD_RECV: {
+    int fd = UD_VAL(ud);
+    int has_buf = cqe->flags & IORING_CQE_F_BUFFER;
+    unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    int live = fd < fd_len && fd_watched[fd] && fd_gen[fd] == UD_GEN(ud);
+
+    if (!more)
+      recvs_armed--;
+    if (!live || (detaching && cqe->res == -ECANCELED)) {
+      if (has_buf)
+        buf_recycle(bid);
+      return 0;
+    }
+    if (cqe->res > 0 && has_buf) {
+      net_stats.recvs++;
+      int n = cqe->res < BUF_SIZE ? cqe->res : BUF_SIZE;
+      memcpy(ev->data, buf_mem + (size_t)bid * BUF_SIZE, n);
+      ev->data[n] = '\0';
+      buf_recycle(bid);
+      ev->type = NET_EV_DATA;
+      ev->fd = fd;
+      ev->len = n;
+      if (!more && !detaching)
+        arm_recv(fd);
+      return 1;
+    }
+    if (has_buf)
+      buf_recycle(bid);
+    if (cqe->res == -ENOBUFS) {
+      if (!more && !detaching)
+        arm_recv(fd);
+      return 0;
+    }
+    if (cqe->res < 0)
+      fprintf(stderr, "recv: %s\n", strerror(-cqe->res));
+    fd_watched[fd] = 0;
+    fd_gen[fd]++;
+    ev->type = NET_EV_CLOSED;
+    ev->fd = fd;
+    ev->len = 0;
+    ev->data[0] = '\0';
+    return 1;
+  }
+
+  default:
+    return 0;
+  }
+}
+
+static void stash_push(const NetEvent *ev) {
+  if (stash_head + stash_count == stash_cap) {
+    if (stash_head > 0) {
+      memmove(stash, stash + stash_head, stash_count * sizeof(NetEvent));
+      stash_head = 0;
+    } else {
+      int cap = stash_cap ? stash_cap * 2 : 64;
+      NetEvent *s = realloc(stash, cap * sizeof(NetEvent));
+      if (!s) {
+        perror("realloc");
+        exit(1);
+      }
+      stash = s;
+      stash_cap = cap;
+    }
+  }
+  stash[stash_head + stash_count++] = *ev;
+}
+
+/* Walks the completion queue. Send results go to res[], everything else is
+ * turned into events: into `events` while there is room, then the stash. */
+static int reap(NetEvent *events, int max, ssize_t *res, int *sends_left) {
+  unsigned head = *cq_head;
+  unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+  int count = 0;
+
+  while (head != tail) {
+    const struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+    head++;
+    if (UD_KIND(cqe->user_data) == UD_SEND) {
+      if (res)
+        res[UD_VAL(cqe->user_data)] = cqe->res < 0 ? -1 : cqe->res;
+      if (sends_left)
+        (*sends_left)--;
+      continue;
+    }
+    NetEvent ev;
+    if (!handle_cqe(cqe, &ev))
+      continue;
+    if (count < max)
+      events[count++] = ev;
+    else
+      stash_push(&ev);
+  }
+  __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+  return count;
+}
+
+int net_uring_wait(NetEvent *events, int max, int timeout_ms) {
+  int count = 0;
+  while (stash_count > 0 && count < max) {
+    events[count++] = stash[stash_head++];
+    stash_count--;
+  }
+  if (stash_count == 0)
+    stash_head = 0;
+  if (count > 0)
+    return count;
+
+  unsigned head = *cq_head;
+  unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+  if (head == tail) {
+    struct __kernel_timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+    unsigned n = sq_pending;
+    sq_pending = 0;
+    net_stats.wakeups++;
+    int r = sys_enter(n, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                      &arg, sizeof(arg));
+    if (r < 0 && errno != ETIME && errno != EINTR)
+      perror("io_uring_enter");
+  } else if (sq_pending) {
+    submit();
+  }
+  return reap(events, max, NULL, NULL);
+}
+
+void net_uring_send_many(const int *fds, int n, const void *buf, size_t len,
+                         int flags, ssize_t *res, int64_t *sent_ns) {
+  /* MSG_DONTWAIT keeps the semantics of send() on a non-blocking socket:
+   * the send runs inline during submission and a full socket buffer comes
+   * back as -EAGAIN instead of parking the request. */
+  int i = 0;
+  while (i < n) {
+    int from = i;
+    int sends_left = 0;
+    for (; i < n; i++) {
+      struct io_uring_sqe *sqe = get_sqe();
+      if (!sqe)
+        break;
+      sqe->opcode = IORING_OP_SEND;
+      sqe->fd = fds[i];
+      sqe->addr = (uint64_t)(uintptr_t)buf;
+      sqe->len = len;
+      sqe->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL | flags;
+      sqe->user_data = UD(UD_SEND, 0, i);
+      res[i] = -1;
+      sends_left++;
+      net_stats.sends++;
+    }
+    unsigned to_submit = sq_pending;
+    sq_pending = 0;
+    sys_enter(to_submit, sends_left, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (sent_ns) {
+      /* The sends of one submission only finish together, as far as we can
+       * see: they all get the time it returned. */
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      for (int j = from; j < i; j++)
+        sent_ns[j] = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+    reap(NULL, 0, res, &sends_left);
+    while (sends_left > 0) {
+      if (sys_enter(0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+          errno != EINTR)
+        break;
+      reap(NULL, 0, res, &sends_left);
+    }
+  }
+}
+
+int net_uring_detach(NetEvent **leftover) {
+  cancel(UD(UD_ACCEPT, 0, listen_sock));
+  for (int fd = 0; fd < fd_len; fd++) {
+    if (fd_watched[fd])
+      cancel(UD(UD_RECV, fd_gen[fd], fd));
+  }
+  detaching = 1;
+  submit();
+
+  /* Data that completes before the cancel is already out of the socket and
+   * must travel with the rest of the state. */
+  while (recvs_armed > 0 || accept_armed) {
+    if (__atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) == *cq_head &&
+        sys_enter(0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+        errno != EINTR)
+      break;
+    reap(NULL, 0, NULL, NULL);
+  }
+
+  if (stash_head > 0) {
+    memmove(stash, stash + stash_head, stash_count * sizeof(NetEvent));
+    stash_head = 0;
+  }
+  *leftover = stash;
+  int count = stash_count;
+  stash_count = 0;
+  return count;
+}
+
+void net_uring_resume(void) {
+  detaching = 0;
+  arm_accept();
+  for (int fd = 0; fd < fd_len; fd++) {
+    if (fd_watched[fd]) {
+      fd_gen[fd]++;
+      arm_recv(fd);
+    }
+  }
+  submit();
+}
+
+#else
+
+int net_uring_init(int listen_fd) {
+  (void)listen_fd;
+  return -1;
+}
+void net_uring_shutdown(void) {}
+void net_uring_watch(int fd) { (void)fd; }
+void net_uring_unwatch(int fd) { (void)fd; }
+void net_uring_pause(int fd) { (void)fd; }
+void net_uring_unpause(int fd) { (void)fd; }
+int net_uring_wait(NetEvent *events, int max, int timeout_ms) {
+  (void)events;
+  (void)max;
+  (void)timeout_ms;
+  return 0;
+}
+void net_uring_send_many(const int *fds, int n, const void *buf, size_t len,
+                         int flags, ssize_t *res, int64_t *sent_ns) {
+  (void)fds;
+  (void)buf;
+  (void)len;
+  (void)flags;
+  (void)sent_ns;
+  for (int i = 0; i < n; i++)
+    res[i] = -1;
+}
+int net_uring_detach(NetEvent **leftover) {
+  *leftover = NULL;
+  return 0;
+}
+void net_uring_resume(void) {}
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef QUIZRUSH_NET_URING_H
+#define QUIZRUSH_NET_URING_H
+
+#include "net.h"
+
+/* io_uring backend behind net.h. net_uring_init() returns -1 when the kernel
+ * (or the platform) can't do multishot accept/recv with provided buffer
+ * rings; the caller then stays on poll(). */
+int net_uring_init(int listen_fd);
+void net_uring_shutdown(void);
+void net_uring_watch(int fd);
+void net_uring_unwatch(int fd);
+/* Stop and restart reading a watched socket, for the input limits. */
+void net_uring_pause(int fd);
+void net_uring_unpause(int fd);
+int net_uring_wait(NetEvent *events, int max, int timeout_ms);
+/* sent_ns may be NULL. */
+void net_uring_send_many(const int *fds, int n, const void *buf, size_t len,
+                         int flags, ssize_t *res, int64_t *sent_ns);
+int net_uring_detach(NetEvent **leftover);
+void net_uring_resume(void);
+
+#endif
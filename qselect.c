@@ -0,0 +1,174 @@
+#include "qselect.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DIFF_SLOTS (QSEL_MAX_DIFFICULTY + 1)
+
+static void *xmalloc(size_t size) {
+  void *p = malloc(size ? size : 1);
+  if (!p) {
+    perror("malloc");
+    exit(1);
+  }
+  return p;
+}
+
+void qsel_build(QuestionIndex *ix, const int *category, const int *difficulty,
+                int count, int category_count) {
+  memset(ix, 0, sizeof(*ix));
+  ix->count = count;
+  ix->category_count = category_count;
+  ix->by_category = xmalloc(count * sizeof(int));
+  ix->by_difficulty = xmalloc(count * sizeof(int));
+  int groups = category_count * DIFF_SLOTS;
+  ix->cat_diff_start = calloc(groups + 1, sizeof(int));
+  if (!ix->cat_diff_start) {
+    perror("calloc");
+    exit(1);
+  }
+
+  /* Counting sort: sizes, prefix sums, then a stable scatter. */
+  for (int i = 0; i < count; i++) {
+    ix->cat_diff_start[category[i] * DIFF_SLOTS + difficulty[i] + 1]++;
+    ix->diff_start[difficulty[i] + 1]++;
+  }
+  for (int g = 0; g < groups; g++)
+    ix->cat_diff_start[g + 1] += ix->cat_diff_start[g];
+  for (int d = 0; d < DIFF_SLOTS; d++)
+    ix->diff_start[d + 1] += ix->diff_start[d];
+
+  int *fill = xmalloc((groups + DIFF_SLOTS) * sizeof(int));
+  memcpy(fill, ix->cat_diff_start, groups * sizeof(int));
+  memcpy(fill + groups, ix->diff_start, DIFF_SLOTS * sizeof(int));
+  for (int i = 0; i < count; i++) {
+    ix->by_category[fill[category[i] * DIFF_SLOTS + difficulty[i]]++] = i;
+    ix->by_difficulty[fill[groups + difficulty[i]]++] = i;
+  }
+  free(fill);
+}
+
+void qsel_free(QuestionIndex *ix) {
+  free(ix->by_category);
+  free(ix->by_difficulty);
+  free(ix->cat_diff_start);
+  memset(ix, 0, sizeof(*ix));
+}
+
+static const int *range_of(const QuestionIndex *ix, int category,
+                           int difficulty, int *len) {
+  if (category >= ix->category_count || difficulty > QSEL_MAX_DIFFICULTY) {
+    *len = 0;
+    return ix->by_category;
+  }
+  int from, to;
+  const int *base = ix->by_category;
+  if (category == QSEL_ANY && difficulty == QSEL_ANY) {
+    from = 0;
+    to = ix->count;
+  } else if (category == QSEL_ANY) {
+    base = ix->by_difficulty;
+    from = ix->diff_start[difficulty];
+    to = ix->diff_start[difficulty + 1];
+  } else if (difficulty == QSEL_ANY) {
+    from = ix->cat_diff_start[category * DIFF_SLOTS];
+    to = ix->cat_diff_start[(category + 1) * DIFF_SLOTS];
+  } else {
+    from = ix->cat_diff_start[category * DIFF_SLOTS + difficulty];
+    to = ix->cat_diff_start[category * DIFF_SLOTS + difficulty + 1];
+  }
+  *len = to - from;
+  return base + from;
+}
+
+static uint64_t splitmix64(uint64_t *state) {
+  uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+/* Positions of the range the shuffle has written to; everything else still
+ * holds its original id. Open addressing, key -1 is empty. */
+typedef struct {
+  int *keys;
+  int *values;
+  unsigned mask;
+  int used;
+} SwapTable;
+
+static void swaps_init(SwapTable *t, unsigned cap) {
+  t->keys = xmalloc(cap * sizeof(int));
+  t->values = xmalloc(cap * sizeof(int));
+  memset(t->keys, 0xff, cap * sizeof(int));
+  t->mask = cap - 1;
+  t->used = 0;
+}
+
+static unsigned swaps_slot(const SwapTable *t, int key) {
+  unsigned h = (unsigned)key * 2654435761u;
+  while (t->keys[h & t->mask] != -1 && t->keys[h & t->mask] != key)
+    h++;
+  return h & t->mask;
+}
+
+static int swaps_get(const SwapTable *t, int key, int fallback) {
+  unsigned s = swaps_slot(t, key);
+  return t->keys[s] == key ? t->values[s] : fallback;
+}
+
+static void swaps_set(SwapTable *t, int key, int value) {
+  if ((unsigned)(t->used + 1) * 2 > t->mask + 1) {
+    SwapTable bigger;
+    swaps_init(&bigger, (t->mask + 1) * 2);
+    for (unsigned i = 0; i <= t->mask; i++) {
+      if (t->keys[i] != -1)
+        swaps_set(&bigger, t->keys[i], t->values[i]);
+    }
+    free(t->keys);
+    free(t->values);
+    *t = bigger;
+  }
+  unsigned s = swaps_slot(t, key);
+  if (t->keys[s] == -1) {
+    t->keys[s] = key;
+    t->used++;
+  }
+  t->values[s] = value;
+}
+
+int qsel_pick(const QuestionIndex *ix, int category, int difficulty, int k,
+              uint64_t seed, int game, int *out) {
+  int len;
+  const int *range = range_of(ix, category, difficulty, &len);
+  if (k > len)
+    k = len;
+  if (k <= 0)
+    return 0;
+
+  /* Games of a series take consecutive slices of one shuffle, so none of them
+   * repeats a question until the range is used up; then a new shuffle. */
+  int per_shuffle = len / k;
+  uint64_t rng = seed + (uint64_t)(game / per_shuffle) * 0x9E3779B97F4A7C15ULL;
+  int from = (game % per_shuffle) * k;
+
+  unsigned cap = 16;
+  while (cap < (unsigned)(from + k) * 4)
+    cap *= 2;
+  SwapTable swaps;
+  swaps_init(&swaps, cap);
+
+  for (int i = 0; i < from + k; i++) {
+    int j = i + (int)(((splitmix64(&rng) >> 32) * (uint64_t)(len - i)) >> 32);
+    int at_i = swaps_get(&swaps, i, range[i]);
+    int at_j = swaps_get(&swaps, j, range[j]);
+    swaps_set(&swaps, j, at_i);
+    if (i >= from)
+      out[i - from] = at_j;
+  }
+
+  free(swaps.keys);
+  free(swaps.values);
+  return k;
+}
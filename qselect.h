@@ -0,0 +1,40 @@
+#ifndef QUIZRUSH_QSELECT_H
+#define QUIZRUSH_QSELECT_H
+
+#include <stdint.h>
+
+#define QSEL_MAX_DIFFICULTY 5
+#define QSEL_ANY -1
+
+/* Index arrays over the question bank, built once with a counting sort.
+ * by_category holds question ids grouped by category and, inside a category,
+ * by difficulty; cat_diff_start[c * (QSEL_MAX_DIFFICULTY + 1) + d] is where
+ * the (c, d) group starts, so a category or a (category, difficulty) pair is
+ * one contiguous range. by_difficulty does the same for difficulty alone. */
+typedef struct {
+  int count;
+  int category_count;
+  int *by_category;
+  int *cat_diff_start;
+  int *by_difficulty;
+  int diff_start[QSEL_MAX_DIFFICULTY + 2];
+} QuestionIndex;
+
+/* category[i] is in [0, category_count), difficulty[i] in
+ * [0, QSEL_MAX_DIFFICULTY]. */
+void qsel_build(QuestionIndex *ix, const int *category, const int *difficulty,
+                int count, int category_count);
+void qsel_free(QuestionIndex *ix);
+
+/* Draws up to k distinct questions matching the filter (QSEL_ANY for either
+ * field), in random order. A partial Fisher-Yates over the matching range
+ * that keeps its swaps in a small hash table instead of touching the index:
+ * O(k) time and memory however big the bank, and the same seed always gives
+ * the same questions. `game` numbers the games of a series played with one
+ * seed: they draw disjoint questions until the range runs out, at the cost of
+ * O(game * k) for the later ones. Returns how many were drawn (fewer than k if
+ * the filter runs out). */
+int qsel_pick(const QuestionIndex *ix, int category, int difficulty, int k,
+              uint64_t seed, int game, int *out);
+
+#endif
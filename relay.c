@@ -0,0 +1,307 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "net.h"
+#include "spectate.h"
+
+#define SERVER_PORT 5000
+#define EVENTS_PER_WAIT 256
+#define RECONNECT_SEC 1
+#define GREETING                                                               \
+  "\nQuizRush: вы зритель. Вопросы и счёт приходят сюда, ответы не "          \
+  "принимаются.\n"
+
+/* A relay takes the spectator stream from the game server over one
+ * connection and fans it out to any number of spectators, who connect to
+ * SPECTATE_PORT with nc or telnet. It keeps the latest state for
+ * those who join late and outlives the server: after a live upgrade or the
+ * end of the game it reconnects and keeps showing the last state. */
+
+volatile sig_atomic_t stop = 0;
+
+int upstream = -1;
+SpecState state;
+SpecReader reader;
+
+/* Spectator sockets in a dense array; slot_of maps an fd back to its place
+ * so a leaving spectator is swapped with the last one. */
+int *viewers = NULL;
+int viewer_count = 0;
+int viewer_cap = 0;
+int *slot_of = NULL;
+int slot_of_len = 0;
+/* A copy of viewers for one fan-out, which drops viewers as it goes, and the
+ * results; both keep viewer_cap entries. */
+int *send_fds = NULL;
+ssize_t *send_res = NULL;
+
+int viewers_peak = 0;
+unsigned long viewers_joined = 0;
+unsigned long viewers_dropped = 0;
+unsigned long messages = 0;
+unsigned long bytes_out = 0;
+
+void handle_sigint() { stop = 1; }
+
+void *xrealloc(void *ptr, size_t size) {
+  void *p = realloc(ptr, size);
+  if (!p) {
+    perror("realloc");
+    exit(1);
+  }
+  return p;
+}
+
+int connect_upstream(const char *host) {
+  struct addrinfo hints, *res, *rp;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  char port_str[16];
+  snprintf(port_str, sizeof(port_str), "%d", SERVER_PORT);
+  if (getaddrinfo(host, port_str, &hints, &res) != 0)
+    return -1;
+
+  int sock = -1;
+  for (rp = res; rp != NULL; rp = rp->ai_next) {
+    sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+    if (sock == -1)
+      continue;
+    if (connect(sock, rp->ai_addr, rp->ai_addrlen) == 0)
+      break;
+    close(sock);
+    sock = -1;
+  }
+  freeaddrinfo(res);
+  if (sock < 0)
+    return -1;
+  if (send(sock, SPECTATE_HELLO, strlen(SPECTATE_HELLO), 0) < 0) {
+    close(sock);
+    return -1;
+  }
+  fcntl(sock, F_SETFL, O_NONBLOCK);
+  net_watch(sock);
+  return sock;
+}
+
+int open_listen(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("socket");
+    exit(1);
+  }
+  int reuse = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = INADDR_ANY;
+  addr.sin_port = htons(port);
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("bind");
+    exit(1);
+  }
+  if (listen(fd, SOMAXCONN) < 0) {
+    perror("listen");
+    exit(1);
+  }
+  return fd;
+}
+
+void add_viewer(int fd) {
+  if (fd >= slot_of_len) {
+    int len = slot_of_len ? slot_of_len : 1024;
+    while (len <= fd)
+      len *= 2;
+    slot_of = xrealloc(slot_of, len * sizeof(int));
+    for (int i = slot_of_len; i < len; i++)
+      slot_of[i] = -1;
+    slot_of_len = len;
+  }
+  if (viewer_count == viewer_cap) {
+    viewer_cap = viewer_cap ? viewer_cap * 2 : 1024;
+    viewers = xrealloc(viewers, viewer_cap * sizeof(int));
+    send_fds = xrealloc(send_fds, viewer_cap * sizeof(int));
+    send_res = xrealloc(send_res, viewer_cap * sizeof(ssize_t));
+  }
+  slot_of[fd] = viewer_count;
+  viewers[viewer_count++] = fd;
+  viewers_joined++;
+  if (viewer_count > viewers_peak)
+    viewers_peak = viewer_count;
+}
+
+void remove_viewer(int fd) {
+  if (fd < 0 || fd >= slot_of_len || slot_of[fd] < 0)
+    return;
+  int slot = slot_of[fd];
+  int last = viewers[--viewer_count];
+  viewers[slot] = last;
+  slot_of[last] = slot;
+  slot_of[fd] = -1;
+  net_close(fd);
+}
+
+/* A spectator whose socket buffer is full would only fall further behind;
+ * they are dropped and can reconnect to get the current state. */
+void send_to_viewers(const char *text, size_t len) {
+  if (viewer_count == 0)
+    return;
+  int n = viewer_count;
+  ssize_t *res = send_res;
+  int *fds = send_fds;
+  memcpy(fds, viewers, n * sizeof(int));
+  net_send_many(fds, n, text, len, res);
+  messages++;
+  for (int i = 0; i < n; i++) {
+    if (res[i] == (ssize_t)len) {
+      bytes_out += len;
+    } else {
+      viewers_dropped++;
+      remove_viewer(fds[i]);
+    }
+  }
+}
+
+void welcome(int fd) {
+  size_t len;
+  char *snapshot = spec_snapshot(&state, 0, &len);
+  size_t greeting_len = strlen(GREETING);
+  char *msg = xrealloc(NULL, greeting_len + len + 1);
+  memcpy(msg, GREETING, greeting_len);
+  if (snapshot)
+    memcpy(msg + greeting_len, snapshot, len);
+  free(snapshot);
+  if (net_send(fd, msg, greeting_len + len) == (ssize_t)(greeting_len + len))
+    bytes_out += greeting_len + len;
+  else
+    remove_viewer(fd);
+  free(msg);
+}
+
+void read_upstream(const char *data, int len) {
+  spec_feed(&reader, data, len);
+  int kind;
+  const char *text;
+  while (spec_next(&reader, &kind, &text)) {
+    spec_update(&state, kind, text);
+    send_to_viewers(text, strlen(text));
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int backend = NET_BACKEND_POLL;
+  int port = SPECTATE_PORT;
+  int bad = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "b:p:")) != -1) {
+    switch (opt) {
+    case 'b':
+      if (strcmp(optarg, "uring") == 0)
+        backend = NET_BACKEND_URING;
+      else if (strcmp(optarg, "poll") != 0)
+        bad = 1;
+      break;
+    case 'p':
+      port = atoi(optarg);
+      break;
+    default:
+      bad = 1;
+    }
+  }
+  if (bad || argc - optind != 1) {
+    printf("Использование: %s [-b poll|uring] [-p порт_зрителей] "
+           "<IP или hostname сервера>\n",
+           argv[0]);
+    return 1;
+  }
+  const char *host = argv[optind];
+
+  signal(SIGINT, handle_sigint);
+  signal(SIGPIPE, SIG_IGN);
+
+  int listen_fd = open_listen(port);
+  net_init(backend, listen_fd);
+  /* The server's stream comes in bursts of many chunks; spectators have
+   * nothing to say, so their input costs one recv at most. */
+  NetLimits limits = {0, 0, 0, 0, 0, 0};
+  net_set_limits(&limits);
+  printf("Ретранслятор: зрители на порту %d (%s), сервер %s\n", port,
+         net_backend_name(), host);
+
+  time_t retry_at = 0;
+  int was_connected = 0;
+  NetEvent events[EVENTS_PER_WAIT];
+  while (!stop) {
+    if (upstream < 0 && time(NULL) >= retry_at) {
+      upstream = connect_upstream(host);
+      if (upstream >= 0) {
+        printf("Подключено к серверу\n");
+        was_connected = 1;
+      } else {
+        if (was_connected)
+          printf("Сервер недоступен, повтор через %d с\n", RECONNECT_SEC);
+        was_connected = 0;
+        retry_at = time(NULL) + RECONNECT_SEC;
+      }
+      fflush(stdout);
+    }
+
+    int n = net_wait(events, EVENTS_PER_WAIT, 1000);
+    for (int i = 0; i < n; i++) {
+      NetEvent *ev = &events[i];
+      if (ev->type == NET_EV_ACCEPT) {
+        add_viewer(ev->fd);
+        net_watch(ev->fd);
+        welcome(ev->fd);
+      } else if (ev->fd == upstream) {
+        if (ev->type == NET_EV_DATA) {
+          read_upstream(ev->data, ev->len);
+          continue;
+        }
+        /* The server closes relays right before it exits; give it time
+         * instead of connecting to a process on its way out. */
+        net_close(upstream);
+        upstream = -1;
+        retry_at = time(NULL) + RECONNECT_SEC;
+        spec_reader_free(&reader);
+        printf("Соединение с сервером закрыто\n");
+        fflush(stdout);
+      } else if (ev->type == NET_EV_CLOSED) {
+        remove_viewer(ev->fd);
+      }
+    }
+  }
+
+  printf("\nЗрителей: сейчас %d, максимум %d, всего %lu, отключено "
+         "медленных %lu\n",
+         viewer_count, viewers_peak, viewers_joined, viewers_dropped);
+  printf("Сообщений %lu, отправлено байт %lu\n", messages, bytes_out);
+  printf("Ввод-вывод (%s): системных вызовов %lu, пробуждений %lu, send %lu\n",
+         net_backend_name(), net_stats.syscalls, net_stats.wakeups,
+         net_stats.sends);
+
+  for (int i = 0; i < viewer_count; i++)
+    net_close(viewers[i]);
+  if (upstream >= 0)
+    net_close(upstream);
+  free(viewers);
+  free(slot_of);
+  free(send_fds);
+  free(send_res);
+  spec_free(&state);
+  spec_reader_free(&reader);
+  net_shutdown();
+  close(listen_fd);
+  return 0;
+}
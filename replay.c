@@ -0,0 +1,502 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+
+#define SERVER_PORT 5000
+#define BUFFER_SIZE 4096
+#define LINE_LEN 512
+#define TOKEN_LEN 64
+#define QUESTION_PREFIX "Вопрос "
+#define SCORE_PREFIX "Ваш итоговый счёт: "
+/* As fast as possible still waits for the server to answer the previous
+ * message on a connection (or this long), so two messages don't arrive as
+ * one recv(). */
+#define FAST_GAP_NS 20000000LL
+#define SYNC_REPLY_NS 1000000000LL
+#define STALL_NS 60000000000LL
+#define IDLE_NS 30000000000LL
+
+/* Feeds a capture recorded with "server.out -r" to a server started with
+ * -R, one socket per recorded connection, and checks that every player ends
+ * with the recorded score.
+ *
+ * Lobby events are sent at their recorded offsets. An event of round r waits
+ * until the server has sent question r and then keeps its offset from the
+ * recorded question time, so slow or fast rounds on either side don't shift
+ * it into the wrong round. Answers carry their recorded time ("N@us"), which
+ * the server takes instead of its own clock with -R, so scores don't depend
+ * on the replay speed. */
+
+typedef struct {
+  int sock;
+  int awaiting_reply;
+  int64_t last_send_ns;
+  char line[LINE_LEN];
+  int line_len;
+  char old_token[TOKEN_LEN]; /* from the capture */
+  char token[TOKEN_LEN];     /* what this server gave */
+  int expected_score;        /* -1 if the capture has none */
+  int final_score;
+} Conn;
+
+Conn *conns = NULL;
+int conn_count = 0;
+int open_conns = 0;
+
+/* Per round: recorded question time and when we first saw the question. */
+int64_t *round_t_ns = NULL;
+int64_t *question_seen_ns = NULL;
+int round_count = 0;
+
+/* Connection of the last message that has to be handled before anything
+ * after it, see due_time(). */
+int sync_conn = 0;
+
+int64_t first_event_ns = -1;
+int client_events = 0;
+int64_t last_activity_ns = 0;
+int server_port = SERVER_PORT;
+
+int64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int connect_to(const char *host) {
+  struct addrinfo hints, *res, *rp;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  char port_str[16];
+  snprintf(port_str, sizeof(port_str), "%d", server_port);
+  int err = getaddrinfo(host, port_str, &hints, &res);
+  if (err != 0) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
+    return -1;
+  }
+
+  int sock = -1;
+  for (rp = res; rp != NULL; rp = rp->ai_next) {
+    sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+    if (sock == -1)
+      continue;
+    if (connect(sock, rp->ai_addr, rp->ai_addrlen) == 0)
+      break;
+    close(sock);
+    sock = -1;
+  }
+  freeaddrinfo(res);
+  if (sock >= 0) {
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(sock, F_SETFL, O_NONBLOCK);
+  }
+  return sock;
+}
+
+void *xcalloc(size_t n, size_t size) {
+  void *p = calloc(n ? n : 1, size);
+  if (!p) {
+    perror("calloc");
+    exit(1);
+  }
+  return p;
+}
+
+CaptureEvent *load_capture(const char *path, CaptureHeader *hdr, int *count) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    exit(1);
+  }
+  if (capture_read_header(f, hdr) < 0) {
+    printf("%s: это не запись QuizRush\n", path);
+    exit(1);
+  }
+
+  int cap = 1024;
+  CaptureEvent *events = xcalloc(cap, sizeof(CaptureEvent));
+  CaptureEvent ev;
+  memset(&ev, 0, sizeof(ev));
+  int n = 0;
+  while (capture_read(f, &ev)) {
+    if (n == cap) {
+      cap *= 2;
+      CaptureEvent *p = realloc(events, cap * sizeof(CaptureEvent));
+      if (!p) {
+        perror("realloc");
+        exit(1);
+      }
+      events = p;
+    }
+    events[n++] = ev;
+  }
+  fclose(f);
+  *count = n;
+  return events;
+}
+
+int is_client_event(int type) {
+  return type == CAP_ACCEPT || type == CAP_DATA || type == CAP_CLOSED;
+}
+
+/* Sizes the tables and takes what the capture says about the server side:
+ * question times, issued tokens and final scores. */
+void prepare(const CaptureEvent *events, int n) {
+  for (int i = 0; i < n; i++) {
+    if (events[i].conn >= conn_count)
+      conn_count = events[i].conn + 1;
+    if (events[i].round >= round_count)
+      round_count = events[i].round + 1;
+    if (!is_client_event(events[i].type))
+      continue;
+    client_events++;
+    if (first_event_ns < 0)
+      first_event_ns = events[i].t_ns;
+  }
+  conns = xcalloc(conn_count, sizeof(Conn));
+  round_t_ns = xcalloc(round_count, sizeof(int64_t));
+  question_seen_ns = xcalloc(round_count, sizeof(int64_t));
+  for (int i = 0; i < conn_count; i++) {
+    conns[i].sock = -1;
+    conns[i].expected_score = -1;
+    conns[i].final_score = -1;
+  }
+
+  for (int i = 0; i < n; i++) {
+    const CaptureEvent *ev = &events[i];
+    Conn *c = &conns[ev->conn];
+    if (ev->type == CAP_ROUND)
+      round_t_ns[ev->round] = ev->t_ns;
+    else if (ev->type == CAP_TOKEN)
+      snprintf(c->old_token, sizeof(c->old_token), "%.*s", ev->len, ev->data);
+    else if (ev->type == CAP_RESULT)
+      c->expected_score = ev->value;
+  }
+}
+
+void close_conn(Conn *c) {
+  if (c->sock < 0)
+    return;
+  close(c->sock);
+  c->sock = -1;
+  open_conns--;
+}
+
+void handle_line(Conn *c, const char *line, int64_t now) {
+  if (strncmp(line, "/token ", 7) == 0) {
+    snprintf(c->token, sizeof(c->token), "%s", line + 7);
+  } else if (strncmp(line, QUESTION_PREFIX, strlen(QUESTION_PREFIX)) == 0) {
+    int q = atoi(line + strlen(QUESTION_PREFIX)) - 1;
+    if (q >= 0 && q < round_count && question_seen_ns[q] == 0)
+      question_seen_ns[q] = now;
+  } else {
+    /* A big room's final table is cut off mid-line, right before this. */
+    const char *score = strstr(line, SCORE_PREFIX);
+    if (score)
+      c->final_score = atoi(score + strlen(SCORE_PREFIX));
+  }
+}
+
+void read_conn(Conn *c, int64_t now) {
+  char buffer[BUFFER_SIZE];
+  int n = recv(c->sock, buffer, sizeof(buffer), 0);
+  if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+    close_conn(c);
+    return;
+  }
+  if (n < 0)
+    return;
+  c->awaiting_reply = 0;
+  last_activity_ns = now;
+  for (int i = 0; i < n; i++) {
+    if (buffer[i] == '\n' || c->line_len == LINE_LEN - 1) {
+      c->line[c->line_len] = '\0';
+      handle_line(c, c->line, now);
+      c->line_len = 0;
+      if (buffer[i] == '\n')
+        continue;
+    }
+    c->line[c->line_len++] = buffer[i];
+  }
+}
+
+/* "/resume <token>" has to name the token this server issued. Returns 0 if
+ * that token hasn't arrived yet. */
+int rewrite_resume(const CaptureEvent *ev, char *out, int *len) {
+  memcpy(out, ev->data, ev->len);
+  *len = ev->len;
+  out[*len] = '\0';
+  if (strncmp(out, "/resume ", 8) != 0)
+    return 1;
+  char old[TOKEN_LEN];
+  snprintf(old, sizeof(old), "%s", out + 8);
+  old[strcspn(old, "\r\n")] = '\0';
+  for (int i = 1; i < conn_count; i++) {
+    if (strcmp(conns[i].old_token, old) != 0)
+      continue;
+    if (!conns[i].token[0])
+      return 0;
+    *len = snprintf(out, BUFFER_SIZE, "/resume %s", conns[i].token);
+    return 1;
+  }
+  return 1;
+}
+
+/* Appends the recorded answer time to something that looks like an
+ * answer. */
+void stamp_answer(const CaptureEvent *ev, char *out, int *len) {
+  int digits = 0;
+  while (digits < *len && out[digits] >= '0' && out[digits] <= '9')
+    digits++;
+  if (digits == 0 || ev->round < 0)
+    return;
+  if (strspn(out + digits, "\r\n") != (size_t)(*len - digits))
+    return;
+  int64_t elapsed_us = (ev->t_ns - round_t_ns[ev->round]) / 1000;
+  char tail[8];
+  snprintf(tail, sizeof(tail), "%s", out + digits);
+  *len = digits + snprintf(out + digits, BUFFER_SIZE - digits, "@%lld%s",
+                           (long long)elapsed_us, tail);
+}
+
+/* When the event may go out, or -1 while it waits for the server. */
+int64_t due_time(const CaptureEvent *ev, int fast, int64_t start_ns,
+                 int64_t now) {
+  int64_t due;
+  if (ev->round < 0) {
+    due = fast ? now : start_ns + (ev->t_ns - first_event_ns);
+  } else {
+    if (question_seen_ns[ev->round] == 0)
+      return -1;
+    due = fast ? now
+               : question_seen_ns[ev->round] +
+                     (ev->t_ns - round_t_ns[ev->round]);
+  }
+  /* Connections race each other into the server. Answers don't care, but
+   * who has joined, who is ready when the game starts and whether a player
+   * is back before the others finish the round do: after a lobby message or
+   * a resume nothing goes out until the server has reacted to it. */
+  const Conn *prev = &conns[sync_conn];
+  if (prev->awaiting_reply && prev->last_send_ns + SYNC_REPLY_NS > due)
+    due = prev->last_send_ns + SYNC_REPLY_NS;
+  const Conn *c = &conns[ev->conn];
+  if (fast && ev->type == CAP_DATA && c->awaiting_reply &&
+      c->last_send_ns + FAST_GAP_NS > due)
+    due = c->last_send_ns + FAST_GAP_NS;
+  return due;
+}
+
+/* Returns 0 if the event has to wait. */
+int perform(const CaptureEvent *ev, const char *host, int64_t now,
+            int *skipped) {
+  Conn *c = &conns[ev->conn];
+  if (ev->type == CAP_ACCEPT) {
+    close_conn(c);
+    c->sock = connect_to(host);
+    if (c->sock < 0) {
+      perror("connect");
+      (*skipped)++;
+      return 1;
+    }
+    c->line_len = 0;
+    c->token[0] = '\0';
+    open_conns++;
+  } else if (ev->type == CAP_CLOSED) {
+    close_conn(c);
+  } else if (ev->type == CAP_DATA) {
+    if (c->sock < 0) {
+      (*skipped)++;
+      return 1;
+    }
+    char out[BUFFER_SIZE];
+    int len;
+    if (!rewrite_resume(ev, out, &len))
+      return 0;
+    stamp_answer(ev, out, &len);
+    if (send(c->sock, out, len, 0) < 0) {
+      (*skipped)++;
+      close_conn(c);
+      return 1;
+    }
+    c->awaiting_reply = 1;
+    c->last_send_ns = now;
+    if (ev->round < 0 || strncmp(out, "/resume ", 8) == 0)
+      sync_conn = ev->conn;
+    else
+      sync_conn = 0;
+  }
+  return 1;
+}
+
+void print_report(const CaptureEvent *events, int n, int sent, int skipped,
+                  int64_t start_ns, int fast) {
+  int64_t recorded = n > 0 ? events[n - 1].t_ns - first_event_ns : 0;
+  printf("\nПовтор (%s): событий %d/%d, пропущено %d, время %.2f с "
+         "(в записи %.2f с)\n",
+         fast ? "максимальная скорость" : "1x", sent, client_events, skipped,
+         (now_ns() - start_ns) / 1e9, recorded / 1e9);
+  for (int r = 0; r + 1 < round_count; r++) {
+    if (!question_seen_ns[r] || !question_seen_ns[r + 1])
+      break;
+    printf("Раунд %d: %.0f мс (в записи %.0f мс)\n", r + 1,
+           (question_seen_ns[r + 1] - question_seen_ns[r]) / 1e6,
+           (round_t_ns[r + 1] - round_t_ns[r]) / 1e6);
+  }
+}
+
+int check_scores(void) {
+  int checked = 0, wrong = 0;
+  for (int i = 1; i < conn_count; i++) {
+    const Conn *c = &conns[i];
+    if (c->expected_score < 0)
+      continue;
+    checked++;
+    if (c->final_score != c->expected_score) {
+      printf("Соединение %d: в записи %d очков, в повторе %d\n", i,
+             c->expected_score, c->final_score);
+      wrong++;
+    }
+  }
+  if (checked == 0) {
+    printf("В записи нет итоговых счетов (игра не закончилась)\n");
+    return 0;
+  }
+  if (wrong) {
+    printf("Итоговые счета расходятся: %d из %d\n", wrong, checked);
+    return 1;
+  }
+  printf("Итоговые счета совпадают (%d игроков)\n", checked);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  int fast = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "fp:")) != -1) {
+    if (opt == 'f')
+      fast = 1;
+    else if (opt == 'p')
+      server_port = atoi(optarg);
+  }
+  if (argc - optind != 2 || server_port <= 0 || server_port > 65535) {
+    printf("Использование: %s [-f] [-p порт] <IP или hostname> "
+           "<файл записи>\n"
+           "  -f  без пауз из записи (по умолчанию 1x)\n"
+           "  -p  порт сервера (по умолчанию %d)\n",
+           argv[0], SERVER_PORT);
+    return 1;
+  }
+  const char *host = argv[optind];
+
+  CaptureHeader hdr;
+  int n;
+  CaptureEvent *events = load_capture(argv[optind + 1], &hdr, &n);
+  /* The answer times depend on RTTs the capture doesn't have. */
+  if (hdr.compensate_latency) {
+    printf("Запись сделана с -l: счёт зависит от RTT игроков, которого в "
+           "записи нет, повторить её нельзя\n");
+    free(events);
+    return 1;
+  }
+  prepare(events, n);
+  printf("Запись: событий %d, соединений %d, вопросов %d (сид %u)\n",
+         client_events, conn_count - 1, hdr.game_len, hdr.seed);
+  printf("Сервер должен быть запущен так: ./server.out -R -s %u -q %d -n %d",
+         hdr.seed, hdr.game_len, hdr.max_players);
+  if (hdr.category[0])
+    printf(" -k '%s'", hdr.category);
+  if (hdr.difficulty > 0)
+    printf(" -d %d", hdr.difficulty);
+  if (server_port != SERVER_PORT)
+    printf(" -p %d", server_port);
+  printf("\n");
+
+  struct pollfd *fds = xcalloc(conn_count, sizeof(struct pollfd));
+  int *fd_conn = xcalloc(conn_count, sizeof(int));
+  int64_t start_ns = now_ns();
+  last_activity_ns = start_ns;
+  int64_t progress_ns = start_ns;
+  int next = 0, sent = 0, skipped = 0;
+
+  while (1) {
+    int64_t now = now_ns();
+    int64_t wake = now + 100000000;
+    int blocked = 0;
+    while (next < n) {
+      const CaptureEvent *ev = &events[next];
+      if (!is_client_event(ev->type)) {
+        next++;
+        continue;
+      }
+      int64_t due = due_time(ev, fast, start_ns, now);
+      if (due > now) {
+        wake = due < wake ? due : wake;
+        progress_ns = now;
+        break;
+      }
+      if (due < 0 || !perform(ev, host, now, &skipped)) {
+        blocked = 1;
+        break;
+      }
+      next++;
+      sent++;
+      progress_ns = now;
+      last_activity_ns = now;
+    }
+
+    if (blocked && now - progress_ns > STALL_NS) {
+      printf("Повтор остановился на событии %d: сервер не прислал вопрос "
+             "%d\n",
+             next, events[next].round + 1);
+      break;
+    }
+    if (next == n && (open_conns == 0 || now - last_activity_ns > IDLE_NS))
+      break;
+
+    int nfds = 0;
+    for (int i = 1; i < conn_count; i++) {
+      if (conns[i].sock < 0)
+        continue;
+      fds[nfds].fd = conns[i].sock;
+      fds[nfds].events = POLLIN;
+      fd_conn[nfds++] = i;
+    }
+    int timeout = (int)((wake - now + 999999) / 1000000);
+    if (poll(fds, nfds, timeout) < 0 && errno != EINTR) {
+      perror("poll");
+      break;
+    }
+    now = now_ns();
+    for (int i = 0; i < nfds; i++) {
+      if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+        read_conn(&conns[fd_conn[i]], now);
+    }
+  }
+
+  print_report(events, n, sent, skipped, start_ns, fast);
+  int ret = check_scores();
+
+  for (int i = 1; i < conn_count; i++)
+    close_conn(&conns[i]);
+  free(fds);
+  free(fd_conn);
+  free(conns);
+  free(round_t_ns);
+  free(question_seen_ns);
+  free(events);
+  return ret;
+}
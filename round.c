@@ -0,0 +1,192 @@
+#include "round.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+RoundState round_state;
+
+static int *silent = NULL;
+
+static void *grow_array(void *p, int cap, size_t size) {
+  void *q = realloc(p, cap * size);
+  if (!q) {
+    perror("realloc");
+    exit(1);
+  }
+  return q;
+}
+
+static void reserve(int cap) {
+  RoundState *rs = &round_state;
+  if (cap <= rs->cap)
+    return;
+  int n = rs->cap ? rs->cap : 64;
+  while (n < cap)
+    n *= 2;
+  rs->id = grow_array(rs->id, n, sizeof(*rs->id));
+  rs->sock = grow_array(rs->sock, n, sizeof(*rs->sock));
+  rs->ready = grow_array(rs->ready, n, sizeof(*rs->ready));
+  rs->rtt_us = grow_array(rs->rtt_us, n, sizeof(*rs->rtt_us));
+  rs->question_us = grow_array(rs->question_us, n, sizeof(*rs->question_us));
+  rs->connected = grow_array(rs->connected, n, sizeof(*rs->connected));
+  rs->answered = grow_array(rs->answered, n, sizeof(*rs->answered));
+  rs->answer = grow_array(rs->answer, n, sizeof(*rs->answer));
+  rs->answer_time_us =
+      grow_array(rs->answer_time_us, n, sizeof(*rs->answer_time_us));
+  rs->score = grow_array(rs->score, n, sizeof(*rs->score));
+  rs->owner_slot = grow_array(rs->owner_slot, n, sizeof(*rs->owner_slot));
+  silent = grow_array(silent, n, sizeof(*silent));
+  rs->cap = n;
+}
+
+int round_slot_add(int sock, int *owner_slot) {
+  RoundState *rs = &round_state;
+  reserve(rs->len + 1);
+  int i = rs->len++;
+  rs->id[i] = 0;
+  rs->sock[i] = sock;
+  rs->ready[i] = 0;
+  rs->rtt_us[i] = -1;
+  rs->question_us[i] = 0;
+  rs->connected[i] = 1;
+  rs->answered[i] = 0;
+  rs->answer[i] = 0;
+  rs->answer_time_us[i] = 0;
+  rs->score[i] = 0;
+  rs->owner_slot[i] = owner_slot;
+  *owner_slot = i;
+  return i;
+}
+
+void round_slot_remove(int slot) {
+  RoundState *rs = &round_state;
+  int last = --rs->len;
+  if (slot != last) {
+    rs->id[slot] = rs->id[last];
+    rs->sock[slot] = rs->sock[last];
+    rs->ready[slot] = rs->ready[last];
+    rs->rtt_us[slot] = rs->rtt_us[last];
+    rs->question_us[slot] = rs->question_us[last];
+    rs->connected[slot] = rs->connected[last];
+    rs->answered[slot] = rs->answered[last];
+    rs->answer[slot] = rs->answer[last];
+    rs->answer_time_us[slot] = rs->answer_time_us[last];
+    rs->score[slot] = rs->score[last];
+    rs->owner_slot[slot] = rs->owner_slot[last];
+    *rs->owner_slot[slot] = slot;
+  }
+}
+
+void round_free(void) {
+  RoundState *rs = &round_state;
+  free(rs->id);
+  free(rs->sock);
+  free(rs->ready);
+  free(rs->rtt_us);
+  free(rs->question_us);
+  free(rs->connected);
+  free(rs->answered);
+  free(rs->answer);
+  free(rs->answer_time_us);
+  free(rs->score);
+  free(rs->owner_slot);
+  free(silent);
+  memset(rs, 0, sizeof(*rs));
+  silent = NULL;
+}
+
+size_t round_slot_bytes(void) {
+  const RoundState *rs = &round_state;
+  return sizeof(*rs->id) + sizeof(*rs->sock) + sizeof(*rs->ready) +
+         sizeof(*rs->rtt_us) + sizeof(*rs->question_us) +
+         sizeof(*rs->connected) + sizeof(*rs->answered) +
+         sizeof(*rs->answer) + sizeof(*rs->answer_time_us) +
+         sizeof(*rs->score) + sizeof(*rs->owner_slot) +
+         sizeof(*silent);
+}
+
+void round_reset(void) {
+  RoundState *rs = &round_state;
+  memset(rs->answered, 0, rs->len);
+  memset(rs->answer, 0, rs->len);
+  memset(rs->answer_time_us, 0, rs->len * sizeof(*rs->answer_time_us));
+}
+
+int round_pending(void) {
+  const RoundState *rs = &round_state;
+  int pending = 0;
+  for (int i = 0; i < rs->len; i++)
+    pending += rs->connected[i] & !rs->answered[i];
+  return pending;
+}
+
+/* Selects only, so that round_close() still vectorizes with it inlined. */
+int round_points(int ok, int32_t time_us, int base_points, int time_limit,
+                 int tenths) {
+  int bonus = tenths ? time_limit * 10 - time_us / 100000
+                     : time_limit - time_us / 1000000;
+  bonus = bonus < 0 ? 0 : bonus;
+  int base = tenths ? base_points * 10 : base_points;
+  return ok ? base + bonus : 0;
+}
+
+void round_close(int correct_option, int base_points, int time_limit,
+                 int tenths, RoundSummary *out) {
+  RoundState *rs = &round_state;
+  const uint8_t *restrict connected = rs->connected;
+  const uint8_t *restrict answered = rs->answered;
+  const uint8_t *restrict answer = rs->answer;
+  const int32_t *restrict time_us = rs->answer_time_us;
+  int32_t *restrict score = rs->score;
+  int n = rs->len;
+
+  /* Branch-free on purpose: every term is a compare or a select, so the loop
+   * vectorizes; the histogram is kept as one reduction per option. */
+  int answered_count = 0, correct = 0;
+  int h0 = 0, h1 = 0, h2 = 0, h3 = 0, h4 = 0;
+  int64_t time_sum = 0;
+  int32_t time_min = INT32_MAX, time_max = 0;
+  for (int i = 0; i < n; i++) {
+    int a = answer[i];
+    int did = answered[i];
+    int ok = did & (a == correct_option);
+    score[i] += round_points(ok, time_us[i], base_points, time_limit, tenths);
+
+    answered_count += did;
+    correct += ok;
+    h0 += did & (a == 0);
+    h1 += a == 1;
+    h2 += a == 2;
+    h3 += a == 3;
+    h4 += a == 4;
+    /* Selects as masks: a byte-to-int ?: keeps gcc from vectorizing. */
+    int32_t real = -(int32_t)(a != 0);
+    int32_t t = time_us[i] & real;
+    int32_t t_lo = t | (~real & INT32_MAX);
+    time_sum += t;
+    time_min = t_lo < time_min ? t_lo : time_min;
+    time_max = t > time_max ? t : time_max;
+  }
+
+  /* Compaction doesn't vectorize; it gets its own scan over the two byte
+   * arrays. */
+  int silent_count = 0;
+  for (int i = 0; i < n; i++) {
+    silent[silent_count] = i;
+    silent_count += connected[i] & !answered[i];
+  }
+
+  out->answered = answered_count;
+  out->correct = correct;
+  out->histogram[0] = h0;
+  out->histogram[1] = h1;
+  out->histogram[2] = h2;
+  out->histogram[3] = h3;
+  out->histogram[4] = h4;
+  out->time_sum_us = time_sum;
+  out->time_min_us = time_min == INT32_MAX ? 0 : time_min;
+  out->time_max_us = time_max;
+  out->silent_count = silent_count;
+  out->silent = silent;
+}
@@ -0,0 +1,70 @@
+#ifndef QUIZRUSH_ROUND_H
+#define QUIZRUSH_ROUND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ROUND_OPTIONS 4
+
+/* Everything the server keeps per player, except the name, as parallel
+ * arrays indexed by a dense slot, so the per-round passes are linear scans
+ * over a few contiguous arrays and slots 0..len-1 are the room. Removing a
+ * player moves the last slot into the hole and updates that player's index
+ * through owner_slot, which also leads from a slot back to its player. */
+typedef struct {
+  int len;
+  int cap;
+  int32_t *id;
+  int *sock;
+  uint8_t *ready;
+  int32_t *rtt_us;      /* last TCP_INFO sample, -1 if unknown */
+  int32_t *question_us; /* question sent to this player, after round start */
+  uint8_t *connected;
+  uint8_t *answered;
+  uint8_t *answer; /* 1..ROUND_OPTIONS, 0 for "no answer" */
+  int32_t *answer_time_us;
+  int32_t *score;
+  int **owner_slot;
+} RoundState;
+
+typedef struct {
+  int answered;
+  int correct;
+  int histogram[ROUND_OPTIONS + 1]; /* [0]: gave up or timed out */
+  int64_t time_sum_us;              /* over real answers (1..4) only */
+  int32_t time_min_us;
+  int32_t time_max_us;
+  int silent_count; /* connected, but no answer when the round closed */
+  int *silent;      /* their slots, valid until the next round_close() */
+} RoundSummary;
+
+extern RoundState round_state;
+
+/* Returns the new slot, cleared but for the socket, and remembers where the
+ * owner keeps it. */
+int round_slot_add(int sock, int *owner_slot);
+void round_slot_remove(int slot);
+void round_free(void);
+/* Memory one slot takes across all the arrays. */
+size_t round_slot_bytes(void);
+
+void round_reset(void);
+
+/* Connected players that haven't answered yet. */
+int round_pending(void);
+
+/* Points for one answer: base_points plus the whole seconds left of
+ * time_limit for a correct one, 0 otherwise. With `tenths` both count in
+ * tenths of a second (ten times the points), so that a few milliseconds of
+ * latency compensation aren't lost to rounding. round_close() and the instant
+ * feedback to the player both score through it. */
+int round_points(int ok, int32_t time_us, int base_points, int time_limit,
+                 int tenths);
+
+/* The end-of-round pass: scores every slot with round_points(), adds the
+ * points to the totals and fills in the answer histogram, response-time
+ * statistics and non-responders. */
+void round_close(int correct_option, int base_points, int time_limit,
+                 int tenths, RoundSummary *out);
+
+#endif
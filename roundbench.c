@@ -0,0 +1,354 @@
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "round.h"
+#include "strpool.h"
+
+#define TIME_PER_QUESTION 20
+#define BASE_POINTS 10
+#define CORRECT_OPTION 2
+#define QUESTIONS_FILE "questions.txt"
+#define CATEGORY_MARKER "#category:"
+#define OPTIONS_COUNT 4
+#define QUESTION_LINES (OPTIONS_COUNT + 2)
+#define MAX_QUESTION_LEN 256
+#define MAX_ANSWER_LEN 100
+#define MAX_NAME_LEN 50
+
+/* Round-close bookkeeping for N players, done the way server.c used to (a
+ * walk of the malloc'ed player list per step) and with the slot arrays of
+ * round.c; then the memory the players and M questions take either way.
+ * Usage: ./roundbench.out [players] [rounds] [questions] */
+
+/* The player node of the baseline server.c, field for field. */
+typedef struct ListPlayer {
+  int id;
+  int sock;
+  char name[MAX_NAME_LEN];
+  int score;
+  int answered;
+  int answer;
+  int answer_time;
+  int ready;
+  int connected;
+  struct ListPlayer *next;
+} ListPlayer;
+
+/* A question with fixed-size buffers, as server.c used to keep it, and as
+ * handles into a string pool, as it keeps it now. */
+typedef struct {
+  char question[MAX_QUESTION_LEN];
+  char options[OPTIONS_COUNT][MAX_ANSWER_LEN];
+  int correct_option;
+} FixedQuestion;
+
+typedef struct {
+  StrRef question;
+  StrRef options[OPTIONS_COUNT];
+  uint8_t correct_option;
+  uint8_t category;
+  uint8_t difficulty;
+} PooledQuestion;
+
+/* server.c's player node; the rest of a player is its round slot. */
+typedef struct {
+  int slot;
+  StrRef name;
+} SlotPlayer;
+
+typedef union SlotPlayerNode {
+  SlotPlayer player;
+  union SlotPlayerNode *next;
+} SlotPlayerNode;
+
+long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Same answers for both variants: most players answer, some give up, a few
+ * stay silent. */
+void fake_answer(int i, int round, int *answered, int *answer, int *time_us) {
+  unsigned h = (unsigned)(i * 2654435761u) ^ (unsigned)(round * 40503u);
+  *answered = h % 10 != 0;
+  *answer = *answered ? (int)(h >> 8) % 5 : 0;
+  *time_us = (int)((h >> 4) % (TIME_PER_QUESTION * 1000000));
+}
+
+/* The players join over time while the server allocates other things, so
+ * consecutive list nodes are not neighbours in memory. */
+ListPlayer *build_list(int n, ListPlayer ***nodes_out) {
+  ListPlayer **nodes = malloc(n * sizeof(ListPlayer *));
+  void **junk = malloc(n * sizeof(void *));
+  if (!nodes || !junk) {
+    perror("malloc");
+    exit(1);
+  }
+  for (int i = 0; i < n; i++) {
+    nodes[i] = calloc(1, sizeof(ListPlayer));
+    junk[i] = malloc(64 + (i % 7) * 48);
+    if (!nodes[i] || !junk[i]) {
+      perror("malloc");
+      exit(1);
+    }
+    nodes[i]->id = i + 1;
+    nodes[i]->connected = 1;
+  }
+  for (int i = n - 1; i > 0; i--) {
+    int j = rand() % (i + 1);
+    ListPlayer *t = nodes[i];
+    nodes[i] = nodes[j];
+    nodes[j] = t;
+  }
+  for (int i = 0; i < n - 1; i++)
+    nodes[i]->next = nodes[i + 1];
+  for (int i = 0; i < n; i++)
+    free(junk[i]);
+  free(junk);
+  *nodes_out = nodes;
+  return nodes[0];
+}
+
+long long list_round(ListPlayer *head, ListPlayer **nodes, int n, int round,
+                     long *checksum) {
+  for (int i = 0; i < n; i++) {
+    int answered, answer, time_us;
+    fake_answer(i, round, &answered, &answer, &time_us);
+    nodes[i]->answered = answered;
+    nodes[i]->answer = answer;
+    nodes[i]->answer_time = time_us / 1000000;
+  }
+
+  long long start = now_ns();
+  int active = 0;
+  for (ListPlayer *cur = head; cur; cur = cur->next)
+    active += cur->connected && !cur->answered;
+
+  int hist[ROUND_OPTIONS + 1] = {0};
+  int silent = 0;
+  for (ListPlayer *cur = head; cur; cur = cur->next) {
+    if (cur->answered && cur->answer == CORRECT_OPTION) {
+      int bonus = TIME_PER_QUESTION - cur->answer_time;
+      cur->score += BASE_POINTS + (bonus < 0 ? 0 : bonus);
+    }
+    if (cur->answered)
+      hist[cur->answer]++;
+  }
+  for (ListPlayer *cur = head; cur; cur = cur->next) {
+    if (cur->connected && !cur->answered)
+      silent++;
+  }
+  for (ListPlayer *cur = head; cur; cur = cur->next) {
+    cur->answered = 0;
+    cur->answer = 0;
+    cur->answer_time = 0;
+  }
+  long long spent = now_ns() - start;
+  *checksum += active + silent + hist[CORRECT_OPTION];
+  return spent;
+}
+
+long long soa_round(int n, int round, long *checksum) {
+  RoundState *rs = &round_state;
+  for (int i = 0; i < n; i++) {
+    int answered, answer, time_us;
+    fake_answer(i, round, &answered, &answer, &time_us);
+    rs->answered[i] = answered;
+    rs->answer[i] = answer;
+    rs->answer_time_us[i] = time_us;
+  }
+
+  long long start = now_ns();
+  int active = round_pending();
+  RoundSummary sum;
+  round_close(CORRECT_OPTION, BASE_POINTS, TIME_PER_QUESTION, 0, &sum);
+  round_reset();
+  long long spent = now_ns() - start;
+  *checksum += active + sum.silent_count + sum.histogram[CORRECT_OPTION];
+  return spent;
+}
+
+/* A dropped player's name stays interned while they may come back: every
+ * player drops and rejoins, and the pool and the slot arrays must not grow. */
+void player_memory(int n, int *slots, ListPlayer *node) {
+  StrPool names;
+  memset(&names, 0, sizeof(names));
+  char name[MAX_NAME_LEN];
+  StrRef ref;
+  for (int i = 0; i < n; i++) {
+    int len = snprintf(name, sizeof(name), "игрок_%d", i + 1);
+    strpool_intern(&names, name, len, &ref);
+  }
+
+  size_t pool_cap = names.cap, table_cap = names.table_cap;
+  int slot_cap = round_state.cap;
+  for (int i = 0; i < n; i++)
+    round_slot_remove(round_state.len - 1);
+  for (int i = 0; i < n; i++) {
+    int len = snprintf(name, sizeof(name), "игрок_%d", i + 1);
+    strpool_intern(&names, name, len, &ref);
+    round_slot_add(i + 3, &slots[i]);
+  }
+  int allocs = (names.cap != pool_cap) + (names.table_cap != table_cap) +
+               (round_state.cap != slot_cap);
+
+  /* Used: what the players fill; allocated: with the room the arrays and the
+   * pool keep for growth (capacities double). */
+  double used = sizeof(SlotPlayerNode) + round_slot_bytes() +
+                (double)(names.len + names.table_count * sizeof(*names.table)) /
+                    n;
+  double pooled = sizeof(SlotPlayerNode) +
+                  (double)round_state.cap * round_slot_bytes() / n +
+                  (double)strpool_bytes(&names) / n;
+  /* A list node was a malloc chunk of its own: its header counts too. */
+  double listed = malloc_usable_size(node) + sizeof(size_t);
+  printf("Память игроков: узел списка %zu байт (%.0f с заголовком malloc); "
+         "узел, слот и имя в пуле %.1f (x%.1f), с запасом роста %.1f "
+         "(x%.1f)\n",
+         sizeof(ListPlayer), listed, used, listed / used, pooled,
+         listed / pooled);
+  printf("Повторный вход всех игроков: выделений %d\n", allocs);
+  strpool_free(&names);
+}
+
+/* Non-empty lines of questions.txt without the category lines, a whole
+ * number of questions; a stand-in question if the file isn't there. */
+int read_question_lines(char ***out) {
+  static const char *stand_in[QUESTION_LINES] = {
+      "Столица Франции?", "Париж", "Лондон", "Берлин", "Мадрид", "1"};
+  char **lines = NULL;
+  int count = 0, cap = 0;
+  char line[MAX_QUESTION_LEN * 2];
+  FILE *file = fopen(QUESTIONS_FILE, "r");
+  while (file && fgets(line, sizeof(line), file)) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0' ||
+        strncmp(line, CATEGORY_MARKER, strlen(CATEGORY_MARKER)) == 0)
+      continue;
+    if (count == cap) {
+      cap = cap ? cap * 2 : 64;
+      lines = realloc(lines, cap * sizeof(char *));
+      if (!lines) {
+        perror("realloc");
+        exit(1);
+      }
+    }
+    lines[count++] = strdup(line);
+  }
+  if (file)
+    fclose(file);
+  count -= count % QUESTION_LINES;
+  if (count == 0) {
+    lines = realloc(lines, QUESTION_LINES * sizeof(char *));
+    for (int i = 0; i < QUESTION_LINES; i++)
+      lines[i] = strdup(stand_in[i]);
+    count = QUESTION_LINES;
+  }
+  *out = lines;
+  return count;
+}
+
+/* Loads m questions, the texts of questions.txt over and over, the way
+ * server.c does: one reservation for all texts, then handles into it. */
+void question_memory(int m) {
+  char **lines;
+  int line_count = read_question_lines(&lines);
+  int bank = line_count / QUESTION_LINES;
+
+  size_t text_bytes = 0;
+  for (int i = 0; i < m; i++) {
+    for (int j = 0; j < QUESTION_LINES - 1; j++)
+      text_bytes += strlen(lines[(i % bank) * QUESTION_LINES + j]) + 1;
+  }
+  StrPool texts;
+  memset(&texts, 0, sizeof(texts));
+  strpool_reserve(&texts, text_bytes);
+  PooledQuestion *questions = malloc(m * sizeof(PooledQuestion));
+  if (!questions) {
+    perror("malloc");
+    exit(1);
+  }
+  for (int i = 0; i < m; i++) {
+    char **q = lines + (i % bank) * QUESTION_LINES;
+    strpool_add(&texts, q[0], strnlen(q[0], MAX_QUESTION_LEN - 1),
+                &questions[i].question);
+    for (int j = 0; j < OPTIONS_COUNT; j++)
+      strpool_add(&texts, q[j + 1], strnlen(q[j + 1], MAX_ANSWER_LEN - 1),
+                  &questions[i].options[j]);
+    questions[i].correct_option = atoi(q[QUESTION_LINES - 1]);
+  }
+
+  double pooled = sizeof(PooledQuestion) + (double)strpool_bytes(&texts) / m;
+  printf("Память вопросов (%d): буферы фиксированного размера %zu байт на "
+         "вопрос, пул строк %.1f (x%.1f); на 1M вопросов %.1f МБ против "
+         "%.1f МБ\n",
+         m, sizeof(FixedQuestion), pooled, sizeof(FixedQuestion) / pooled,
+         pooled * 1e6 / (1024 * 1024),
+         sizeof(FixedQuestion) * 1e6 / (1024 * 1024));
+
+  free(questions);
+  strpool_free(&texts);
+  for (int i = 0; i < line_count; i++)
+    free(lines[i]);
+  free(lines);
+}
+
+int main(int argc, char *argv[]) {
+  int n = argc > 1 ? atoi(argv[1]) : 100000;
+  int rounds = argc > 2 ? atoi(argv[2]) : 50;
+  int question_count = argc > 3 ? atoi(argv[3]) : 1000000;
+  if (n <= 0 || rounds <= 0 || question_count <= 0) {
+    printf("Использование: %s [игроков] [раундов] [вопросов]\n", argv[0]);
+    return 1;
+  }
+  srand(1);
+
+  ListPlayer **nodes;
+  ListPlayer *head = build_list(n, &nodes);
+  int *slots = malloc(n * sizeof(int));
+  if (!slots) {
+    perror("malloc");
+    return 1;
+  }
+  for (int i = 0; i < n; i++)
+    round_slot_add(i + 3, &slots[i]);
+
+  long list_sum = 0, soa_sum = 0;
+  long long list_ns = 0, soa_ns = 0;
+  for (int r = 0; r < rounds; r++) {
+    list_ns += list_round(head, nodes, n, r, &list_sum);
+    soa_ns += soa_round(n, r, &soa_sum);
+  }
+
+  long list_score = 0, soa_score = 0;
+  for (int i = 0; i < n; i++) {
+    list_score += nodes[i]->score;
+    soa_score += round_state.score[i];
+  }
+
+  printf("Игроков %d, раундов %d\n", n, rounds);
+  printf("Список:  %.1f мкс на раунд, %.2f нс на игрока\n",
+         list_ns / 1e3 / rounds, (double)list_ns / rounds / n);
+  printf("Массивы: %.1f мкс на раунд, %.2f нс на игрока (x%.1f)\n",
+         soa_ns / 1e3 / rounds, (double)soa_ns / rounds / n,
+         (double)list_ns / soa_ns);
+  if (list_sum != soa_sum || list_score != soa_score) {
+    printf("Результаты расходятся: %ld/%ld, очки %ld/%ld\n", list_sum, soa_sum,
+           list_score, soa_score);
+    return 1;
+  }
+  player_memory(n, slots, head);
+  question_memory(question_count);
+
+  for (int i = 0; i < n; i++)
+    free(nodes[i]);
+  free(nodes);
+  free(slots);
+  round_free();
+  return 0;
+}
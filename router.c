@@ -0,0 +1,679 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cluster.h"
+
+#define ROUTER_PORT 5000
+#define MAX_BACKENDS 64
+#define VNODES 64
+#define BACKEND_GRACE_SEC 5
+#define FIRST_MSG_LEN 256
+#define PIPE_CHUNK 65536
+
+/* The router is the front door of a cluster: it takes clients on the game
+ * port, reads their first message for the room, picks a backend server.out
+ * for it and from then on only moves bytes between the two sockets with
+ * splice() through a pipe, without copying them into its own memory. It
+ * keeps no state that the backends can't give it back: they report their
+ * load and rooms over the control socket, so a restarted router picks up
+ * where it left off. */
+
+typedef struct {
+  int port; /* 0: free slot */
+  int ctl;  /* control connection, -1 while it's down */
+  time_t down_since;
+  int players;
+  int max_players;
+  int lobby;
+  int routed; /* clients sent here since its last report */
+  unsigned long routed_total;
+} Backend;
+
+typedef struct {
+  int fd;
+  int backend; /* -1 until the first report */
+  char buf[1024];
+  size_t len;
+  short revents;
+} Control;
+
+typedef struct {
+  char id[CLUSTER_ROOM_LEN];
+  int backend;
+} Room;
+
+typedef struct {
+  uint32_t hash;
+  int backend;
+} RingPoint;
+
+enum { LINK_FIRST, LINK_OPEN };
+
+/* fd[0] is the client, fd[1] the backend; pipe[d] carries what fd[d] sends
+ * to fd[!d], and queued[d] is how much of it is still in the pipe. */
+typedef struct {
+  int state;
+  int fd[2];
+  int pipe[2][2];
+  size_t queued[2];
+  int eof[2];
+  short revents[2];
+} Link;
+
+volatile sig_atomic_t stop = 0;
+
+Backend backends[MAX_BACKENDS];
+RingPoint ring[MAX_BACKENDS * VNODES];
+int ring_len = 0;
+
+Room *rooms = NULL;
+int room_count = 0;
+int room_cap = 0;
+
+Control *ctls = NULL;
+int ctl_count = 0;
+int ctl_cap = 0;
+
+Link *links = NULL;
+int link_count = 0;
+int link_cap = 0;
+
+struct pollfd *pfds = NULL;
+int pfds_cap = 0;
+
+unsigned long clients_total = 0;
+unsigned long clients_rejected = 0;
+unsigned long bytes_in = 0;  /* clients to backends */
+unsigned long bytes_out = 0; /* backends to clients */
+unsigned long splices = 0;
+unsigned long first_bytes = 0;
+
+void handle_sigint() { stop = 1; }
+
+void *xrealloc(void *ptr, size_t size) {
+  void *p = realloc(ptr, size);
+  if (!p) {
+    perror("realloc");
+    exit(1);
+  }
+  return p;
+}
+
+int by_hash(const void *a, const void *b) {
+  uint32_t x = ((const RingPoint *)a)->hash;
+  uint32_t y = ((const RingPoint *)b)->hash;
+  return x < y ? -1 : x > y;
+}
+
+void build_ring(void) {
+  ring_len = 0;
+  for (int b = 0; b < MAX_BACKENDS; b++) {
+    if (!backends[b].port)
+      continue;
+    for (int v = 0; v < VNODES; v++) {
+      char key[32];
+      snprintf(key, sizeof(key), "%d#%d", backends[b].port, v);
+      ring[ring_len].hash = cluster_hash(key);
+      ring[ring_len].backend = b;
+      ring_len++;
+    }
+  }
+  qsort(ring, ring_len, sizeof(RingPoint), by_hash);
+}
+
+/* Index of the first ring point at or after h, wrapping round. */
+int ring_find(uint32_t h) {
+  int lo = 0, hi = ring_len;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (ring[mid].hash < h)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo == ring_len ? 0 : lo;
+}
+
+int find_backend(int port) {
+  for (int b = 0; b < MAX_BACKENDS; b++) {
+    if (backends[b].port == port)
+      return b;
+  }
+  return -1;
+}
+
+Room *find_room(const char *id) {
+  for (int i = 0; i < room_count; i++) {
+    if (strcmp(rooms[i].id, id) == 0)
+      return &rooms[i];
+  }
+  return NULL;
+}
+
+void add_room(const char *id, int b) {
+  if (room_count == room_cap) {
+    room_cap = room_cap ? room_cap * 2 : 64;
+    rooms = xrealloc(rooms, room_cap * sizeof(Room));
+  }
+  snprintf(rooms[room_count].id, CLUSTER_ROOM_LEN, "%s", id);
+  rooms[room_count].backend = b;
+  room_count++;
+}
+
+int rooms_on(int b) {
+  int n = 0;
+  for (int i = 0; i < room_count; i++)
+    n += rooms[i].backend == b;
+  return n;
+}
+
+void tell_room(int b, const char *id) {
+  if (backends[b].ctl < 0)
+    return;
+  char msg[CLUSTER_ROOM_LEN + 8];
+  int len = snprintf(msg, sizeof(msg), "room %s\n", id);
+  send(backends[b].ctl, msg, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+int load_of(int b) { return backends[b].players + backends[b].routed; }
+
+/* A backend can take a new room while its lobby is open and not full. */
+int can_host(int b) {
+  Backend *be = &backends[b];
+  return be->port && be->ctl >= 0 && be->lobby && load_of(b) < be->max_players;
+}
+
+/* A server runs a single lobby, so a room only goes to one that has no room
+ * yet: the least loaded of them, and of equally loaded ones the first after
+ * the room's hash on the ring. -1 when every server already has a room. */
+int place_room(const char *id) {
+  int start = ring_find(cluster_hash(id));
+  int best = -1;
+  for (int i = 0; i < ring_len; i++) {
+    int b = ring[(start + i) % ring_len].backend;
+    if (!can_host(b) || rooms_on(b) > 0)
+      continue;
+    if (best < 0 || load_of(b) < load_of(best))
+      best = b;
+  }
+  return best;
+}
+
+int route(const char *id) {
+  Room *room = find_room(id);
+  if (room)
+    return room->backend;
+  int b = place_room(id);
+  if (b < 0)
+    return -1;
+  add_room(id, b);
+  tell_room(b, id);
+  printf("Комната \"%s\" -> порт %d\n", id, backends[b].port);
+  return b;
+}
+
+void drop_backend(int b) {
+  for (int i = 0; i < room_count;) {
+    if (rooms[i].backend == b)
+      rooms[i] = rooms[--room_count];
+    else
+      i++;
+  }
+  printf("Сервер на порту %d выбыл\n", backends[b].port);
+  memset(&backends[b], 0, sizeof(Backend));
+  backends[b].ctl = -1;
+  build_ring();
+}
+
+/* "load <port> <players> <max_players> <lobby> [<room> ...]" or "leave" */
+void on_report(Control *c, char *line) {
+  if (strcmp(line, "leave") == 0) {
+    if (c->backend >= 0 && backends[c->backend].ctl == c->fd)
+      drop_backend(c->backend);
+    c->backend = -1;
+    return;
+  }
+  int port, players, max_players, lobby, used;
+  if (sscanf(line, "load %d %d %d %d%n", &port, &players, &max_players,
+             &lobby, &used) != 4 ||
+      port <= 0)
+    return;
+
+  int b = c->backend >= 0 ? c->backend : find_backend(port);
+  if (b < 0) {
+    b = find_backend(0);
+    if (b < 0)
+      return;
+    backends[b].port = port;
+    build_ring();
+    printf("Подключён сервер на порту %d\n", port);
+  }
+  Backend *be = &backends[b];
+  if (c->backend < 0) {
+    /* A new process on a known port: a live upgrade or a restart. It gets
+     * the rooms placed here back. */
+    if (be->ctl >= 0 && be->ctl != c->fd) {
+      for (int i = 0; i < ctl_count; i++) {
+        if (ctls[i].fd == be->ctl)
+          ctls[i].backend = -1;
+      }
+    }
+    c->backend = b;
+    be->ctl = c->fd;
+    for (int i = 0; i < room_count; i++) {
+      if (rooms[i].backend == b)
+        tell_room(b, rooms[i].id);
+    }
+  }
+  be->players = players;
+  be->max_players = max_players;
+  be->lobby = lobby;
+  be->routed = 0;
+
+  /* A restarted router learns the rooms back from their servers. */
+  char *save = NULL;
+  for (char *id = strtok_r(line + used, " ", &save); id;
+       id = strtok_r(NULL, " ", &save)) {
+    if (!find_room(id))
+      add_room(id, b);
+  }
+}
+
+/* Returns -1 when the connection is gone. */
+int read_control(Control *c) {
+  ssize_t n = recv(c->fd, c->buf + c->len, sizeof(c->buf) - c->len - 1, 0);
+  if (n <= 0)
+    return n < 0 && (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+  c->len += n;
+  c->buf[c->len] = '\0';
+  char *line = c->buf;
+  char *end;
+  while ((end = strchr(line, '\n'))) {
+    *end = '\0';
+    on_report(c, line);
+    line = end + 1;
+  }
+  c->len -= line - c->buf;
+  memmove(c->buf, line, c->len);
+  if (c->len == sizeof(c->buf) - 1)
+    c->len = 0;
+  return 0;
+}
+
+void close_control(int i) {
+  Control *c = &ctls[i];
+  if (c->backend >= 0 && backends[c->backend].ctl == c->fd) {
+    backends[c->backend].ctl = -1;
+    backends[c->backend].down_since = time(NULL);
+  }
+  close(c->fd);
+  *c = ctls[--ctl_count];
+}
+
+void expire_backends(void) {
+  time_t now = time(NULL);
+  for (int b = 0; b < MAX_BACKENDS; b++) {
+    if (backends[b].port && backends[b].ctl < 0 &&
+        now - backends[b].down_since >= BACKEND_GRACE_SEC)
+      drop_backend(b);
+  }
+}
+
+int connect_backend(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  return fd;
+}
+
+void refuse(int fd, const char *msg) {
+  send(fd, msg, strlen(msg), MSG_DONTWAIT | MSG_NOSIGNAL);
+  clients_rejected++;
+}
+
+/* The first message is the only one the router reads itself: it may start
+ * with the room line, which the backend never sees. */
+int open_link(Link *l) {
+  char buf[FIRST_MSG_LEN];
+  ssize_t n = recv(l->fd[0], buf, sizeof(buf) - 1, 0);
+  if (n < 0)
+    return errno == EAGAIN || errno == EINTR ? 0 : -1;
+  if (n == 0)
+    return -1;
+  buf[n] = '\0';
+  first_bytes += n;
+
+  char room[CLUSTER_ROOM_LEN] = "";
+  const char *rest = buf;
+  if (strncmp(buf, CLUSTER_ROOM_PREFIX, strlen(CLUSTER_ROOM_PREFIX)) == 0) {
+    const char *id = buf + strlen(CLUSTER_ROOM_PREFIX);
+    size_t id_len = strcspn(id, " \r\n");
+    if (id_len >= sizeof(room))
+      id_len = sizeof(room) - 1;
+    memcpy(room, id, id_len);
+    room[id_len] = '\0';
+    const char *end = strchr(id, '\n');
+    rest = end ? end + 1 : buf + n;
+  }
+
+  int b = route(room);
+  if (b < 0) {
+    refuse(l->fd[0], "Нет свободного игрового сервера для комнаты, "
+                     "попробуйте позже.\n");
+    return -1;
+  }
+  l->fd[1] = connect_backend(backends[b].port);
+  if (l->fd[1] < 0) {
+    refuse(l->fd[0], "Игровой сервер недоступен, попробуйте позже.\n");
+    return -1;
+  }
+  for (int d = 0; d < 2; d++) {
+    if (pipe2(l->pipe[d], O_NONBLOCK | O_CLOEXEC) < 0) {
+      perror("pipe2");
+      return -1;
+    }
+  }
+  size_t rest_len = buf + n - rest;
+  if (rest_len > 0 && send(l->fd[1], rest, rest_len, MSG_NOSIGNAL) < 0)
+    return -1;
+  backends[b].routed++;
+  backends[b].routed_total++;
+  l->state = LINK_OPEN;
+  return 0;
+}
+
+/* Moves one pipe's worth from fd[d] to fd[!d]. Whatever the other side can't
+ * take yet stays in the pipe, and fd[d] isn't read until it is out. */
+int pump(Link *l, int d) {
+  if (l->queued[d] == 0 && !l->eof[d]) {
+    ssize_t n = splice(l->fd[d], NULL, l->pipe[d][1], NULL, PIPE_CHUNK,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    splices++;
+    if (n == 0)
+      l->eof[d] = 1;
+    else if (n < 0)
+      return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    else
+      l->queued[d] = n;
+    if (d == 0)
+      bytes_in += n > 0 ? n : 0;
+    else
+      bytes_out += n > 0 ? n : 0;
+  }
+  while (l->queued[d] > 0) {
+    ssize_t n = splice(l->pipe[d][0], NULL, l->fd[!d], NULL, l->queued[d],
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    splices++;
+    if (n < 0)
+      return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    l->queued[d] -= n;
+  }
+  return 0;
+}
+
+/* Either side closing ends the link once what it sent has been passed on. */
+int service_link(Link *l) {
+  if (l->state == LINK_FIRST)
+    return l->revents[0] ? open_link(l) : 0;
+  for (int d = 0; d < 2; d++) {
+    int readable = l->queued[d] == 0 && (l->revents[d] & ~POLLOUT);
+    int writable = l->queued[d] > 0 && l->revents[!d];
+    if ((readable || writable) && pump(l, d) < 0)
+      return -1;
+  }
+  for (int d = 0; d < 2; d++) {
+    if (l->eof[d] && l->queued[d] == 0)
+      return -1;
+  }
+  return 0;
+}
+
+void close_link(int i) {
+  Link *l = &links[i];
+  for (int d = 0; d < 2; d++) {
+    if (l->fd[d] >= 0)
+      close(l->fd[d]);
+    for (int e = 0; e < 2; e++) {
+      if (l->pipe[d][e] >= 0)
+        close(l->pipe[d][e]);
+    }
+  }
+  *l = links[--link_count];
+}
+
+void accept_clients(int listen_fd) {
+  while (1) {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        perror("accept");
+      return;
+    }
+    if (link_count == link_cap) {
+      link_cap = link_cap ? link_cap * 2 : 1024;
+      links = xrealloc(links, link_cap * sizeof(Link));
+    }
+    Link *l = &links[link_count++];
+    memset(l, 0, sizeof(*l));
+    l->fd[0] = fd;
+    l->fd[1] = -1;
+    for (int d = 0; d < 2; d++)
+      l->pipe[d][0] = l->pipe[d][1] = -1;
+    clients_total++;
+  }
+}
+
+void accept_controls(int listen_fd) {
+  while (1) {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+      return;
+    if (ctl_count == ctl_cap) {
+      ctl_cap = ctl_cap ? ctl_cap * 2 : 16;
+      ctls = xrealloc(ctls, ctl_cap * sizeof(Control));
+    }
+    Control *c = &ctls[ctl_count++];
+    c->fd = fd;
+    c->backend = -1;
+    c->len = 0;
+  }
+}
+
+int open_listen(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("socket");
+    exit(1);
+  }
+  int reuse = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = INADDR_ANY;
+  addr.sin_port = htons(port);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("bind");
+    exit(1);
+  }
+  if (listen(fd, SOMAXCONN) < 0) {
+    perror("listen");
+    exit(1);
+  }
+  return fd;
+}
+
+int open_control_socket(const char *path) {
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("socket");
+    exit(1);
+  }
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("bind");
+    exit(1);
+  }
+  if (listen(fd, SOMAXCONN) < 0) {
+    perror("listen");
+    exit(1);
+  }
+  return fd;
+}
+
+void add_pfd(int *n, int fd, short events) {
+  pfds[*n].fd = fd;
+  pfds[*n].events = events;
+  pfds[*n].revents = 0;
+  (*n)++;
+}
+
+void print_stats(void) {
+  printf("\nКлиентов %lu (отказано %lu), на связи %d, комнат %d\n",
+         clients_total, clients_rejected, link_count, room_count);
+  printf("splice: к серверам %lu байт, к клиентам %lu байт, вызовов %lu; "
+         "прочитано самим маршрутизатором %lu байт (первые сообщения)\n",
+         bytes_in, bytes_out, splices, first_bytes);
+  for (int b = 0; b < MAX_BACKENDS; b++) {
+    Backend *be = &backends[b];
+    if (!be->port)
+      continue;
+    printf("  порт %d: направлено %lu, комнат %d, игроков %d/%d, %s\n",
+           be->port, be->routed_total, rooms_on(b), be->players,
+           be->max_players,
+           be->ctl < 0 ? "нет связи" : be->lobby ? "лобби" : "идёт игра");
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int port = ROUTER_PORT;
+  const char *control_path = CLUSTER_CONTROL_PATH;
+  int bad = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "p:c:")) != -1) {
+    switch (opt) {
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'c':
+      control_path = optarg;
+      break;
+    default:
+      bad = 1;
+    }
+  }
+  if (bad || optind != argc) {
+    printf("Использование: %s [-p порт] [-c управляющий_сокет]\n", argv[0]);
+    return 1;
+  }
+
+  signal(SIGINT, handle_sigint);
+  signal(SIGPIPE, SIG_IGN);
+  for (int b = 0; b < MAX_BACKENDS; b++)
+    backends[b].ctl = -1;
+
+  int listen_fd = open_listen(port);
+  int control_fd = open_control_socket(control_path);
+  printf("Маршрутизатор: клиенты на порту %d, серверы сообщают о себе в %s\n",
+         port, control_path);
+  fflush(stdout);
+
+  while (!stop) {
+    int want = 2 + ctl_count + 2 * link_count;
+    if (want > pfds_cap) {
+      pfds_cap = want * 2;
+      pfds = xrealloc(pfds, pfds_cap * sizeof(struct pollfd));
+    }
+    int n = 0;
+    add_pfd(&n, listen_fd, POLLIN);
+    add_pfd(&n, control_fd, POLLIN);
+    for (int i = 0; i < ctl_count; i++)
+      add_pfd(&n, ctls[i].fd, POLLIN);
+    for (int i = 0; i < link_count; i++) {
+      Link *l = &links[i];
+      if (l->state == LINK_FIRST) {
+        add_pfd(&n, l->fd[0], POLLIN);
+        continue;
+      }
+      for (int d = 0; d < 2; d++) {
+        short events = 0;
+        if (l->queued[d] == 0 && !l->eof[d])
+          events |= POLLIN;
+        if (l->queued[!d] > 0)
+          events |= POLLOUT;
+        add_pfd(&n, l->fd[d], events);
+      }
+    }
+
+    if (poll(pfds, n, 1000) < 0) {
+      if (errno != EINTR)
+        perror("poll");
+      continue;
+    }
+
+    int p = 2;
+    int ctls_polled = ctl_count;
+    for (int i = 0; i < ctls_polled; i++)
+      ctls[i].revents = pfds[p++].revents;
+    int links_polled = link_count;
+    for (int i = 0; i < links_polled; i++) {
+      Link *l = &links[i];
+      l->revents[0] = pfds[p++].revents;
+      l->revents[1] = l->state == LINK_FIRST ? 0 : pfds[p++].revents;
+    }
+
+    for (int i = ctls_polled - 1; i >= 0; i--) {
+      if (ctls[i].revents && read_control(&ctls[i]) < 0)
+        close_control(i);
+    }
+    for (int i = links_polled - 1; i >= 0; i--) {
+      if (service_link(&links[i]) < 0)
+        close_link(i);
+    }
+    if (pfds[1].revents)
+      accept_controls(control_fd);
+    if (pfds[0].revents)
+      accept_clients(listen_fd);
+    expire_backends();
+    fflush(stdout);
+  }
+
+  print_stats();
+  while (link_count > 0)
+    close_link(link_count - 1);
+  while (ctl_count > 0)
+    close_control(ctl_count - 1);
+  free(links);
+  free(ctls);
+  free(rooms);
+  free(pfds);
+  close(listen_fd);
+  close(control_fd);
+  unlink(control_path);
+  return 0;
+}
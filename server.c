@@ -1,16 +1,32 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <ifaddrs.h>
+#include <limits.h>
 #include <netdb.h>
-#include <poll.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "capture.h"
+#include "cluster.h"
+#include "handoff.h"
+#include "journal.h"
+#include "latency.h"
+#include "match.h"
+#include "net.h"
+#include "qselect.h"
+#include "round.h"
+#include "session.h"
+#include "spectate.h"
+#include "strpool.h"
+
 #define PORT 5000
 #define MAX_PLAYERS 10
 #define MAX_QUESTION_LEN 256
@@ -21,168 +37,450 @@
 #define BASE_POINTS 10
 #define CONNECT_TIMEOUT 30
 #define QUESTIONS_FILE "questions.txt"
-
+#define MAX_CATEGORIES 64
+#define CATEGORY_OVERFLOW -2
+#define MAX_CATEGORY_LEN 64
+/* Starts a category line of the questions file; any other line is text. */
+#define CATEGORY_MARKER "#category:"
+#define EVENTS_PER_WAIT 64
+#define HANDSHAKE_TIMEOUT 5
+/* Lobby connections that haven't said who they are yet, beyond max_players:
+ * room for spectator relays when the lobby is full. */
+#define PENDING_EXTRA 16
+
+/* The texts are in question_texts; a question is only their handles. */
 typedef struct {
-  char question[MAX_QUESTION_LEN];
-  char options[OPTIONS_COUNT][MAX_ANSWER_LEN];
-  int correct_option;
+  StrRef question;
+  StrRef options[OPTIONS_COUNT];
+  uint8_t correct_option;
+  uint8_t category;
+  uint8_t difficulty; /* 1-5, 0 if the file doesn't say */
 } Question;
 
+/* The rest of a player is their slot in round_state. The node only stays put
+ * while the slot moves, so sessions can point to it. */
 typedef struct Player {
-  int id;
-  int sock;
-  char name[MAX_NAME_LEN];
-  int score;
-  int answered;
-  int answer;
-  int answer_time;
-  int ready;
-  int connected;
-  struct Player *next;
+  int slot;    /* first: round_state.owner_slot points here */
+  StrRef name; /* interned in player_names */
 } Player;
 
+/* Player nodes are allocated in blocks; a free one links to the next. */
+typedef union PlayerNode {
+  Player player;
+  union PlayerNode *next;
+} PlayerNode;
+
 typedef struct {
   int sock;
   char name[MAX_NAME_LEN];
   int bytes_received;
 } PendingPlayer;
 
-Player *head = NULL;
+/* A connection accepted during the game. It may only send "/resume <token>";
+ * anything else (or silence) gets it closed. */
+typedef struct {
+  int sock;
+  time_t accepted_at;
+} Handshake;
+
 int server_fd = -1;
 Question *questions = NULL;
 int question_count = 0;
+StrPool question_texts;
+
+/* The names of the room and of parked players, interned, so a name is taken
+ * exactly when it is in the table. A name goes when its player leaves for
+ * good, and the pool is rebuilt once such names outweigh the live ones.
+ * Player nodes come from blocks that are never freed or moved (round_state
+ * keeps pointers to their slot), and a leaving player's node is reused by the
+ * next one to join. */
+#define PLAYER_BLOCK 256
+StrPool player_names;
+PlayerNode *spare_players = NULL;
+PlayerNode **player_blocks = NULL;
+int player_block_count = 0;
+int players_live = 0;
+int players_peak = 0;
+unsigned long join_allocs = 0;
+
+char category_names[MAX_CATEGORIES][MAX_CATEGORY_LEN];
+int category_count = 0;
+QuestionIndex question_index;
+
+/* The questions of the current game, by round. */
+int *game_questions = NULL;
+int game_len = 0;
+uint32_t game_seed = 0;
+int max_players = MAX_PLAYERS;
+int listen_port = PORT;
+int players_joined = 0;
+unsigned long answers_total = 0;
+int current_round = -1;
+
+/* With -l answer time is counted from when the player actually received the
+ * question: time since it was sent minus the connection's RTT (half for the
+ * question to arrive, half for the answer to come back). */
+int compensate_latency = 0;
+int64_t round_start_ns = 0;
+LatencyHist room_rtt;
+
+/* -r writes every client event to a capture file; -R serves a replay of one
+ * (see replay.c): answers may carry their recorded time as "N@us" and the
+ * pauses between rounds are skipped. */
+const char *capture_path = NULL;
+int replay_mode = 0;
+
+Handshake *handshakes = NULL;
+int handshake_count = 0;
+
+/* Spectators watch through relay processes (relay.c) that connect like a
+ * player and send SPECTATE_HELLO. Each message goes once to every relay, so
+ * the size of the audience never reaches this process. */
+SpecState spectators;
+int *relays = NULL;
+int relay_count = 0;
+/* Reused by every publish; they only grow. */
+ssize_t *relay_res = NULL;
+char *relay_frame = NULL;
+size_t relay_frame_cap = 0;
+int relays_seen = 0;
+unsigned long relay_messages = 0;
+unsigned long relay_bytes = 0;
+
+/* Players of an interrupted game read back from the journal that haven't
+ * reconnected yet. */
+JournalState recovered;
+
+void send_to_all_except(const char *msg, int exclude_id);
+void free_players(void);
+void print_io_stats(void);
+void park_player(Player *p);
+void publish(int kind, const char *text);
+void close_relays(void);
+
+int64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-void send_to_all_except(Player *head, const char *msg, int exclude_id);
-void free_players(Player *head);
+/* Pause for the players to read the scoreboard; a replay doesn't need it. */
+void pause_sec(int sec) {
+  if (!replay_mode)
+    sleep(sec);
+}
 
-Player *add_player(Player *head, int sock, const char *name, int id) {
-  Player *p = malloc(sizeof(Player));
-  if (!p) {
-    perror("malloc");
-    exit(1);
+void capture_events(const NetEvent *events, int n, int64_t t_ns) {
+  for (int i = 0; i < n; i++) {
+    const NetEvent *ev = &events[i];
+    if (ev->type == NET_EV_ACCEPT)
+      capture_accept(ev->fd, current_round, t_ns);
+    else if (ev->type == NET_EV_DATA)
+      capture_data(ev->fd, current_round, t_ns, ev->data, ev->len);
+    else
+      capture_closed(ev->fd, current_round, t_ns);
   }
-  p->id = id;
-  p->sock = sock;
-  strncpy(p->name, name, sizeof(p->name) - 1);
-  p->name[sizeof(p->name) - 1] = '\0';
-  p->score = 0;
-  p->answered = 0;
-  p->ready = 0;
-  p->connected = 1;
-  p->next = NULL;
-
-  if (!head)
-    return p;
+}
 
-  Player *cur = head;
-  while (cur->next)
-    cur = cur->next;
-  cur->next = p;
-  return head;
+const char *player_name(const Player *p) {
+  return strpool_get(&player_names, p->name);
 }
 
-Player *remove_player(Player *head, int sock) {
-  Player *cur = head;
-  Player *prev = NULL;
+/* Slots 0..round_state.len-1 are the room. */
+Player *player_at(int slot) { return (Player *)round_state.owner_slot[slot]; }
+
+const char *text_of(StrRef text) { return strpool_get(&question_texts, text); }
+
+/* -1 if the pool is full. */
+int intern_name(const char *name, StrRef *ref) {
+  size_t cap = player_names.cap;
+  size_t table_cap = player_names.table_cap;
+  if (strpool_intern(&player_names, name, strnlen(name, MAX_NAME_LEN - 1),
+                     ref) < 0) {
+    printf("Пул имён игроков заполнен\n");
+    return -1;
+  }
+  if (player_names.cap != cap || player_names.table_cap != table_cap)
+    join_allocs++;
+  return 0;
+}
 
-  while (cur) {
-    if (cur->sock == sock) {
-      if (prev)
-        prev->next = cur->next;
-      else
-        head = cur->next;
+void release_name(Player *p) { strpool_remove(&player_names, p->name); }
 
-      close(cur->sock);
-      free(cur);
-      return head;
+/* Rebuilds player_names from the room and the parked sessions once the
+ * names of players who are gone take more than half of it. */
+void compact_names(void) {
+  if (2 * player_names.dead <= player_names.len)
+    return;
+  StrPool fresh;
+  memset(&fresh, 0, sizeof(fresh));
+  for (int i = 0; i < round_state.len; i++) {
+    Player *p = player_at(i);
+    strpool_intern(&fresh, player_name(p), p->name.len, &p->name);
+  }
+  for (int id = 1; id <= session_max_id(); id++) {
+    const ParkedState *st = session_parked_at(id);
+    StrRef ref;
+    if (st)
+      strpool_intern(&fresh, st->name, strnlen(st->name, MAX_NAME_LEN - 1),
+                     &ref);
+  }
+  strpool_free(&player_names);
+  player_names = fresh;
+}
+
+Player *new_player(void) {
+  if (!spare_players) {
+    PlayerNode *block = malloc(PLAYER_BLOCK * sizeof(PlayerNode));
+    PlayerNode **blocks = realloc(
+        player_blocks, (player_block_count + 1) * sizeof(PlayerNode *));
+    if (!block || !blocks) {
+      perror("malloc");
+      exit(1);
+    }
+    player_blocks = blocks;
+    player_blocks[player_block_count++] = block;
+    for (int i = 0; i < PLAYER_BLOCK; i++) {
+      block[i].next = spare_players;
+      spare_players = &block[i];
     }
-    prev = cur;
-    cur = cur->next;
+    join_allocs++;
   }
-  return head;
+  PlayerNode *node = spare_players;
+  spare_players = node->next;
+  if (++players_live > players_peak)
+    players_peak = players_live;
+  return &node->player;
+}
+
+void release_player(Player *p) {
+  PlayerNode *node = (PlayerNode *)p;
+  node->next = spare_players;
+  spare_players = node;
+  players_live--;
+}
+
+/* Reused by every broadcast; they only grow with the room. */
+int *send_fds = NULL;
+int *send_targets = NULL;
+ssize_t *send_res = NULL;
+int64_t *send_ns = NULL;
+int send_cap = 0;
+
+void free_texts(void) {
+  for (int i = 0; i < player_block_count; i++)
+    free(player_blocks[i]);
+  free(player_blocks);
+  player_blocks = NULL;
+  player_block_count = 0;
+  spare_players = NULL;
+  strpool_free(&player_names);
+  strpool_free(&question_texts);
+  free(send_fds);
+  free(send_targets);
+  free(send_res);
+  free(send_ns);
+  send_fds = NULL;
+  send_targets = NULL;
+  send_res = NULL;
+  send_ns = NULL;
+  send_cap = 0;
+}
+
+/* NULL if there is no room for the name. */
+Player *add_player(int sock, const char *name, int id) {
+  StrRef ref;
+  if (intern_name(name, &ref) < 0)
+    return NULL;
+  Player *p = new_player();
+  p->name = ref;
+  int slots = round_state.cap;
+  round_slot_add(sock, &p->slot);
+  if (round_state.cap != slots)
+    join_allocs++;
+  round_state.id[p->slot] = id;
+  return p;
+}
+
+void remove_player(Player *p) {
+  net_close(round_state.sock[p->slot]);
+  round_slot_remove(p->slot);
+  release_player(p);
 }
 
 void handle_sigint() {
   printf("\nСервером получен сигнал для завершения, закрываем соединения...\n");
 
-  if (head) {
-    send_to_all_except(head, "\nСервер завершает работу. Игра остановлена.\n",
-                       -1);
+  if (round_state.len > 0) {
+    send_to_all_except("\nСервер завершает работу. Игра остановлена.\n", -1);
+    free_players();
   }
 
-  if (head)
-    free_players(head);
-
   if (server_fd >= 0)
     close(server_fd);
 
   free(questions);
+  free(game_questions);
+  qsel_free(&question_index);
+  journal_close();
+  capture_close();
+  close_relays();
+  journal_state_free(&recovered);
+  session_free();
+  cluster_leave();
+  print_io_stats();
+  round_free();
+  free_texts();
+  net_shutdown();
   exit(0);
 }
 
-Player *cleanup_disconnected(Player *head) {
-  Player *cur = head;
-  Player *prev = NULL;
+/* Backwards, since a removal moves the last slot into the hole. */
+void cleanup_disconnected(void) {
+  for (int i = round_state.len - 1; i >= 0; i--) {
+    if (!round_state.connected[i]) {
+      Player *dead = player_at(i);
+      park_player(dead);
+      remove_player(dead);
+    }
+  }
+}
+
+Player *find_player(int sock) {
+  for (int i = 0; i < round_state.len; i++) {
+    if (round_state.sock[i] == sock)
+      return player_at(i);
+  }
+  return NULL;
+}
 
-  while (cur) {
-    if (!cur->connected) {
-      Player *dead = cur;
-      if (prev)
-        prev->next = cur->next;
-      else
-        head = cur->next;
+/* Fan-out goes through net_send_many() so the io_uring backend can push the
+ * whole broadcast in one submission. With `since_ns` set, each player's
+ * question_us becomes the time its send returned, counted from since_ns. */
+void send_to_players_since(const char *msg, int exclude_id, int connected_only,
+                           int64_t since_ns) {
+  int count = round_state.len;
+  if (count == 0)
+    return;
 
-      cur = cur->next;
-      close(dead->sock);
-      free(dead);
-    } else {
-      prev = cur;
-      cur = cur->next;
+  if (count > send_cap) {
+    send_fds = realloc(send_fds, count * sizeof(int));
+    send_targets = realloc(send_targets, count * sizeof(int));
+    send_res = realloc(send_res, count * sizeof(ssize_t));
+    send_ns = realloc(send_ns, count * sizeof(int64_t));
+    if (!send_fds || !send_targets || !send_res || !send_ns) {
+      perror("realloc");
+      exit(1);
     }
+    send_cap = count;
   }
-  return head;
-}
+  int *fds = send_fds;
+  int *targets = send_targets;
+  ssize_t *res = send_res;
 
-void send_to_all_except(Player *head, const char *msg, int exclude_id) {
-  Player *cur = head;
-  while (cur) {
-    if (cur->connected && cur->id != exclude_id) {
-      ssize_t s = send(cur->sock, msg, strlen(msg), 0);
-      if (s <= 0) {
-        cur->connected = 0;
-      }
+  int n = 0;
+  for (int i = 0; i < count; i++) {
+    if ((round_state.connected[i] || !connected_only) &&
+        round_state.id[i] != exclude_id) {
+      fds[n] = round_state.sock[i];
+      targets[n++] = i;
+    }
+  }
+
+  net_send_many_timed(fds, n, msg, strlen(msg), res,
+                      since_ns ? send_ns : NULL);
+  for (int i = 0; i < n; i++) {
+    if (since_ns)
+      round_state.question_us[targets[i]] =
+          (int32_t)((send_ns[i] - since_ns) / 1000);
+    if (res[i] <= 0) {
+      if (!connected_only && round_state.connected[targets[i]])
+        printf("[%s] отключился\n", player_name(player_at(targets[i])));
+      round_state.connected[targets[i]] = 0;
     }
-    cur = cur->next;
   }
 }
 
-void notify_about_disconnected(Player *head) {
-  Player *cur = head;
-  char msg[256];
+void send_to_players(const char *msg, int exclude_id, int connected_only) {
+  send_to_players_since(msg, exclude_id, connected_only, 0);
+}
+
+void send_to_all_except(const char *msg, int exclude_id) {
+  send_to_players(msg, exclude_id, 1);
+}
 
-  while (cur) {
-    if (!cur->connected) {
-      snprintf(msg, sizeof(msg), "[%s] покинул игру\n", cur->name);
-      send_to_all_except(head, msg, cur->id);
+void notify_about_disconnected(void) {
+  char msg[256];
+  for (int i = 0; i < round_state.len; i++) {
+    if (!round_state.connected[i]) {
+      snprintf(msg, sizeof(msg), "[%s] покинул игру\n",
+               player_name(player_at(i)));
+      send_to_all_except(msg, round_state.id[i]);
     }
-    cur = cur->next;
   }
 }
 
 void send_to_pending(PendingPlayer *pending, int count, const char *msg) {
   for (int i = 0; i < count; i++) {
-    send(pending[i].sock, msg, strlen(msg), 0);
+    net_send(pending[i].sock, msg, strlen(msg));
   }
 }
 
-void free_players(Player *head) {
-  Player *cur = head;
-  while (cur) {
-    Player *tmp = cur;
-    cur = cur->next;
-    close(tmp->sock);
-    free(tmp);
+void free_players(void) {
+  while (round_state.len > 0)
+    remove_player(player_at(round_state.len - 1));
+}
+
+int find_category(const char *name) {
+  for (int i = 0; i < category_count; i++) {
+    if (strcmp(category_names[i], name) == 0)
+      return i;
+  }
+  return -1;
+}
+
+int is_category_line(const char *line) {
+  return strncmp(line, CATEGORY_MARKER, strlen(CATEGORY_MARKER)) == 0;
+}
+
+/* Id of a category, added if new; CATEGORY_OVERFLOW once the table is full. */
+int category_id(const char *name) {
+  int id = find_category(name);
+  if (id >= 0)
+    return id;
+  if (category_count == MAX_CATEGORIES)
+    return CATEGORY_OVERFLOW;
+  snprintf(category_names[category_count], MAX_CATEGORY_LEN, "%.*s",
+           MAX_CATEGORY_LEN - 1, name);
+  return category_count++;
+}
+
+/* Next non-empty line of the questions file without its newline. Lines
+ * "#category: <category> [difficulty]" are consumed here and set the category
+ * and difficulty (1-5) of the questions after them. */
+void next_question_line(FILE *file, char *line, int size, int *category,
+                        int *difficulty) {
+  while (fgets(line, size, file)) {
+    line[strcspn(line, "\r\n")] = 0;
+    if (line[0] == '\0')
+      continue;
+    if (!is_category_line(line))
+      return;
+
+    char *name = line + strlen(CATEGORY_MARKER);
+    while (*name == ' ')
+      name++;
+    char *last = strrchr(name, ' ');
+    int level = last ? atoi(last + 1) : 0;
+    if (level >= 1 && level <= QSEL_MAX_DIFFICULTY) {
+      *difficulty = level;
+      *last = '\0';
+    } else {
+      *difficulty = 0;
+    }
+    *category = category_id(name);
   }
+  line[0] = '\0';
 }
 
 /* i dislike this func tbh...
@@ -199,12 +497,21 @@ int load_questions(const char *filename) {
 
   char line[MAX_QUESTION_LEN * 2];
   int count = 0;
+  size_t text_bytes = 0;
 
   while (fgets(line, sizeof(line), file)) {
-    if (strlen(line) > 1)
+    if (strlen(line) > 1 && !is_category_line(line)) {
       count++;
+      text_bytes += strlen(line);
+    }
   }
   question_count = count / 6;
+  /* Every line's newline becomes its '\0': one allocation for all texts. */
+  if (strpool_reserve(&question_texts, text_bytes) < 0) {
+    printf("Ошибка: файл %s слишком большой\n", filename);
+    fclose(file);
+    return 0;
+  }
 
   questions = malloc(question_count * sizeof(Question));
   if (!questions) {
@@ -213,24 +520,85 @@ int load_questions(const char *filename) {
   }
 
   rewind(file);
+  int category = -1;
+  int difficulty = 0;
   for (int i = 0; i < question_count; i++) {
-    fgets(questions[i].question, MAX_QUESTION_LEN, file);
-    questions[i].question[strcspn(questions[i].question, "\n")] = 0;
+    next_question_line(file, line, sizeof(line), &category, &difficulty);
+    if (category == -1)
+      category = category_id("");
+    if (category == CATEGORY_OVERFLOW) {
+      printf("Ошибка: в файле %s больше %d категорий\n", filename,
+             MAX_CATEGORIES);
+      fclose(file);
+      return 0;
+    }
+    int full = strpool_add(&question_texts, line,
+                           strnlen(line, MAX_QUESTION_LEN - 1),
+                           &questions[i].question) < 0;
+    questions[i].category = category;
+    questions[i].difficulty = difficulty;
 
     for (int j = 0; j < OPTIONS_COUNT; j++) {
-      fgets(questions[i].options[j], MAX_ANSWER_LEN, file);
-      questions[i].options[j][strcspn(questions[i].options[j], "\n")] = 0;
+      next_question_line(file, line, sizeof(line), &category, &difficulty);
+      full |= strpool_add(&question_texts, line,
+                          strnlen(line, MAX_ANSWER_LEN - 1),
+                          &questions[i].options[j]) < 0;
+    }
+    if (full) {
+      printf("Ошибка: файл %s слишком большой\n", filename);
+      fclose(file);
+      return 0;
     }
 
-    fgets(line, sizeof(line), file);
-    sscanf(line, "%d", &questions[i].correct_option);
+    next_question_line(file, line, sizeof(line), &category, &difficulty);
+    int correct = 0;
+    sscanf(line, "%d", &correct);
+    questions[i].correct_option = correct;
   }
 
   fclose(file);
-  printf("Загружено вопросов: %d\n", question_count);
+  printf("Загружено вопросов: %d, категорий: %d\n", question_count,
+         category_count);
   return 1;
 }
 
+/* Builds the index arrays the game's questions are drawn from. */
+void index_questions(void) {
+  int *category = malloc((question_count ? question_count : 1) * sizeof(int));
+  int *difficulty =
+      malloc((question_count ? question_count : 1) * sizeof(int));
+  if (!category || !difficulty) {
+    perror("malloc");
+    exit(1);
+  }
+  for (int i = 0; i < question_count; i++) {
+    category[i] = questions[i].category;
+    difficulty[i] = questions[i].difficulty;
+  }
+  qsel_build(&question_index, category, difficulty, question_count,
+             category_count);
+  free(category);
+  free(difficulty);
+}
+
+/* Draws this game's questions. The same seed and filters over the same file
+ * give the same game, which is what journal recovery relies on; `game` is the
+ * game's number in a -m series, whose games don't repeat questions. */
+void pick_game(uint32_t seed, int category, int difficulty, int count,
+               int game) {
+  if (count <= 0 || count > question_count)
+    count = question_count;
+  free(game_questions);
+  game_questions = malloc((count ? count : 1) * sizeof(int));
+  if (!game_questions) {
+    perror("malloc");
+    exit(1);
+  }
+  game_seed = seed;
+  game_len = qsel_pick(&question_index, category, difficulty, count, seed,
+                       game, game_questions);
+}
+
 void clean_string(char *str) {
   int i = 0, j = 0;
   while (str[i]) {
@@ -242,33 +610,27 @@ void clean_string(char *str) {
   str[j] = '\0';
 }
 
-int name_exists(Player *head, const char *name) {
-  Player *cur = head;
-  while (cur) {
-    if (strcmp(cur->name, name) == 0) {
-      return 1;
-    }
-    cur = cur->next;
-  }
-  return 0;
-}
-
-int calculate_score(int is_correct, int time_spent) {
-  if (!is_correct)
-    return 0;
-
-  int time_bonus = TIME_PER_QUESTION - time_spent;
-  if (time_bonus < 0)
-    time_bonus = 0;
-
-  return BASE_POINTS + time_bonus;
+/* Only looks the name up: probing name_1, name_2... doesn't fill the pool.
+ * A parked player keeps their name interned until the grace period runs out,
+ * so the resumed player doesn't meet a namesake. */
+int name_exists(const char *name) {
+  StrRef ref;
+  return strpool_find(&player_names, name, strnlen(name, MAX_NAME_LEN - 1),
+                      &ref);
 }
 
-void send_question(Player *head, int q_index) {
-  char buffer[1024];
-  Question q = questions[q_index];
-
-  snprintf(buffer, sizeof(buffer),
+/* Spectators get the question without the answer prompt. */
+void format_question(char *buffer, size_t size, int q_index, int seconds,
+                     int for_player) {
+  const Question *q = &questions[game_questions[q_index]];
+  char prompt[128];
+  if (for_player)
+    snprintf(prompt, sizeof(prompt),
+             "У вас есть %d секунд! Введите номер ответа (1-4): \n", seconds);
+  else
+    snprintf(prompt, sizeof(prompt), "На ответ %d секунд.\n", seconds);
+
+  snprintf(buffer, size,
            "\n=================================================\n"
            "Вопрос %d/%d:\n"
            "%s\n\n"
@@ -277,45 +639,868 @@ void send_question(Player *head, int q_index) {
            "2) %s\n"
            "3) %s\n"
            "4) %s\n\n"
-           "У вас есть %d секунд! Введите номер ответа (1-4): \n",
-           q_index + 1, question_count, q.question, q.options[0], q.options[1],
-           q.options[2], q.options[3], TIME_PER_QUESTION);
+           "%s",
+           q_index + 1, game_len, text_of(q->question), text_of(q->options[0]),
+           text_of(q->options[1]), text_of(q->options[2]),
+           text_of(q->options[3]), prompt);
+}
 
-  send_to_all_except(head, buffer, -1);
+/* Refreshes the player's RTT from TCP_INFO and adds it to the room's
+ * distribution. */
+void sample_rtt(int slot) {
+  int rtt = latency_rtt_us(round_state.sock[slot]);
+  if (rtt < 0)
+    return;
+  round_state.rtt_us[slot] = rtt;
+  latency_record(&room_rtt, rtt);
 }
 
-int all_players_answered(Player *head) {
-  Player *cur = head;
-  while (cur) {
-    if (cur->connected && !cur->answered) {
-      return 0;
+void send_question(int q_index) {
+  char buffer[1024];
+  format_question(buffer, sizeof(buffer), q_index, TIME_PER_QUESTION, 1);
+  /* The round starts before the fan-out; with -l every player's clock starts
+   * when the send to it returned, so the sends ahead of theirs don't count.
+   * The spectators are served after that. */
+  round_start_ns = monotonic_ns();
+  send_to_players_since(buffer, -1, 1, compensate_latency ? round_start_ns : 0);
+  for (int i = 0; i < round_state.len; i++) {
+    if (!round_state.connected[i])
+      continue;
+    if (!compensate_latency)
+      round_state.question_us[i] = 0;
+    sample_rtt(i);
+  }
+  format_question(buffer, sizeof(buffer), q_index, TIME_PER_QUESTION, 0);
+  publish(SPEC_QUESTION, buffer);
+}
+
+void issue_token(Player *p) {
+  char token[SESSION_TOKEN_LEN];
+  char msg[SESSION_TOKEN_LEN + 16];
+  int sock = round_state.sock[p->slot];
+  session_register(round_state.id[p->slot], p, token, sizeof(token));
+  capture_token(sock, current_round, monotonic_ns(), token);
+  snprintf(msg, sizeof(msg), "/token %s\n", token);
+  net_send(sock, msg, strlen(msg));
+}
+
+/* A player without a session (one from the matchmaking queue) isn't coming
+ * back, and gives up the name right away. */
+void park_player(Player *p) {
+  int id = round_state.id[p->slot];
+  ParkedState st;
+  snprintf(st.name, sizeof(st.name), "%s", player_name(p));
+  st.score = round_state.score[p->slot];
+  st.ready = round_state.ready[p->slot];
+  st.round = current_round;
+  st.answered = round_state.answered[p->slot];
+  st.answer = round_state.answer[p->slot];
+  st.answer_time_us = round_state.answer_time_us[p->slot];
+  session_park(id, &st);
+  if (!session_parked_at(id))
+    release_name(p);
+}
+
+void on_session_expired(int id, const ParkedState *st) {
+  printf("[%s] не вернулся за %d сек, место освобождено\n", st->name,
+         SESSION_GRACE_SEC);
+  StrRef ref;
+  if (strpool_find(&player_names, st->name,
+                   strnlen(st->name, MAX_NAME_LEN - 1), &ref))
+    strpool_remove(&player_names, ref);
+  journal_leave(id);
+}
+
+void expire_sessions(void) {
+  static time_t last_check = 0;
+  time_t now = time(NULL);
+  if (now == last_check)
+    return;
+  last_check = now;
+  session_expire(now, on_session_expired);
+  compact_names();
+}
+
+/* Reattaches a reconnecting player to its session: a parked player is put
+ * back into the list, a player whose old connection the server still
+ * considers alive just gets the new socket. Returns NULL for an unknown or
+ * expired token. */
+Player *resume_player(int sock, const char *token) {
+  int id;
+  Session *s = session_lookup(token, &id);
+  if (!s)
+    return NULL;
+
+  Player *p;
+  if (s->state == SESSION_LIVE) {
+    p = s->live;
+    net_close(round_state.sock[p->slot]);
+    round_state.sock[p->slot] = sock;
+    round_state.connected[p->slot] = 1;
+    return p;
+  }
+
+  /* The parked name is still interned: this only finds it. */
+  ParkedState *st = &s->parked;
+  p = add_player(sock, st->name, id);
+  if (!p)
+    return NULL;
+  round_state.score[p->slot] = st->score;
+  round_state.ready[p->slot] = st->ready;
+  /* We can't tell whether the question reached them before the drop; their
+   * time counts from the round start. */
+  if (st->round == current_round) {
+    round_state.answered[p->slot] = st->answered;
+    round_state.answer[p->slot] = st->answer;
+    round_state.answer_time_us[p->slot] = st->answer_time_us;
+  }
+  session_attach(s, p);
+  return p;
+}
+
+int is_resume_request(const char *msg) {
+  return strncmp(msg, "/resume ", 8) == 0;
+}
+
+void add_handshake(int sock) {
+  Handshake *h = realloc(handshakes, (handshake_count + 1) * sizeof(Handshake));
+  if (!h) {
+    perror("realloc");
+    exit(1);
+  }
+  handshakes = h;
+  handshakes[handshake_count].sock = sock;
+  handshakes[handshake_count].accepted_at = time(NULL);
+  handshake_count++;
+}
+
+int find_handshake(int sock) {
+  for (int i = 0; i < handshake_count; i++) {
+    if (handshakes[i].sock == sock)
+      return i;
+  }
+  return -1;
+}
+
+void remove_handshake(int i) {
+  handshakes[i] = handshakes[--handshake_count];
+}
+
+void drop_relay(int i) {
+  net_close(relays[i]);
+  relays[i] = relays[--relay_count];
+  printf("Ретранслятор зрителей отключился, осталось %d\n", relay_count);
+}
+
+/* A relay that can't take a message whole is dropped rather than waited
+ * for; it reconnects and catches up from the snapshot. */
+void send_to_relays(const char *data, size_t len) {
+  if (relay_count == 0)
+    return;
+  ssize_t *res = relay_res;
+  net_send_many(relays, relay_count, data, len, res);
+  relay_messages++;
+  relay_bytes += len * relay_count;
+  /* Backwards, since a drop moves the last relay into the hole. */
+  for (int i = relay_count - 1; i >= 0; i--) {
+    if (res[i] != (ssize_t)len)
+      drop_relay(i);
+  }
+}
+
+void publish(int kind, const char *text) {
+  spec_update(&spectators, kind, text);
+  if (relay_count == 0)
+    return;
+  size_t len = spec_frame(&relay_frame, &relay_frame_cap, kind, text);
+  send_to_relays(relay_frame, len);
+}
+
+void keep_relay(int sock) {
+  int *r = realloc(relays, (relay_count + 1) * sizeof(int));
+  ssize_t *res = realloc(relay_res, (relay_count + 1) * sizeof(ssize_t));
+  if (!r || !res) {
+    perror("realloc");
+    exit(1);
+  }
+  relays = r;
+  relay_res = res;
+  relays[relay_count++] = sock;
+}
+
+/* Relays aren't read from: a dead one shows up as a failed send. */
+void add_relay(int sock) {
+  net_unwatch(sock);
+  keep_relay(sock);
+  relays_seen++;
+  printf("Подключён ретранслятор зрителей, всего %d\n", relay_count);
+
+  size_t len;
+  char *snapshot = spec_snapshot(&spectators, 1, &len);
+  if (snapshot && net_send(sock, snapshot, len) != (ssize_t)len)
+    drop_relay(relay_count - 1);
+  free(snapshot);
+}
+
+void close_relays(void) {
+  for (int i = 0; i < relay_count; i++)
+    net_close(relays[i]);
+  free(relays);
+  free(relay_res);
+  free(relay_frame);
+  relays = NULL;
+  relay_res = NULL;
+  relay_frame = NULL;
+  relay_frame_cap = 0;
+  relay_count = 0;
+  spec_free(&spectators);
+}
+
+void reject_during_game(int sock) {
+  char *msg = "Игра уже идет! Попробуйте позже.\n";
+  net_send(sock, msg, strlen(msg));
+  net_close(sock);
+  printf("Игрок попытался подключиться во время игры, соединение "
+         "закрыто.\n");
+}
+
+void expire_handshakes(void) {
+  time_t now = time(NULL);
+  for (int i = 0; i < handshake_count; i++) {
+    if (now - handshakes[i].accepted_at >= HANDSHAKE_TIMEOUT) {
+      reject_during_game(handshakes[i].sock);
+      remove_handshake(i);
+      i--;
     }
-    cur = cur->next;
   }
-  return 1;
 }
 
-void reset_round_flags(Player *head) {
-  Player *cur = head;
-  while (cur) {
-    cur->answered = 0;
-    cur->answer = 0;
-    cur->answer_time = 0;
-    cur = cur->next;
+/* Sends a player that came back mid-round what the others see right now. */
+void send_round_snapshot(Player *p, int q_index, int time_left) {
+  char buffer[1280];
+  int len = snprintf(buffer, sizeof(buffer),
+                     "\nВы снова в игре, %s! Ваш счёт: %d\n", player_name(p),
+                     round_state.score[p->slot]);
+  if (round_state.answered[p->slot])
+    snprintf(buffer + len, sizeof(buffer) - len,
+             "Вы уже ответили на вопрос %d/%d, ждём остальных.\n",
+             q_index + 1, game_len);
+  else
+    format_question(buffer + len, sizeof(buffer) - len, q_index, time_left,
+                    1);
+  if (net_send(round_state.sock[p->slot], buffer, strlen(buffer)) <= 0)
+    round_state.connected[p->slot] = 0;
+
+  char msg[256];
+  snprintf(msg, sizeof(msg), "[%s] вернулся в игру\n", player_name(p));
+  send_to_all_except(msg, round_state.id[p->slot]);
+}
+
+/* Live upgrade: on SIGUSR2 the running server execs its binary again and
+ * passes it the listening socket, every client socket and the game state
+ * over a Unix socket. Clients keep their connections. */
+enum { PHASE_LOBBY, PHASE_ROUND };
+
+#define HANDOFF_MAGIC 0x51524855
+/* Bump on any change to what live_upgrade() writes. */
+#define HANDOFF_VERSION 2
+
+/* The start of the blob in every version: the new process refuses a state
+ * laid out differently from its own. */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t state_size;  /* sizeof(HandoffState) */
+  uint32_t player_size; /* sizeof(HandoffPlayer) */
+} HandoffFormat;
+
+typedef struct {
+  HandoffFormat format;
+  int32_t phase;
+  int32_t round;
+  int32_t last_printed_sec;
+  int64_t round_start;
+  int64_t round_start_ns;
+  int64_t started_ns;
+  int32_t next_id;
+  int32_t players_joined;
+  uint64_t answers_total;
+  int32_t game_recovered;
+  int32_t player_count;
+  int32_t pending_count;
+  int32_t handshake_count;
+  int32_t recovered_count;
+  int32_t session_count;
+  int32_t leftover_count;
+  int32_t relay_count;
+  int32_t game_len;
+  uint32_t game_seed;
+  LatencyHist room_rtt;
+  CaptureCursor capture;
+} HandoffState;
+
+typedef struct {
+  int32_t id;
+  int32_t score;
+  int32_t answered;
+  int32_t answer;
+  int32_t answer_time_us;
+  int32_t ready;
+  int32_t connected;
+  int32_t rtt_us;
+  int64_t question_ns;
+  char name[MAX_NAME_LEN];
+} HandoffPlayer;
+
+volatile sig_atomic_t upgrade_requested = 0;
+char **upgrade_argv = NULL;
+char upgrade_path[PATH_MAX];
+
+/* Set by the new process when it takes over in the middle of a round. */
+int resumed_round = 0;
+time_t resumed_round_start;
+int resumed_last_printed_sec;
+
+void handle_sigusr2() { upgrade_requested = 1; }
+
+/* argv for the new process: ours without a previous "-H <fd>". The binary is
+ * the file /proc/self/exe names now, so a server started through PATH finds
+ * it too; exec'ing /proc/self/exe itself would rerun the old binary after
+ * it has been replaced. */
+void save_upgrade_argv(int argc, char *argv[]) {
+  ssize_t n_path = readlink("/proc/self/exe", upgrade_path,
+                            sizeof(upgrade_path) - 1);
+  if (n_path > 0)
+    upgrade_path[n_path] = '\0';
+  else
+    snprintf(upgrade_path, sizeof(upgrade_path), "%s", argv[0]);
+  upgrade_argv = malloc((argc + 1) * sizeof(char *));
+  if (!upgrade_argv) {
+    perror("malloc");
+    exit(1);
+  }
+  int n = 0;
+  for (int i = 0; i < argc; i++) {
+    if (strcmp(argv[i], "-H") == 0) {
+      i++;
+      continue;
+    }
+    upgrade_argv[n++] = argv[i];
   }
+  upgrade_argv[n] = NULL;
 }
 
-void process_round(Player *head, int q_index) {
-  printf("\nВопрос %d/%d: %s\n", q_index + 1, question_count,
-         questions[q_index].question);
+void blob_put(char **blob, size_t *len, size_t *cap, const void *data,
+              size_t size) {
+  if (*len + size > *cap) {
+    size_t new_cap = *cap ? *cap : 4096;
+    while (new_cap < *len + size)
+      new_cap *= 2;
+    char *p = realloc(*blob, new_cap);
+    if (!p) {
+      perror("realloc");
+      exit(1);
+    }
+    *blob = p;
+    *cap = new_cap;
+  }
+  memcpy(*blob + *len, data, size);
+  *len += size;
+}
 
-  reset_round_flags(head);
-  send_question(head, q_index);
+int fd_index(const int *fds, int nfds, int fd) {
+  for (int i = 0; i < nfds; i++) {
+    if (fds[i] == fd)
+      return i;
+  }
+  return -1;
+}
 
-  time_t round_start = time(NULL);
-  int round_active = 1;
+/* Returns only if the upgrade failed; the old process then keeps serving. */
+void live_upgrade(int phase, PendingPlayer *pending, int pending_count,
+                  int next_id, int round, time_t round_start,
+                  int last_printed_sec) {
+  upgrade_requested = 0;
+  int64_t started = monotonic_ns();
+  printf("Обновление сервера: передаём соединения новому процессу...\n");
+  fflush(stdout);
+  journal_commit();
+  capture_flush();
+
+  NetEvent *detached;
+  int leftover_count = net_detach(&detached);
+  NetEvent *leftover = NULL;
+  if (leftover_count > 0) {
+    leftover = malloc(leftover_count * sizeof(NetEvent));
+    if (!leftover) {
+      perror("malloc");
+      exit(1);
+    }
+    memcpy(leftover, detached, leftover_count * sizeof(NetEvent));
+  }
+
+  int player_count = round_state.len;
+  int max_fds = 1 + player_count + pending_count + handshake_count +
+                leftover_count + relay_count;
+  int *fds = malloc(max_fds * sizeof(int));
+  if (!fds) {
+    perror("malloc");
+    exit(1);
+  }
+  int nfds = 0;
+  fds[nfds++] = server_fd;
+  for (int i = 0; i < player_count; i++)
+    fds[nfds++] = round_state.sock[i];
+  for (int i = 0; i < pending_count; i++)
+    fds[nfds++] = pending[i].sock;
+  for (int i = 0; i < handshake_count; i++)
+    fds[nfds++] = handshakes[i].sock;
+  for (int i = 0; i < leftover_count; i++) {
+    if (leftover[i].type == NET_EV_ACCEPT)
+      fds[nfds++] = leftover[i].fd;
+  }
+  for (int i = 0; i < relay_count; i++)
+    fds[nfds++] = relays[i];
+
+  int session_count;
+  const Session *sessions = session_table(&session_count);
+
+  HandoffState st;
+  memset(&st, 0, sizeof(st));
+  st.format.magic = HANDOFF_MAGIC;
+  st.format.version = HANDOFF_VERSION;
+  st.format.state_size = sizeof(HandoffState);
+  st.format.player_size = sizeof(HandoffPlayer);
+  st.phase = phase;
+  st.round = round;
+  st.last_printed_sec = last_printed_sec;
+  st.round_start = round_start;
+  st.round_start_ns = round_start_ns;
+  st.started_ns = started;
+  st.next_id = next_id;
+  st.players_joined = players_joined;
+  st.answers_total = answers_total;
+  st.game_recovered = recovered.in_progress;
+  st.player_count = player_count;
+  st.pending_count = pending_count;
+  st.handshake_count = handshake_count;
+  st.recovered_count = recovered.player_count;
+  st.session_count = session_count;
+  /* An event for a socket that isn't handed over has nothing to refer to in
+   * the new process. */
+  for (int i = 0; i < leftover_count; i++) {
+    if (leftover[i].type == NET_EV_ACCEPT ||
+        fd_index(fds, nfds, leftover[i].fd) >= 0)
+      st.leftover_count++;
+  }
+  st.relay_count = relay_count;
+  st.room_rtt = room_rtt;
+  st.game_len = game_len;
+  st.game_seed = game_seed;
+  capture_cursor(&st.capture);
+
+  char *blob = NULL;
+  size_t len = 0, cap = 0;
+  blob_put(&blob, &len, &cap, &st, sizeof(st));
+  for (int i = 0; i < player_count; i++) {
+    HandoffPlayer hp;
+    memset(&hp, 0, sizeof(hp));
+    hp.id = round_state.id[i];
+    hp.score = round_state.score[i];
+    hp.answered = round_state.answered[i];
+    hp.answer = round_state.answer[i];
+    hp.answer_time_us = round_state.answer_time_us[i];
+    hp.ready = round_state.ready[i];
+    hp.connected = round_state.connected[i];
+    hp.rtt_us = round_state.rtt_us[i];
+    hp.question_ns = round_start_ns + round_state.question_us[i] * 1000LL;
+    snprintf(hp.name, sizeof(hp.name), "%s", player_name(player_at(i)));
+    blob_put(&blob, &len, &cap, &hp, sizeof(hp));
+  }
+  blob_put(&blob, &len, &cap, pending, pending_count * sizeof(PendingPlayer));
+  blob_put(&blob, &len, &cap, handshakes, handshake_count * sizeof(Handshake));
+  blob_put(&blob, &len, &cap, recovered.players,
+           recovered.player_count * sizeof(JournalPlayer));
+  blob_put(&blob, &len, &cap, sessions, session_count * sizeof(Session));
+  /* The game's questions with their texts: the new process doesn't parse
+   * the question file while nobody serves the clients. */
+  StrPool texts;
+  memset(&texts, 0, sizeof(texts));
+  for (int i = 0; i < game_len; i++) {
+    Question q = questions[game_questions[i]];
+    strpool_add(&texts, text_of(q.question), q.question.len, &q.question);
+    for (int j = 0; j < OPTIONS_COUNT; j++)
+      strpool_add(&texts, text_of(q.options[j]), q.options[j].len,
+                  &q.options[j]);
+    blob_put(&blob, &len, &cap, &q, sizeof(q));
+  }
+  uint64_t texts_len = texts.len;
+  blob_put(&blob, &len, &cap, &texts_len, sizeof(texts_len));
+  blob_put(&blob, &len, &cap, texts.buf, texts.len);
+  strpool_free(&texts);
+  for (int i = 0; i < leftover_count; i++) {
+    NetEvent ev = leftover[i];
+    /* fds are renumbered in the new process: send the index instead. */
+    ev.fd = fd_index(fds, nfds, ev.fd);
+    if (ev.fd < 0 && ev.type != NET_EV_ACCEPT)
+      continue;
+    blob_put(&blob, &len, &cap, &ev, sizeof(ev));
+  }
+  for (int i = 0; i < nfds; i++) {
+    int32_t conn = capture_conn(fds[i]);
+    blob_put(&blob, &len, &cap, &conn, sizeof(conn));
+  }
+  /* What the spectators see, as the frames a relay would get. */
+  size_t snapshot_len;
+  char *snapshot = spec_snapshot(&spectators, 1, &snapshot_len);
+  uint64_t snapshot_len64 = snapshot_len;
+  blob_put(&blob, &len, &cap, &snapshot_len64, sizeof(snapshot_len64));
+  if (snapshot)
+    blob_put(&blob, &len, &cap, snapshot, snapshot_len);
+  free(snapshot);
+
+  int chan = -1;
+  pid_t pid = handoff_spawn(upgrade_path, upgrade_argv, &chan);
+  int ok = pid > 0 && handoff_send(chan, blob, len, fds, nfds) == 0 &&
+           handoff_wait_ack(chan, HANDOFF_ACK_TIMEOUT_MS) == 0;
+  free(blob);
+  free(fds);
+
+  if (ok) {
+    printf("Управление передано процессу %d\n", (int)pid);
+    fflush(stdout);
+    _exit(0);
+  }
+
+  printf("Обновление не удалось, продолжаем работу\n");
+  if (pid > 0) {
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+  }
+  if (chan >= 0)
+    close(chan);
+  net_resume();
+  net_inject(leftover, leftover_count);
+  free(leftover);
+}
+
+/* New process side of live_upgrade(). Fills in the lobby or round state the
+ * caller continues from and returns the phase. */
+int take_over(int chan, PendingPlayer **pending, int *pending_count,
+              int *next_id, int *round, int backend) {
+  void *data;
+  size_t len;
+  int *fds;
+  int nfds;
+  if (handoff_recv(chan, &data, &len, &fds, &nfds) < 0) {
+    printf("Не удалось получить состояние от старого процесса\n");
+    exit(1);
+  }
+
+  char *p = data;
+  HandoffFormat format;
+  memset(&format, 0, sizeof(format));
+  memcpy(&format, p, len < sizeof(format) ? len : sizeof(format));
+  if (format.magic != HANDOFF_MAGIC || format.version != HANDOFF_VERSION ||
+      format.state_size != sizeof(HandoffState) ||
+      format.player_size != sizeof(HandoffPlayer) ||
+      len < sizeof(HandoffState)) {
+    printf("Несовместимый формат передачи состояния: версия %u (%u/%u байт), "
+           "ожидалась %u (%zu/%zu байт)\n",
+           format.version, format.state_size, format.player_size,
+           HANDOFF_VERSION, sizeof(HandoffState), sizeof(HandoffPlayer));
+    exit(1);
+  }
+  HandoffState st;
+  memcpy(&st, p, sizeof(st));
+  p += sizeof(st);
+
+  int fi = 0;
+  server_fd = fds[fi++];
+  net_init(backend, server_fd);
+
+  for (int i = 0; i < st.player_count; i++) {
+    HandoffPlayer hp;
+    memcpy(&hp, p, sizeof(hp));
+    p += sizeof(hp);
+    int sock = fds[fi++];
+    Player *pl = add_player(sock, hp.name, hp.id);
+    if (!pl)
+      exit(1);
+    round_state.score[pl->slot] = hp.score;
+    round_state.answered[pl->slot] = hp.answered;
+    round_state.answer[pl->slot] = hp.answer;
+    round_state.answer_time_us[pl->slot] = hp.answer_time_us;
+    round_state.ready[pl->slot] = hp.ready;
+    round_state.connected[pl->slot] = hp.connected;
+    round_state.rtt_us[pl->slot] = hp.rtt_us;
+    round_state.question_us[pl->slot] =
+        (int32_t)((hp.question_ns - st.round_start_ns) / 1000);
+    net_watch(sock);
+  }
+
+  int pending_cap = max_players + PENDING_EXTRA;
+  if (pending_cap < st.pending_count)
+    pending_cap = st.pending_count;
+  *pending = malloc(pending_cap * sizeof(PendingPlayer));
+  if (!*pending) {
+    perror("malloc");
+    exit(1);
+  }
+  memcpy(*pending, p, st.pending_count * sizeof(PendingPlayer));
+  p += st.pending_count * sizeof(PendingPlayer);
+  *pending_count = st.pending_count;
+  for (int i = 0; i < st.pending_count; i++) {
+    (*pending)[i].sock = fds[fi++];
+    net_watch((*pending)[i].sock);
+  }
+
+  handshake_count = st.handshake_count;
+  handshakes = malloc((handshake_count ? handshake_count : 1) *
+                      sizeof(Handshake));
+  if (!handshakes) {
+    perror("malloc");
+    exit(1);
+  }
+  memcpy(handshakes, p, handshake_count * sizeof(Handshake));
+  p += handshake_count * sizeof(Handshake);
+  for (int i = 0; i < handshake_count; i++) {
+    handshakes[i].sock = fds[fi++];
+    net_watch(handshakes[i].sock);
+  }
+
+  recovered.player_count = st.recovered_count;
+  recovered.players =
+      malloc((st.recovered_count ? st.recovered_count : 1) *
+             sizeof(JournalPlayer));
+  if (!recovered.players) {
+    perror("malloc");
+    exit(1);
+  }
+  memcpy(recovered.players, p, st.recovered_count * sizeof(JournalPlayer));
+  p += st.recovered_count * sizeof(JournalPlayer);
+  recovered.in_progress = st.game_recovered;
+
+  session_load((const Session *)p, st.session_count);
+  p += st.session_count * sizeof(Session);
+  for (int id = 1; id <= session_max_id(); id++) {
+    const ParkedState *parked = session_parked_at(id);
+    StrRef ref;
+    if (parked && intern_name(parked->name, &ref) < 0)
+      exit(1);
+  }
+  game_len = st.game_len;
+  game_seed = st.game_seed;
+  question_count = game_len;
+  questions = malloc((game_len ? game_len : 1) * sizeof(Question));
+  game_questions = malloc((game_len ? game_len : 1) * sizeof(int));
+  if (!questions || !game_questions) {
+    perror("malloc");
+    exit(1);
+  }
+  memcpy(questions, p, game_len * sizeof(Question));
+  p += game_len * sizeof(Question);
+  uint64_t texts_len;
+  memcpy(&texts_len, p, sizeof(texts_len));
+  p += sizeof(texts_len);
+  /* Same order as they were added, so the handles stay valid. */
+  strpool_reserve(&question_texts, texts_len);
+  for (int i = 0; i < game_len; i++) {
+    Question *q = &questions[i];
+    strpool_add(&question_texts, p + q->question.off, q->question.len,
+                &q->question);
+    for (int j = 0; j < OPTIONS_COUNT; j++)
+      strpool_add(&question_texts, p + q->options[j].off, q->options[j].len,
+                  &q->options[j]);
+    game_questions[i] = i;
+  }
+  p += texts_len;
+  for (int i = 0; i < round_state.len; i++)
+    session_relink(round_state.id[i], player_at(i));
+
+  NetEvent *leftover = malloc((st.leftover_count ? st.leftover_count : 1) *
+                              sizeof(NetEvent));
+  if (!leftover) {
+    perror("malloc");
+    exit(1);
+  }
+  memcpy(leftover, p, st.leftover_count * sizeof(NetEvent));
+  p += st.leftover_count * sizeof(NetEvent);
+  for (int i = 0; i < st.leftover_count; i++) {
+    if (leftover[i].type == NET_EV_ACCEPT)
+      leftover[i].fd = fds[fi++];
+    else if (leftover[i].fd >= 0)
+      leftover[i].fd = fds[leftover[i].fd];
+  }
+  net_inject(leftover, st.leftover_count);
+  free(leftover);
+  for (int i = 0; i < st.relay_count; i++)
+    keep_relay(fds[fi++]);
+
+  if (capture_path && capture_resume(capture_path, &st.capture) < 0)
+    perror("capture");
+  for (int i = 0; i < nfds; i++) {
+    int32_t conn;
+    memcpy(&conn, p, sizeof(conn));
+    p += sizeof(conn);
+    capture_bind(fds[i], conn);
+  }
+  uint64_t snapshot_len;
+  memcpy(&snapshot_len, p, sizeof(snapshot_len));
+  p += sizeof(snapshot_len);
+  SpecReader reader = {0};
+  if (snapshot_len > 0)
+    spec_feed(&reader, p, snapshot_len);
+  p += snapshot_len;
+  int kind;
+  const char *text;
+  while (spec_next(&reader, &kind, &text))
+    spec_update(&spectators, kind, text);
+  spec_reader_free(&reader);
+
+  *next_id = st.next_id;
+  *round = st.round;
+  players_joined = st.players_joined;
+  answers_total = st.answers_total;
+  room_rtt = st.room_rtt;
+  round_start_ns = st.round_start_ns;
+  if (st.phase == PHASE_ROUND) {
+    current_round = st.round;
+    resumed_round = 1;
+    resumed_round_start = st.round_start;
+    resumed_last_printed_sec = st.last_printed_sec;
+  }
+
+  handoff_ack(chan);
+  close(chan);
+  printf("Сервер обновлён: пауза %.1f мс, соединений %d\n",
+         (monotonic_ns() - st.started_ns) / 1e6, nfds - 1);
+
+  free(data);
+  free(fds);
+  return st.phase;
+}
+
+/* Microseconds the player took to answer, from nanosecond timestamps. */
+int answer_time_us(Player *p, int64_t arrived_ns) {
+  int64_t elapsed = arrived_ns - round_start_ns;
+  if (compensate_latency) {
+    elapsed -= (int64_t)round_state.question_us[p->slot] * 1000;
+    if (round_state.rtt_us[p->slot] > 0)
+      elapsed -= (int64_t)round_state.rtt_us[p->slot] * 1000;
+  }
+  if (elapsed < 0)
+    elapsed = 0;
+  if (elapsed > (int64_t)TIME_PER_QUESTION * 1000000000)
+    elapsed = (int64_t)TIME_PER_QUESTION * 1000000000;
+  return (int)(elapsed / 1000);
+}
+
+void handle_answer(Player *cur, const char *data, int q_index,
+                   int64_t arrived_ns) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%s", data);
+  clean_string(buf);
+  int replay_time_us = -1;
+  char *at = strchr(buf, '@');
+  if (at) {
+    *at = '\0';
+    if (replay_mode)
+      replay_time_us = atoi(at + 1);
+  }
+
+  if (strcmp(buf, "0") == 0) {
+    printf("[%s] не ответил вовремя\n", player_name(cur));
+    round_state.answered[cur->slot] = 1;
+    round_state.answer[cur->slot] = 0;
+    round_state.answer_time_us[cur->slot] = TIME_PER_QUESTION * 1000000;
+    journal_answer(round_state.id[cur->slot], q_index, 0, TIME_PER_QUESTION,
+                   0);
+    return;
+  }
+
+  int answer = atoi(buf);
+  if (answer < 1 || answer > 4)
+    return;
+
+  sample_rtt(cur->slot);
+  int time_us = answer_time_us(cur, arrived_ns);
+  if (replay_time_us >= 0)
+    time_us = replay_time_us < TIME_PER_QUESTION * 1000000
+                  ? replay_time_us
+                  : TIME_PER_QUESTION * 1000000;
+  int time_spent = time_us / 1000000;
+
+  round_state.answered[cur->slot] = 1;
+  round_state.answer[cur->slot] = answer;
+  round_state.answer_time_us[cur->slot] = time_us;
+  answers_total++;
+
+  /* Points are added to the score by round_close(); this is only what the
+   * player is told right away. */
+  const Question *q = &questions[game_questions[q_index]];
+  int is_correct = (answer == q->correct_option);
+  int points =
+      round_points(is_correct, time_us, BASE_POINTS, TIME_PER_QUESTION,
+                   compensate_latency);
+  journal_answer(round_state.id[cur->slot], q_index, answer, time_spent,
+                 points);
+
+  char result_msg[256];
+  if (is_correct)
+    snprintf(result_msg, sizeof(result_msg), "\nПравильно! +%d\n", points);
+  else
+    snprintf(result_msg, sizeof(result_msg),
+             "\nНеправильно. Правильный ответ: %d) %s\n",
+             q->correct_option, text_of(q->options[q->correct_option - 1]));
+  ssize_t s =
+      net_send(round_state.sock[cur->slot], result_msg, strlen(result_msg));
+  if (s <= 0) {
+    printf("[%s] отключился между раундами\n", player_name(cur));
+    round_state.connected[cur->slot] = 0;
+  }
+
+  printf("[%s] ответил за %d сек (RTT %.2f мс, %s, +%d)\n", player_name(cur),
+         time_spent, round_state.rtt_us[cur->slot] / 1000.0,
+         is_correct ? "правильно" : "неправильно", points);
+}
+
+void print_round_summary(const RoundSummary *sum) {
+  int real = sum->answered - sum->histogram[0];
+  printf("Ответов %d (правильных %d, сдались %d, молчали %d), "
+         "варианты 1-4: %d/%d/%d/%d\n",
+         sum->answered, sum->correct, sum->histogram[0], sum->silent_count,
+         sum->histogram[1], sum->histogram[2], sum->histogram[3],
+         sum->histogram[4]);
+  if (real > 0)
+    printf("Время ответа: среднее %.2f сек, мин %.2f, макс %.2f\n",
+           sum->time_sum_us / 1e6 / real, sum->time_min_us / 1e6,
+           sum->time_max_us / 1e6);
+}
+
+void process_round(int q_index) {
+  const Question *q = &questions[game_questions[q_index]];
+  current_round = q_index;
+  time_t round_start;
   int last_printed_sec = TIME_PER_QUESTION;
+
+  if (resumed_round) {
+    /* Taken over from the previous process: the question is already out. */
+    resumed_round = 0;
+    round_start = resumed_round_start;
+    last_printed_sec = resumed_last_printed_sec;
+  } else {
+    printf("\nВопрос %d/%d: %s\n", q_index + 1, game_len, text_of(q->question));
+    round_reset();
+    journal_round_start(q_index, game_questions[q_index]);
+    send_question(q_index);
+    capture_round(q_index, round_start_ns);
+    round_start = time(NULL);
+  }
+
+  int round_active = 1;
   char buffer[256];
+  NetEvent events[EVENTS_PER_WAIT];
 
   while (round_active) {
     time_t now = time(NULL);
@@ -325,162 +1510,127 @@ void process_round(Player *head, int q_index) {
       snprintf(buffer, sizeof(buffer), "До окончания раунда: %d...\n",
                time_left);
       printf("%s", buffer);
-      send_to_all_except(head, buffer, -1);
+      send_to_all_except(buffer, -1);
       last_printed_sec = time_left;
     }
 
-    int active_players = 0;
-    Player *cur = head;
-    while (cur) {
-      if (cur->connected && !cur->answered)
-        active_players++;
-      cur = cur->next;
-    }
-
-    if (active_players == 0 || (int)(now - round_start) >= TIME_PER_QUESTION) {
+    if (round_pending() == 0 || (int)(now - round_start) >= TIME_PER_QUESTION) {
       round_active = 0;
       break;
     }
 
-    struct pollfd fds[active_players + 1];
-    Player *players_list[active_players];
-    int idx = 0;
-
-    fds[idx].fd = server_fd;
-    fds[idx].events = POLLIN;
-    idx++;
-
-    cur = head;
-    int pidx = 0;
-    while (cur) {
-      if (cur->connected && !cur->answered) {
-        fds[idx].fd = cur->sock;
-        fds[idx].events = POLLIN;
-        players_list[pidx++] = cur;
-        idx++;
+    if (upgrade_requested)
+      live_upgrade(PHASE_ROUND, NULL, 0, 0, q_index, round_start,
+                   last_printed_sec);
+
+    int n = net_wait(events, EVENTS_PER_WAIT, 100);
+    int64_t arrived_ns = monotonic_ns();
+    capture_events(events, n, arrived_ns);
+    journal_tick();
+    cluster_tick(round_state.len, max_players, 0);
+    expire_sessions();
+    expire_handshakes();
+    for (int i = 0; i < n; i++) {
+      NetEvent *ev = &events[i];
+
+      if (ev->type == NET_EV_ACCEPT) {
+        add_handshake(ev->fd);
+        net_watch(ev->fd);
+        continue;
       }
-      cur = cur->next;
-    }
 
-    int ready = poll(fds, idx, 100);
-    if (ready < 0 && errno != EINTR) {
-      perror("poll");
-      continue;
-    }
-
-    if (fds[0].revents & POLLIN) {
-      struct sockaddr_in client_addr;
-      socklen_t client_len = sizeof(client_addr);
-      int new_sock =
-          accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
-      if (new_sock >= 0) {
-        fcntl(new_sock, F_SETFL, O_NONBLOCK);
-        char *msg = "Игра уже идет! Попробуйте позже.\n";
-        send(new_sock, msg, strlen(msg), 0);
-        close(new_sock);
-        printf("Игрок попытался подключиться во время игры, соединение "
-               "закрыто.\n");
-      } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
-        perror("accept");
+      int h = find_handshake(ev->fd);
+      if (h >= 0) {
+        remove_handshake(h);
+        char msg[64];
+        snprintf(msg, sizeof(msg), "%s", ev->data);
+        clean_string(msg);
+        if (ev->type == NET_EV_DATA && strcmp(msg, SPECTATE_HELLO) == 0) {
+          add_relay(ev->fd);
+          continue;
+        }
+        Player *p = NULL;
+        if (ev->type == NET_EV_DATA && is_resume_request(msg))
+          p = resume_player(ev->fd, msg + 8);
+        if (!p) {
+          reject_during_game(ev->fd);
+          continue;
+        }
+        printf("[%s] переподключился\n", player_name(p));
+        send_round_snapshot(p, q_index,
+                            TIME_PER_QUESTION - (int)(now - round_start));
+        continue;
       }
-    }
 
-    for (int i = 0; i < active_players; i++) {
-      cur = players_list[i];
-      if ((fds[i + 1].revents & POLLIN) && !cur->answered) {
-        char buf[10];
-        int n = recv(cur->sock, buf, sizeof(buf) - 1, 0);
-
-        if (n > 0) {
-          buf[n] = '\0';
-          clean_string(buf);
-
-          if (strcmp(buf, "0") == 0) {
-            printf("[%s] не ответил вовремя\n", cur->name);
-            cur->answered = 1;
-            cur->answer = 0;
-            cur->answer_time = TIME_PER_QUESTION;
-          } else {
-            int answer = atoi(buf);
-            if (answer >= 1 && answer <= 4) {
-              int time_spent = (int)(now - round_start);
-              if (time_spent < 0)
-                time_spent = 0;
-              if (time_spent > TIME_PER_QUESTION)
-                time_spent = TIME_PER_QUESTION;
-
-              cur->answered = 1;
-              cur->answer = answer;
-              cur->answer_time = time_spent;
-
-              int is_correct = (answer == questions[q_index].correct_option);
-              int points = calculate_score(is_correct, time_spent);
-
-              cur->score += points;
-
-              char result_msg[256];
-              if (is_correct)
-                snprintf(result_msg, sizeof(result_msg), "\nПравильно! +%d\n",
-                         points);
-              else
-                snprintf(result_msg, sizeof(result_msg),
-                         "\nНеправильно. Правильный ответ: %d) %s\n",
-                         questions[q_index].correct_option,
-                         questions[q_index]
-                             .options[questions[q_index].correct_option - 1]);
-              ssize_t s = send(cur->sock, result_msg, strlen(result_msg), 0);
-              if (s <= 0) {
-                printf("[%s] отключился между раундами\n", cur->name);
-                cur->connected = 0;
-              }
-
-              printf("[%s] ответил за %d сек (%s, +%d)\n", cur->name,
-                     time_spent, is_correct ? "правильно" : "неправильно",
-                     points);
-            }
-          }
-        } else if (n == 0) {
-          printf("[%s] отключился\n", cur->name);
-          cur->connected = 0;
-          cur->answered = 1;
-        } else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-          perror("recv");
-        }
+      Player *cur = find_player(ev->fd);
+      if (!cur || !round_state.connected[cur->slot])
+        continue;
+
+      if (ev->type == NET_EV_CLOSED) {
+        printf("[%s] отключился\n", player_name(cur));
+        round_state.connected[cur->slot] = 0;
+      } else if (!round_state.answered[cur->slot]) {
+        handle_answer(cur, ev->data, q_index, arrived_ns);
       }
     }
   }
 
-  Player *cur = head;
-  while (cur) {
-    if (!cur->answered) {
-      char timeout_msg[512];
-      snprintf(
-          timeout_msg, sizeof(timeout_msg),
-          "\nВремя вышло! Вы не успели ответить.\n"
-          "Правильный ответ: %d) %s\n\n",
-          questions[q_index].correct_option,
-          questions[q_index].options[questions[q_index].correct_option - 1]);
-      ssize_t s = send(cur->sock, timeout_msg, strlen(timeout_msg), 0);
-      if (s <= 0) {
-        printf("[%s] отключился\n", cur->name);
-        cur->connected = 0;
-      }
+  RoundSummary sum;
+  round_close(q->correct_option, BASE_POINTS, TIME_PER_QUESTION,
+              compensate_latency, &sum);
+  print_round_summary(&sum);
+
+  /* The timeout notice, the round end and the scoreboard from
+   * send_results() are one update for the player. */
+  net_hold(1);
+  if (sum.silent_count > 0) {
+    char timeout_msg[512];
+    snprintf(timeout_msg, sizeof(timeout_msg),
+             "\nВремя вышло! Вы не успели ответить.\n"
+             "Правильный ответ: %d) %s\n\n",
+             q->correct_option, text_of(q->options[q->correct_option - 1]));
+    int *fds = malloc(sum.silent_count * sizeof(int));
+    ssize_t *res = malloc(sum.silent_count * sizeof(ssize_t));
+    if (!fds || !res) {
+      perror("malloc");
+      exit(1);
     }
-    cur = cur->next;
+    for (int i = 0; i < sum.silent_count; i++)
+      fds[i] = round_state.sock[sum.silent[i]];
+    net_send_many(fds, sum.silent_count, timeout_msg, strlen(timeout_msg),
+                  res);
+    for (int i = 0; i < sum.silent_count; i++) {
+      if (res[i] <= 0)
+        round_state.connected[sum.silent[i]] = 0;
+    }
+    free(fds);
+    free(res);
   }
+  journal_round_end(q_index);
+
+  char end[512];
+  snprintf(end, sizeof(end),
+           "\nПравильный ответ: %d) %s\n"
+           "Ответов %d, правильных %d, варианты 1-4: %d/%d/%d/%d\n",
+           q->correct_option, text_of(q->options[q->correct_option - 1]),
+           sum.answered, sum.correct, sum.histogram[1], sum.histogram[2],
+           sum.histogram[3], sum.histogram[4]);
+  publish(SPEC_ROUND_END, end);
+
   char msg[256];
   snprintf(msg, sizeof(msg),
            "Все игроки ответили. Переходим к следующему вопросу...\n");
-  send_to_all_except(head, msg, -1);
+  send_to_all_except(msg, -1);
 }
 
-Player *sort_players_by_score(Player *head, int *out_count) {
-  int count = 0;
-  Player *cur = head;
-  while (cur) {
-    count++;
-    cur = cur->next;
-  }
+int compare_by_score(const void *a, const void *b) {
+  int sa = round_state.score[((const Player *)a)->slot];
+  int sb = round_state.score[((const Player *)b)->slot];
+  return (sb > sa) - (sb < sa);
+}
+
+Player *sort_players_by_score(int *out_count) {
+  int count = round_state.len;
   *out_count = count;
 
   if (count == 0)
@@ -490,32 +1640,22 @@ Player *sort_players_by_score(Player *head, int *out_count) {
   if (!arr)
     return NULL;
 
-  cur = head;
-  for (int i = 0; i < count; i++) {
-    arr[i] = *cur;
-    cur = cur->next;
-  }
-
-  for (int i = 0; i < count - 1; i++) {
-    for (int j = i + 1; j < count; j++) {
-      if (arr[j].score > arr[i].score) {
-        Player temp = arr[i];
-        arr[i] = arr[j];
-        arr[j] = temp;
-      }
-    }
-  }
+  for (int i = 0; i < count; i++)
+    arr[i] = *player_at(i);
 
+  qsort(arr, count, sizeof(Player), compare_by_score);
   return arr;
 }
 
-void send_results(Player *head, int q_index) {
+void send_results(int q_index) {
   char buffer[2048];
 
   int count = 0;
-  Player *sorted_players = sort_players_by_score(head, &count);
-  if (!sorted_players)
+  Player *sorted_players = sort_players_by_score(&count);
+  if (!sorted_players) {
+    net_hold(0);
     return;
+  }
 
   snprintf(buffer, sizeof(buffer),
            "\n════════════════════════════════════════\n"
@@ -524,45 +1664,41 @@ void send_results(Player *head, int q_index) {
            "┌──────────────────┬────────────┐\n"
            "│ Игрок            │ Очки       │\n"
            "├──────────────────┼────────────┤\n",
-           q_index + 1, question_count);
+           q_index + 1, game_len);
 
   for (int i = 0; i < count; i++) {
     char line[100];
-    snprintf(line, sizeof(line), "│ %-16s │ %-10d │\n", sorted_players[i].name,
-             sorted_players[i].score);
+    snprintf(line, sizeof(line), "│ %-16s │ %-10d │\n",
+             player_name(&sorted_players[i]),
+             round_state.score[sorted_players[i].slot]);
     strncat(buffer, line, sizeof(buffer) - strlen(buffer) - 1);
   }
 
-  strcat(buffer, "└──────────────────┴────────────┘\n\n");
+  strncat(buffer, "└──────────────────┴────────────┘\n\n",
+          sizeof(buffer) - strlen(buffer) - 1);
 
-  Player *cur = head;
-  while (cur) {
-    ssize_t s = send(cur->sock, buffer, strlen(buffer), 0);
-    if (s <= 0) {
-      printf("[%s] отключился\n", cur->name);
-      cur->connected = 0;
-    }
-    cur = cur->next;
-  }
+  net_hold(0);
+  send_to_players(buffer, -1, 0);
+  publish(SPEC_SCORES, buffer);
 
   free(sorted_players);
 
-  sleep(3);
+  pause_sec(3);
 }
 
-void send_final_results(Player *head) {
-  if (!head)
+void send_final_results(void) {
+  if (round_state.len == 0)
     return;
 
   int count = 0;
-  Player *sorted_players = sort_players_by_score(head, &count);
+  Player *sorted_players = sort_players_by_score(&count);
   if (!sorted_players || count == 0)
     return;
 
-  int max_score = sorted_players[0].score;
+  int max_score = round_state.score[sorted_players[0].slot];
   int winner_count = 0;
   for (int i = 0; i < count; i++) {
-    if (sorted_players[i].score == max_score) {
+    if (round_state.score[sorted_players[i].slot] == max_score) {
       winner_count++;
     }
   }
@@ -578,7 +1714,7 @@ void send_final_results(Player *head) {
     snprintf(congrats, sizeof(congrats),
              "                ПОБЕДИТЕЛЬ: %-16s \n"
              "                   Счёт:%d \n\n",
-             sorted_players[0].name, max_score);
+             player_name(&sorted_players[0]), max_score);
     strcat(buffer, congrats);
   } else if (winner_count > 1) {
     char congrats[512];
@@ -588,8 +1724,8 @@ void send_final_results(Player *head) {
     for (int i = 0; i < winner_count; i++) {
       char line[128];
       snprintf(line, sizeof(line), "                %-16s  \n",
-               sorted_players[i].name);
-      strcat(buffer, line);
+               player_name(&sorted_players[i]));
+      strncat(buffer, line, sizeof(buffer) - strlen(buffer) - 1);
     }
     char score_line[128];
     snprintf(score_line, sizeof(score_line), "              %d \n\n",
@@ -605,11 +1741,13 @@ void send_final_results(Player *head) {
   for (int i = 0; i < count; i++) {
     char line[128];
     snprintf(line, sizeof(line), "│ %-5d │ %-16s │ %-10d │\n", i + 1,
-             sorted_players[i].name, sorted_players[i].score);
-    strcat(buffer, line);
+             player_name(&sorted_players[i]),
+             round_state.score[sorted_players[i].slot]);
+    strncat(buffer, line, sizeof(buffer) - strlen(buffer) - 1);
   }
 
-  strcat(buffer, "└───────┴──────────────────┴────────────┘\n\n");
+  strncat(buffer, "└───────┴──────────────────┴────────────┘\n\n",
+          sizeof(buffer) - strlen(buffer) - 1);
 
   char stats[256];
   snprintf(stats, sizeof(stats),
@@ -617,264 +1755,741 @@ void send_final_results(Player *head) {
            "   Всего вопросов: %d\n"
            "   Всего игроков: %d\n"
            "   Максимальный счет: %d \n\n",
-           question_count, count, max_score);
-  strcat(buffer, stats);
-
-  strcat(buffer,
-         "══════════════════════════════════════════════════════════\n"
-         "  Спасибо за участие в QuizRush! Ждем вас снова! \n"
-         "══════════════════════════════════════════════════════════\n");
-
-  send_to_all_except(head, buffer, -1);
+           game_len, count, max_score);
+  strncat(buffer, stats, sizeof(buffer) - strlen(buffer) - 1);
+
+  strncat(buffer,
+          "══════════════════════════════════════════════════════════\n"
+          "  Спасибо за участие в QuizRush! Ждем вас снова! \n"
+          "══════════════════════════════════════════════════════════\n",
+          sizeof(buffer) - strlen(buffer) - 1);
+
+  net_hold(1);
+  send_to_all_except(buffer, -1);
+  net_hold(0);
+  publish(SPEC_FINAL, buffer);
+
+  /* The table is cut at the buffer size in a big room; everyone gets their
+   * own score as well. */
+  int64_t now = monotonic_ns();
+  for (int i = 0; i < round_state.len; i++) {
+    if (!round_state.connected[i])
+      continue;
+    char line[64];
+    snprintf(line, sizeof(line), "Ваш итоговый счёт: %d\n",
+             round_state.score[i]);
+    net_send(round_state.sock[i], line, strlen(line));
+    capture_result(round_state.sock[i], now, round_state.score[i]);
+  }
 
   free(sorted_players);
   sleep(3);
 }
 
-int main() {
-  if (!load_questions(QUESTIONS_FILE)) {
-    handle_sigint();
+void print_io_stats(void) {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  double cpu_ms = ru.ru_utime.tv_sec * 1000.0 + ru.ru_utime.tv_usec / 1000.0 +
+                  ru.ru_stime.tv_sec * 1000.0 + ru.ru_stime.tv_usec / 1000.0;
+
+  printf("\nВвод-вывод (%s): системных вызовов %lu, пробуждений %lu, "
+         "recv %lu, send %lu, accept %lu\n",
+         net_backend_name(), net_stats.syscalls, net_stats.wakeups,
+         net_stats.recvs, net_stats.sends, net_stats.accepts);
+  if (answers_total > 0)
+    printf("Системных вызовов на ответ: %.2f (ответов: %lu)\n",
+           (double)net_stats.syscalls / answers_total, answers_total);
+  if (journal_stats.records > 0)
+    printf("Журнал: записей %lu, коммитов %lu, сжатий %lu, ошибок записи %lu\n",
+           journal_stats.records, journal_stats.commits,
+           journal_stats.compactions, journal_stats.write_errors);
+  if (journal_stats.commits > 0)
+    printf("fdatasync в цикле: среднее %.2f мс, макс %.2f мс\n",
+           journal_stats.sync_us_total / 1000.0 / journal_stats.commits,
+           journal_stats.sync_us_max / 1000.0);
+  if (players_joined > 0)
+    printf("CPU: %.1f мс, на 1000 игроков: %.1f мс\n", cpu_ms,
+           cpu_ms * 1000.0 / players_joined);
+  if (question_count > 0) {
+    double per_question =
+        sizeof(Question) + (double)question_texts.len / question_count;
+    printf("Память вопросов: %zu байт, на вопрос %.1f (тексты %.1f), "
+           "на 1M вопросов %.1f МБ\n",
+           question_count * sizeof(Question) + strpool_bytes(&question_texts),
+           per_question, per_question - sizeof(Question),
+           per_question * 1e6 / (1024 * 1024));
+  }
+  if (players_peak > 0) {
+    double per_player =
+        sizeof(PlayerNode) + round_slot_bytes() +
+        (double)(player_names.len +
+                 player_names.table_cap * sizeof(*player_names.table)) /
+            players_peak;
+    printf("Память игроков: на игрока %.1f байт, на 1000 игроков %.1f КБ; "
+           "выделений при входе %lu на %d входов\n",
+           per_player, per_player * 1000 / 1024, join_allocs, players_joined);
+  }
+  if (room_rtt.count > 0)
+    printf("RTT в комнате (замеров %lu): p50 %.2f мс, p90 %.2f мс, "
+           "p99 %.2f мс, макс %.2f мс%s\n",
+           room_rtt.count, latency_percentile(&room_rtt, 0.5) / 1000.0,
+           latency_percentile(&room_rtt, 0.9) / 1000.0,
+           latency_percentile(&room_rtt, 0.99) / 1000.0,
+           room_rtt.max_us / 1000.0,
+           compensate_latency ? ", время ответа скомпенсировано" : "");
+  if (relays_seen > 0)
+    printf("Зрители: ретрансляторов %d, сообщений %lu, байт %lu\n",
+           relays_seen, relay_messages, relay_bytes);
+  if (net_stats.throttled || net_stats.deferred || net_stats.kicked)
+    printf("Ограничения ввода: отброшено %lu, пауз %lu, отложено %lu, "
+           "отключено %lu\n",
+           net_stats.throttled, net_stats.paused, net_stats.deferred,
+           net_stats.kicked);
+}
+
+void usage(const char *prog) {
+  printf("Использование: %s [-b poll|uring] [-n макс_игроков] [-j журнал] "
+         "[-c мс] [-l]\n"
+         "       [-q вопросов] [-k категория] [-d сложность 1-5] [-s сид]\n"
+         "       [-r файл_записи] [-R] [-L сообщений_в_сек, 0 - без "
+         "ограничений]\n"
+         "       [-t] [-P мкс_busy_poll] [-W байт_SO_SNDBUF]\n"
+         "       [-m игроков_в_игре [-w мс_ожидания]]\n"
+         "       [-p порт] [-C управляющий_сокет_маршрутизатора]\n"
+         "SIGUSR2 перезапускает сервер без разрыва соединений\n",
+         prog);
+}
+
+/* A player of the interrupted game comes back under the same name and gets
+ * their id and score back. */
+int claim_recovered(const char *name, int *id, int *score) {
+  for (int i = 0; i < recovered.player_count; i++) {
+    if (strcmp(recovered.players[i].name, name) == 0) {
+      *id = recovered.players[i].id;
+      *score = recovered.players[i].score;
+      recovered.players[i] = recovered.players[--recovered.player_count];
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Players from the matchmaking queue come in ready: '/ready' is what got
+ * them a game. */
+int join_matched(const MatchPlayer *players, int count, int next_id) {
+  for (int i = 0; i < count; i++) {
+    char name[MAX_NAME_LEN];
+    char original[MAX_NAME_LEN];
+    snprintf(original, sizeof(original), "%s", players[i].name);
+    clean_string(original);
+    snprintf(name, sizeof(name), "%s", original);
+    int suffix = 1;
+    while (name_exists(name))
+      snprintf(name, sizeof(name), "%.37s_%d", original, suffix++);
+    Player *joined = add_player(players[i].sock, name, next_id++);
+    if (!joined) {
+      net_close(players[i].sock);
+      continue;
+    }
+    round_state.ready[joined->slot] = 1;
+    players_joined++;
+    net_watch(players[i].sock);
+    printf("Игрок [%s] добавлен в игру!\n", name);
+  }
+  char msg[64];
+  snprintf(msg, sizeof(msg), "\nИгра найдена! Игроков: %d\n", count);
+  send_to_all_except(msg, -1);
+  return next_id;
+}
+
+void compact_journal(int next_round) {
+  int count = round_state.len + recovered.player_count;
+  JournalPlayer *snapshot = malloc((count ? count : 1) * sizeof(JournalPlayer));
+  if (!snapshot)
+    return;
+  int n = 0;
+  for (; n < round_state.len; n++) {
+    snapshot[n].id = round_state.id[n];
+    snprintf(snapshot[n].name, sizeof(snapshot[n].name), "%s",
+             player_name(player_at(n)));
+    snapshot[n].score = round_state.score[n];
   }
+  for (int i = 0; i < recovered.player_count; i++)
+    snapshot[n++] = recovered.players[i];
+  for (int id = 1; id <= session_max_id(); id++) {
+    const ParkedState *st = session_parked_at(id);
+    if (!st)
+      continue;
+    JournalPlayer *jp = realloc(snapshot, (n + 1) * sizeof(JournalPlayer));
+    if (!jp)
+      break;
+    snapshot = jp;
+    jp[n].id = id;
+    snprintf(jp[n].name, sizeof(jp[n].name), "%s", st->name);
+    jp[n].score = st->score;
+    n++;
+  }
+  journal_maybe_compact(snapshot, n, next_round, game_seed);
+  free(snapshot);
+}
+
+void remove_pending(PendingPlayer *pending, int *pending_count, int i) {
+  for (int j = i; j < *pending_count - 1; j++)
+    pending[j] = pending[j + 1];
+  (*pending_count)--;
+}
+
+int find_pending(PendingPlayer *pending, int pending_count, int sock) {
+  for (int i = 0; i < pending_count; i++) {
+    if (pending[i].sock == sock)
+      return i;
+  }
+  return -1;
+}
 
+void broadcast_lobby_state(const char *fmt, const char *name) {
+  int ready = 0;
+  for (int i = 0; i < round_state.len; i++)
+    ready += round_state.ready[i];
+  char msg[256];
+  snprintf(msg, sizeof(msg), fmt, name, ready, round_state.len);
+  send_to_all_except(msg, -1);
+  publish(SPEC_STATUS, msg);
+}
+
+int open_listen_socket(void) {
   struct sockaddr_in server_addr;
 
-  server_fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (server_fd < 0) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
     perror("socket");
     exit(1);
   }
 
-  signal(SIGINT, handle_sigint);
-  signal(SIGPIPE, SIG_IGN);
-
-  int opt = 1;
-  setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  int reuse = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
 
   server_addr.sin_family = AF_INET;
   server_addr.sin_addr.s_addr = INADDR_ANY;
-  server_addr.sin_port = htons(PORT);
+  server_addr.sin_port = htons(listen_port);
 
-  fcntl(server_fd, F_SETFL, O_NONBLOCK);
+  fcntl(fd, F_SETFL, O_NONBLOCK);
 
-  if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) <
-      0) {
+  if (bind(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
     perror("bind");
     exit(1);
   }
 
-  if (listen(server_fd, MAX_PLAYERS) < 0) {
+  if (listen(fd, max_players < SOMAXCONN ? SOMAXCONN : max_players) < 0) {
     perror("listen");
     exit(1);
   }
+  return fd;
+}
 
-  printf("Сервер запущен на порту %d\n", PORT);
-
-  PendingPlayer pending[MAX_PLAYERS];
-  int pending_count = 0;
+int main(int argc, char *argv[]) {
+  int backend = NET_BACKEND_POLL;
+  const char *journal_file = NULL;
+  int commit_ms = JOURNAL_COMMIT_MS;
+  int handoff_fd = -1;
+  const char *category_name = NULL;
+  int difficulty = QSEL_ANY;
+  int game_size = 0;
+  int have_seed = 0;
+  uint32_t seed = 0;
+  int game_no = 0;
+  int msg_limit = NET_LIMIT_MSGS;
+  NetTuning tuning = {0, 0, 0, 0};
+  int match_size = 0;
+  int match_wait_ms = MATCH_WAIT_MS;
+  const char *control_path = NULL;
+  int opt;
+  save_upgrade_argv(argc, argv);
+  while ((opt = getopt(argc, argv, "b:n:j:c:lq:k:d:s:r:RL:tP:W:m:w:p:C:H:h")) !=
+         -1) {
+    switch (opt) {
+    case 'b':
+      if (strcmp(optarg, "uring") == 0)
+        backend = NET_BACKEND_URING;
+      else if (strcmp(optarg, "poll") == 0)
+        backend = NET_BACKEND_POLL;
+      else {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'n':
+      max_players = atoi(optarg);
+      if (max_players <= 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'j':
+      journal_file = optarg;
+      break;
+    case 'c':
+      commit_ms = atoi(optarg);
+      break;
+    case 'l':
+      compensate_latency = 1;
+      break;
+    case 'q':
+      game_size = atoi(optarg);
+      break;
+    case 'k':
+      category_name = optarg;
+      break;
+    case 'd':
+      difficulty = atoi(optarg);
+      if (difficulty < 1 || difficulty > QSEL_MAX_DIFFICULTY) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 's':
+      seed = (uint32_t)strtoul(optarg, NULL, 10);
+      have_seed = 1;
+      break;
+    case 'r':
+      capture_path = optarg;
+      break;
+    case 'R':
+      replay_mode = 1;
+      break;
+    case 'L':
+      msg_limit = atoi(optarg);
+      if (msg_limit < 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 't':
+      tuning.nodelay = 1;
+      tuning.coalesce = 1;
+      break;
+    case 'P':
+      tuning.busy_poll_us = atoi(optarg);
+      break;
+    case 'W':
+      tuning.sndbuf = atoi(optarg);
+      break;
+    case 'm':
+      match_size = atoi(optarg);
+      if (match_size <= 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'w':
+      match_wait_ms = atoi(optarg);
+      break;
+    case 'p':
+      listen_port = atoi(optarg);
+      if (listen_port <= 0 || listen_port > 65535) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'C':
+      control_path = optarg;
+      break;
+    case 'H':
+      handoff_fd = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+  /* Behind the router TCP_INFO sees the loopback hop, not the player. */
+  if (compensate_latency && control_path) {
+    printf("Компенсация задержки (-l) не совмещается с -C: за "
+           "маршрутизатором RTT игрока не виден\n");
+    return 1;
+  }
+  /* After the loop: -n may come after -m. */
+  if (match_size > max_players) {
+    usage(argv[0]);
+    return 1;
+  }
 
-  // we cant reinitialize global variable in `main`!
-  int next_id = 1;
+  NetLimits limits = {
+      msg_limit,
+      msg_limit * 2,
+      msg_limit * NET_LIMIT_BYTES_PER_MSG,
+      msg_limit * 2 * NET_LIMIT_BYTES_PER_MSG,
+      NET_READ_BUDGET,
+      NET_MAX_STRIKES,
+  };
+  net_set_limits(&limits);
+  net_set_tuning(&tuning);
+
+  /* The new process of a live upgrade gets the game's questions with the
+   * state. */
+  int category = QSEL_ANY;
+  if (handoff_fd < 0) {
+    if (!load_questions(QUESTIONS_FILE)) {
+      handle_sigint();
+    }
+    index_questions();
+    if (category_name) {
+      category = find_category(category_name);
+      if (category < 0) {
+        printf("Категория \"%s\" не найдена\n", category_name);
+        exit(1);
+      }
+    }
+  }
+  session_init();
 
-  printf("Ожидаем игроков в лобби...\n");
+  signal(SIGINT, handle_sigint);
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGUSR2, handle_sigusr2);
+
+  /* With -m this process only runs the queue; every game is played in a
+   * child of its own that starts with its players already in the lobby. */
+  MatchPlayer *matched = NULL;
+  int matched_count = 0;
+  if (match_size > 0) {
+    if (journal_file || capture_path || control_path || handoff_fd >= 0) {
+      printf("Подбор игр (-m) не совмещается с -j, -r, -C и обновлением\n");
+      exit(1);
+    }
+    signal(SIGUSR2, SIG_IGN);
+    /* One seed for the whole series, so its games share one shuffle. */
+    if (!have_seed)
+      seed = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+    have_seed = 1;
+    matched_count = match_serve(open_listen_socket(), backend, match_size,
+                                match_wait_ms, &matched, &game_no);
+    if (matched_count == 0) {
+      session_free();
+      free(questions);
+      free_texts();
+      qsel_free(&question_index);
+      free(upgrade_argv);
+      return 0;
+    }
+    signal(SIGINT, handle_sigint);
+    /* Games share the output; whole lines keep them readable. */
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    printf("Игра %d (pid %d)\n", game_no, (int)getpid());
+  }
 
-  while (1) {
-    int count = 0;
-    Player *cur = head;
-    while (cur) {
-      count++;
-      cur = cur->next;
+  int start_round = 0;
+  if (journal_file && handoff_fd >= 0) {
+    /* The old process hands over the live state; the journal just goes on. */
+    if (journal_open(journal_file, commit_ms, 0) < 0)
+      exit(1);
+  } else if (journal_file) {
+    if (journal_recover(journal_file, &recovered) < 0) {
+      perror("journal");
+      exit(1);
     }
+    if (recovered.in_progress) {
+      start_round = recovered.next_round;
+      seed = recovered.seed;
+      have_seed = 1;
+    }
+    if (journal_open(journal_file, commit_ms, !recovered.in_progress) < 0)
+      exit(1);
+  }
 
-    int nfds = 1 + pending_count + count;
-    struct pollfd fds[nfds];
-    int idx = 0;
+  if (handoff_fd < 0) {
+    if (!have_seed)
+      seed = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+    pick_game(seed, category, difficulty, game_size,
+              game_no > 0 ? game_no - 1 : 0);
+    if (game_len == 0) {
+      printf("Нет вопросов с такой категорией и сложностью\n");
+      exit(1);
+    }
+    printf("Вопросов в игре: %d (сид %u)\n", game_len, seed);
+    if (recovered.in_progress)
+      printf("Восстановлена прерванная игра: вопрос %d/%d, игроков %d\n",
+             start_round + 1, game_len, recovered.player_count);
+    if (capture_path) {
+      CaptureHeader hdr;
+      memset(&hdr, 0, sizeof(hdr));
+      hdr.seed = seed;
+      hdr.game_len = game_len;
+      hdr.difficulty = difficulty;
+      hdr.max_players = max_players;
+      hdr.compensate_latency = compensate_latency;
+      snprintf(hdr.category, sizeof(hdr.category), "%s",
+               category_name ? category_name : "");
+      if (capture_open(capture_path, &hdr) < 0) {
+        perror("capture");
+        exit(1);
+      }
+      printf("Запись событий в %s\n", capture_path);
+    }
+  }
 
-    fds[idx].fd = server_fd;
-    fds[idx].events = POLLIN;
-    idx++;
+  PendingPlayer *pending = NULL;
+  int pending_count = 0;
+  NetEvent events[EVENTS_PER_WAIT];
+  int in_lobby = 1;
 
-    for (int i = 0; i < pending_count; i++, idx++) {
-      fds[idx].fd = pending[i].sock;
-      fds[idx].events = POLLIN;
+  // we cant reinitialize global variable in `main`!
+  int next_id = recovered.max_id + 1;
+
+  if (handoff_fd >= 0) {
+    int round;
+    in_lobby = take_over(handoff_fd, &pending, &pending_count, &next_id,
+                         &round, backend) == PHASE_LOBBY;
+    if (!in_lobby)
+      start_round = round;
+  } else if (matched_count > 0) {
+    net_init(backend, -1);
+    next_id = join_matched(matched, matched_count, next_id);
+    free(matched);
+  } else {
+    server_fd = open_listen_socket();
+    net_init(backend, server_fd);
+    printf("Сервер запущен на порту %d (%s)\n", listen_port,
+           net_backend_name());
+    if (tuning.nodelay)
+      printf("Профиль низкой задержки: TCP_NODELAY, обновления одним "
+             "сегментом\n");
+
+    pending = malloc((max_players + PENDING_EXTRA) * sizeof(PendingPlayer));
+    if (!pending) {
+      perror("malloc");
+      exit(1);
     }
+    printf("Ожидаем игроков в лобби...\n");
+  }
 
-    cur = head;
-    Player *players[count];
-    int pidx = 0;
-    while (cur) {
-      fds[idx].fd = cur->sock;
-      fds[idx].events = POLLIN;
-      players[pidx++] = cur;
-      cur = cur->next;
-      idx++;
-    }
+  /* A backend of router.out; the new process of a live upgrade reports under
+   * the same port, so the router keeps its rooms here. */
+  if (control_path) {
+    if (cluster_join(control_path, listen_port) == 0)
+      printf("Подключено к маршрутизатору (%s)\n", control_path);
+    else
+      printf("Маршрутизатор (%s) недоступен, пробуем раз в секунду\n",
+             control_path);
+  }
 
-    int ready_count = poll(fds, nfds, 100);
-    if (ready_count < 0 && errno != EINTR) {
-      perror("poll");
-      continue;
-    }
+  while (in_lobby) {
+    if (upgrade_requested)
+      live_upgrade(PHASE_LOBBY, pending, pending_count, next_id, -1, 0,
+                   TIME_PER_QUESTION);
+
+    int n = net_wait(events, EVENTS_PER_WAIT, 100);
+    capture_events(events, n, monotonic_ns());
+    journal_tick();
+    cluster_tick(round_state.len + pending_count, max_players, 1);
+    expire_sessions();
+    /* Everyone left and nobody is within the grace period to come back. */
+    if (round_state.len == 0 && players_joined > 0 &&
+        session_parked_count() == 0)
+      handle_sigint();
 
-    if (fds[0].revents & POLLIN && (count + pending_count) < MAX_PLAYERS) {
-      struct sockaddr_in client_addr;
-      socklen_t client_len = sizeof(client_addr);
-      int client_sock =
-          accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
-      if (client_sock >= 0) {
-        fcntl(client_sock, F_SETFL, O_NONBLOCK);
-        pending[pending_count].sock = client_sock;
+    for (int e = 0; e < n; e++) {
+      NetEvent *ev = &events[e];
+
+      if (ev->type == NET_EV_ACCEPT) {
+        /* Until its first message a connection may as well be a spectator
+         * relay: only players who give their name take a place in the lobby,
+         * and this only bounds how many connections wait to do so. */
+        if (pending_count >= max_players + PENDING_EXTRA) {
+          char *msg = "Лобби заполнено! Попробуйте позже.\n";
+          net_send(ev->fd, msg, strlen(msg));
+          net_close(ev->fd);
+          continue;
+        }
+        pending[pending_count].sock = ev->fd;
         pending[pending_count].bytes_received = 0;
         pending[pending_count].name[0] = '\0';
         pending_count++;
+        net_watch(ev->fd);
+        continue;
       }
-    }
 
-    for (int i = 0; i < pending_count; i++) {
-      char buf[MAX_NAME_LEN];
-      int n = recv(pending[i].sock, buf, sizeof(buf) - 1, 0);
-      if (n > 0) {
-        buf[n] = '\0';
+      int i = find_pending(pending, pending_count, ev->fd);
+      if (i >= 0) {
+        if (ev->type == NET_EV_CLOSED) {
+          net_close(pending[i].sock);
+          remove_pending(pending, &pending_count, i);
+          continue;
+        }
+
+        char buf[MAX_NAME_LEN];
+        snprintf(buf, sizeof(buf), "%.*s", MAX_NAME_LEN - 1, ev->data);
         clean_string(buf);
+
+        if (strcmp(buf, SPECTATE_HELLO) == 0) {
+          int sock = pending[i].sock;
+          remove_pending(pending, &pending_count, i);
+          add_relay(sock);
+          continue;
+        }
+
+        if (is_resume_request(buf)) {
+          int sock = pending[i].sock;
+          remove_pending(pending, &pending_count, i);
+          Player *p = resume_player(sock, buf + 8);
+          if (!p) {
+            char *msg = "Сессия не найдена или истекла.\n";
+            net_send(sock, msg, strlen(msg));
+            net_close(sock);
+            continue;
+          }
+          printf("Игрок [%s] переподключился\n", player_name(p));
+          char msg[256];
+          snprintf(msg, sizeof(msg), "\nВы снова в лобби, %s!\n%s",
+                   player_name(p),
+                   round_state.ready[p->slot]
+                       ? ""
+                       : "Для подтверждения готовности введите "
+                         "комманду '/ready'\n");
+          net_send(sock, msg, strlen(msg));
+          broadcast_lobby_state(
+              "[%s] вернулся в лобби. Готовые игроки: (%d/%d)\n",
+              player_name(p));
+          continue;
+        }
+
+        if (round_state.len >= max_players) {
+          char *msg = "Лобби заполнено! Попробуйте позже.\n";
+          net_send(pending[i].sock, msg, strlen(msg));
+          net_close(pending[i].sock);
+          remove_pending(pending, &pending_count, i);
+          continue;
+        }
+
         strncpy(pending[i].name, buf, MAX_NAME_LEN - 1);
         pending[i].name[MAX_NAME_LEN - 1] = '\0';
 
-        int suffix = 1;
-        char original[MAX_NAME_LEN];
-        strncpy(original, pending[i].name, MAX_NAME_LEN);
-        while (name_exists(head, pending[i].name)) {
-          snprintf(pending[i].name, MAX_NAME_LEN, "%s_%d", original, suffix++);
+        int id, score = 0;
+        int recovered_player = !name_exists(pending[i].name) &&
+                               claim_recovered(pending[i].name, &id, &score);
+        if (!recovered_player) {
+          int suffix = 1;
+          char original[MAX_NAME_LEN];
+          strncpy(original, pending[i].name, MAX_NAME_LEN);
+          while (name_exists(pending[i].name)) {
+            snprintf(pending[i].name, MAX_NAME_LEN, "%s_%d", original,
+                     suffix++);
+          }
+          id = next_id++;
         }
-
-        head = add_player(head, pending[i].sock, pending[i].name, next_id++);
-        printf("Игрок [%s] добавлен в игру!\n", pending[i].name);
-        int ready = 0;
-        int total_players = 0;
-        cur = head;
-        while (cur) {
-          total_players++;
-          if (cur->ready)
-            ready++;
-          cur = cur->next;
+        Player *joined = add_player(pending[i].sock, pending[i].name, id);
+        if (!joined) {
+          char *msg = "Лобби заполнено! Попробуйте позже.\n";
+          net_send(pending[i].sock, msg, strlen(msg));
+          net_close(pending[i].sock);
+          remove_pending(pending, &pending_count, i);
+          continue;
         }
-        char msg[256];
-        snprintf(
-            msg, sizeof(msg),
+        if (recovered_player)
+          printf("Игрок [%s] вернулся в игру со счётом %d\n", pending[i].name,
+                 score);
+        else
+          journal_join(id, pending[i].name);
+        round_state.score[joined->slot] = score;
+        players_joined++;
+        printf("Игрок [%s] добавлен в игру!\n", pending[i].name);
+        broadcast_lobby_state(
             "[%s] присоединился! Готовых игроков на данный момент: (%d/%d)\n",
-            pending[i].name, ready, total_players);
-        send_to_all_except(head, msg, -1);
+            pending[i].name);
+        char msg[256];
         snprintf(msg, sizeof(msg),
                  "Для подтверждения готовности введите комманду '/ready'\n");
-        send(pending[i].sock, msg, strlen(msg), 0);
-        for (int j = i; j < pending_count - 1; j++)
-          pending[j] = pending[j + 1];
-        pending_count--;
-        i--;
-      } else if (n == 0) {
-        close(pending[i].sock);
-        for (int j = i; j < pending_count - 1; j++)
-          pending[j] = pending[j + 1];
-        pending_count--;
-        i--;
-      } else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-        perror("recv");
+        net_send(pending[i].sock, msg, strlen(msg));
+        issue_token(joined);
+        remove_pending(pending, &pending_count, i);
+        continue;
       }
-    }
 
-    for (int i = 0; i < count; i++) {
-      if (fds[1 + pending_count + i].revents & POLLIN) {
+      Player *player = find_player(ev->fd);
+      if (!player)
+        continue;
+
+      if (ev->type == NET_EV_CLOSED) {
+        printf("Игрок [%s] отключился\n", player_name(player));
+        char s_name[MAX_NAME_LEN];
+        snprintf(s_name, sizeof(s_name), "%s", player_name(player));
+        park_player(player);
+        remove_player(player);
+        broadcast_lobby_state(
+            "Игрок [%s] вышел из лобби. Готовые игроки: (%d/%d)\n", s_name);
+      } else {
         char msg[64];
-        int n = recv(fds[1 + pending_count + i].fd, msg, sizeof(msg) - 1, 0);
-        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-          perror("recv");
-          close(players[i]->sock);
-          players[i]->connected = 0;
-        } else if (n == 0) {
-          printf("Игрок [%s] отключился\n", players[i]->name);
-          char s_name[MAX_NAME_LEN];
-          snprintf(s_name, sizeof(s_name), "%s", players[i]->name);
-          head = remove_player(head, players[i]->sock);
-          if (!head) {
-            handle_sigint();
-          }
-          char buffer[256];
-          int ready = 0;
-          int total_players = 0;
-          cur = head;
-          while (cur) {
-            total_players++;
-            if (cur->ready)
-              ready++;
-            cur = cur->next;
-          }
-          snprintf(buffer, sizeof(buffer),
-                   "Игрок [%s] вышел из лобби. Готовые игроки: (%d/%d)\n",
-                   s_name, ready, total_players);
-          send_to_all_except(head, buffer, -1);
-        } else if (n > 0) {
-          msg[n] = '\0';
-          clean_string(msg);
-          if (strcmp(msg, "/ready") == 0 && !players[i]->ready) {
-            players[i]->ready = 1;
-            char buffer[256];
-            int ready = 0;
-            int total_players = 0;
-            cur = head;
-            while (cur) {
-              total_players++;
-              if (cur->ready)
-                ready++;
-              cur = cur->next;
-            }
-            snprintf(buffer, sizeof(buffer),
-                     "[%s] готов. Готовые игроки: (%d/%d)\n", players[i]->name,
-                     ready, total_players);
-            send_to_all_except(head, buffer, -1);
-          }
+        snprintf(msg, sizeof(msg), "%s", ev->data);
+        clean_string(msg);
+        if (strcmp(msg, "/ready") == 0 && !round_state.ready[player->slot]) {
+          round_state.ready[player->slot] = 1;
+          broadcast_lobby_state("[%s] готов. Готовые игроки: (%d/%d)\n",
+                                player_name(player));
         }
       }
     }
 
     int all_ready = 1;
-    int total_players = 0;
-    cur = head;
-    while (cur) {
-      total_players++;
-      if (!cur->ready)
+    for (int i = 0; i < round_state.len; i++) {
+      if (!round_state.ready[i])
         all_ready = 0;
-      cur = cur->next;
     }
 
-    if (total_players > 0 && all_ready) {
-      send_to_all_except(head, "\nВсе игроки готовы! Игра начинается...\n", -1);
-      sleep(3);
+    if (round_state.len > 0 && all_ready) {
+      send_to_all_except("\nВсе игроки готовы! Игра начинается...\n", -1);
+      publish(SPEC_STATUS, "\nВсе игроки готовы! Игра начинается...\n");
+      pause_sec(3);
       break;
     }
   }
-  for (int i = 0; i < pending_count; i++) {
-    close(pending[i].sock);
+  /* Whoever hasn't given a name yet is too late, like a join after the
+   * start. */
+  for (int i = 0; i < pending_count; i++)
+    reject_during_game(pending[i].sock);
+  free(pending);
+  if (in_lobby) {
+    printf("Старт игры!\n");
+    if (!recovered.in_progress)
+      journal_game_start(game_seed);
   }
-  printf("Старт игры!\n");
 
-  for (int q = 0; q < question_count; q++) {
+  for (int q = start_round; q < game_len; q++) {
 
-    process_round(head, q);
-    notify_about_disconnected(head);
-    head = cleanup_disconnected(head);
-    if (!head)
+    process_round(q);
+    notify_about_disconnected();
+    cleanup_disconnected();
+    if (round_state.len == 0)
       handle_sigint();
 
-    send_results(head, q);
-    notify_about_disconnected(head);
-    head = cleanup_disconnected(head);
-    if (!head)
+    send_results(q);
+    notify_about_disconnected();
+    cleanup_disconnected();
+    if (round_state.len == 0)
       handle_sigint();
-    sleep(2);
+    compact_journal(q + 1);
+    pause_sec(2);
   }
 
-  send_final_results(head);
-
-  free_players(head);
+  send_final_results();
+  journal_game_end();
+  journal_close();
+  capture_close();
+  close_relays();
+  journal_state_free(&recovered);
+  session_free();
+  for (int i = 0; i < handshake_count; i++)
+    net_close(handshakes[i].sock);
+  free(handshakes);
+
+  free_players();
   free(questions);
+  free(game_questions);
+  qsel_free(&question_index);
+  free(upgrade_argv);
+  cluster_leave();
+  print_io_stats();
+  round_free();
+  free_texts();
+  net_shutdown();
   close(server_fd);
 
   printf("Игра окончена!\n");
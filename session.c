@@ -0,0 +1,157 @@
+#include "session.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static Session *sessions = NULL;
+static int sessions_len = 0;
+static int parked_count = 0;
+static uint64_t rng_state = 0;
+
+/* xorshift64*, seeded from /dev/urandom. Tokens only have to be unguessable
+ * by other players on the same LAN, not cryptographically strong. */
+static uint64_t next_secret(void) {
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 2685821657736338717ULL;
+}
+
+void session_init(void) {
+  int fd = open("/dev/urandom", O_RDONLY);
+  if (fd >= 0) {
+    if (read(fd, &rng_state, sizeof(rng_state)) != sizeof(rng_state))
+      rng_state = 0;
+    close(fd);
+  }
+  if (rng_state == 0)
+    rng_state = (uint64_t)time(NULL) * 0x9E3779B97F4A7C15ULL ^ getpid();
+}
+
+void session_free(void) {
+  free(sessions);
+  sessions = NULL;
+  sessions_len = 0;
+  parked_count = 0;
+}
+
+static Session *slot(int id) {
+  if (id <= 0)
+    return NULL;
+  if (id >= sessions_len) {
+    int len = sessions_len ? sessions_len : 64;
+    while (len <= id)
+      len *= 2;
+    Session *s = realloc(sessions, len * sizeof(Session));
+    if (!s) {
+      perror("realloc");
+      exit(1);
+    }
+    memset(s + sessions_len, 0, (len - sessions_len) * sizeof(Session));
+    sessions = s;
+    sessions_len = len;
+  }
+  return &sessions[id];
+}
+
+void session_register(int id, void *player, char *token, size_t token_len) {
+  Session *s = slot(id);
+  if (s->state == SESSION_PARKED)
+    parked_count--;
+  s->state = SESSION_LIVE;
+  s->secret = next_secret();
+  s->live = player;
+  snprintf(token, token_len, "%d-%016" PRIx64, id, s->secret);
+}
+
+void session_park(int id, const ParkedState *state) {
+  Session *s = slot(id);
+  if (!s || s->state == SESSION_NONE)
+    return;
+  if (s->state != SESSION_PARKED)
+    parked_count++;
+  s->state = SESSION_PARKED;
+  s->live = NULL;
+  s->parked_at = time(NULL);
+  s->parked = *state;
+}
+
+Session *session_lookup(const char *token, int *id) {
+  int sid;
+  uint64_t secret;
+  if (sscanf(token, "%d-%" SCNx64, &sid, &secret) != 2)
+    return NULL;
+  if (sid <= 0 || sid >= sessions_len)
+    return NULL;
+  Session *s = &sessions[sid];
+  if (s->state == SESSION_NONE || s->secret != secret)
+    return NULL;
+  *id = sid;
+  return s;
+}
+
+void session_attach(Session *s, void *player) {
+  if (s->state == SESSION_PARKED)
+    parked_count--;
+  s->state = SESSION_LIVE;
+  s->live = player;
+}
+
+int session_expire(time_t now, void (*on_expire)(int id, const ParkedState *)) {
+  if (parked_count == 0)
+    return 0;
+  int dropped = 0;
+  for (int id = 1; id < sessions_len; id++) {
+    Session *s = &sessions[id];
+    if (s->state != SESSION_PARKED || now - s->parked_at < SESSION_GRACE_SEC)
+      continue;
+    s->state = SESSION_NONE;
+    parked_count--;
+    dropped++;
+    if (on_expire)
+      on_expire(id, &s->parked);
+  }
+  return dropped;
+}
+
+int session_parked_count(void) { return parked_count; }
+
+const ParkedState *session_parked_at(int id) {
+  if (id <= 0 || id >= sessions_len || sessions[id].state != SESSION_PARKED)
+    return NULL;
+  return &sessions[id].parked;
+}
+
+int session_max_id(void) { return sessions_len - 1; }
+
+const Session *session_table(int *len) {
+  *len = sessions_len;
+  return sessions;
+}
+
+void session_load(const Session *table, int len) {
+  session_free();
+  if (len <= 0)
+    return;
+  sessions = malloc(len * sizeof(Session));
+  if (!sessions) {
+    perror("malloc");
+    exit(1);
+  }
+  memcpy(sessions, table, len * sizeof(Session));
+  sessions_len = len;
+  for (int id = 0; id < len; id++) {
+    sessions[id].live = NULL;
+    if (sessions[id].state == SESSION_PARKED)
+      parked_count++;
+  }
+}
+
+void session_relink(int id, void *player) {
+  if (id > 0 && id < sessions_len && sessions[id].state == SESSION_LIVE)
+    sessions[id].live = player;
+}
@@ -0,0 +1,67 @@
+#ifndef QUIZRUSH_SESSION_H
+#define QUIZRUSH_SESSION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define SESSION_NAME_LEN 64
+#define SESSION_TOKEN_LEN 32
+#define SESSION_GRACE_SEC 60
+
+enum { SESSION_NONE, SESSION_LIVE, SESSION_PARKED };
+
+/* Everything a player needs to get back into the game, without the socket. */
+typedef struct {
+  char name[SESSION_NAME_LEN];
+  int score;
+  int ready;
+  int round; /* answer fields below belong to this round, -1 is the lobby */
+  int answered;
+  int answer;
+  int answer_time_us;
+} ParkedState;
+
+/* Sessions are indexed by player id (ids are handed out sequentially), so a
+ * token "<id>-<secret>" leads to its slot in O(1). `live` points to the
+ * player while connected. */
+typedef struct {
+  int state;
+  uint64_t secret;
+  void *live;
+  time_t parked_at;
+  ParkedState parked;
+} Session;
+
+void session_init(void);
+void session_free(void);
+
+/* Creates the session of a freshly joined player and writes its token. */
+void session_register(int id, void *player, char *token, size_t token_len);
+
+/* Player lost the connection: keep its state for SESSION_GRACE_SEC. */
+void session_park(int id, const ParkedState *state);
+
+/* Returns the session matching the token or NULL. The id is stored in *id. */
+Session *session_lookup(const char *token, int *id);
+
+/* Marks a parked or live session as live again with a new player object. */
+void session_attach(Session *s, void *player);
+
+/* Drops parked sessions older than the grace period. Calls on_expire for
+ * each of them; returns how many were dropped. */
+int session_expire(time_t now, void (*on_expire)(int id, const ParkedState *));
+
+int session_parked_count(void);
+
+/* Raw table for a live upgrade. After session_load() live sessions have no
+ * player yet; session_relink() gives them their new one. */
+const Session *session_table(int *len);
+void session_load(const Session *table, int len);
+void session_relink(int id, void *player);
+
+/* Iterates parked sessions (for journal snapshots). */
+const ParkedState *session_parked_at(int id);
+int session_max_id(void);
+
+#endif
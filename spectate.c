@@ -0,0 +1,123 @@
+#include "spectate.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void *xrealloc(void *ptr, size_t size) {
+  void *p = realloc(ptr, size);
+  if (!p) {
+    perror("realloc");
+    exit(1);
+  }
+  return p;
+}
+
+static char *xstrdup(const char *s) {
+  size_t n = strlen(s) + 1;
+  return memcpy(xrealloc(NULL, n), s, n);
+}
+
+void spec_update(SpecState *s, int kind, const char *text) {
+  if (kind < 0 || kind >= SPEC_KINDS)
+    return;
+  if (kind == SPEC_QUESTION) {
+    free(s->text[SPEC_STATUS]);
+    free(s->text[SPEC_ROUND_END]);
+    s->text[SPEC_STATUS] = s->text[SPEC_ROUND_END] = NULL;
+  }
+  free(s->text[kind]);
+  s->text[kind] = xstrdup(text);
+  s->seq[kind] = ++s->next_seq;
+}
+
+void spec_free(SpecState *s) {
+  for (int k = 0; k < SPEC_KINDS; k++)
+    free(s->text[k]);
+  memset(s, 0, sizeof(*s));
+}
+
+char *spec_snapshot(const SpecState *s, int framed, size_t *len) {
+  int order[SPEC_KINDS];
+  int n = 0;
+  size_t total = 0;
+  for (int k = 0; k < SPEC_KINDS; k++) {
+    if (!s->text[k])
+      continue;
+    int i = n++;
+    while (i > 0 && s->seq[order[i - 1]] > s->seq[k]) {
+      order[i] = order[i - 1];
+      i--;
+    }
+    order[i] = k;
+    total += strlen(s->text[k]) + (framed ? 2 : 0);
+  }
+  *len = total;
+  if (n == 0)
+    return NULL;
+
+  char *out = xrealloc(NULL, total + 1);
+  char *p = out;
+  for (int i = 0; i < n; i++) {
+    size_t l = strlen(s->text[order[i]]);
+    if (framed)
+      *p++ = (char)(order[i] + 1);
+    memcpy(p, s->text[order[i]], l);
+    p += l;
+    if (framed)
+      *p++ = '\0';
+  }
+  *p = '\0';
+  return out;
+}
+
+size_t spec_frame(char **buf, size_t *cap, int kind, const char *text) {
+  size_t l = strlen(text);
+  if (l + 2 > *cap) {
+    *cap = *cap ? *cap : 1024;
+    while (*cap < l + 2)
+      *cap *= 2;
+    *buf = xrealloc(*buf, *cap);
+  }
+  (*buf)[0] = (char)(kind + 1);
+  memcpy(*buf + 1, text, l + 1);
+  return l + 2;
+}
+
+void spec_feed(SpecReader *r, const char *data, size_t n) {
+  if (r->pos > 0) {
+    memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+    r->len -= r->pos;
+    r->pos = 0;
+  }
+  if (r->len + n > r->cap) {
+    r->cap = r->cap ? r->cap : 4096;
+    while (r->cap < r->len + n)
+      r->cap *= 2;
+    r->buf = xrealloc(r->buf, r->cap);
+  }
+  memcpy(r->buf + r->len, data, n);
+  r->len += n;
+}
+
+int spec_next(SpecReader *r, int *kind, const char **text) {
+  while (r->pos < r->len) {
+    char *start = r->buf + r->pos;
+    char *end = memchr(start, '\0', r->len - r->pos);
+    if (!end)
+      return 0;
+    r->pos += end - start + 1;
+    int k = (unsigned char)start[0] - 1;
+    if (end == start || k < 0 || k >= SPEC_KINDS)
+      continue;
+    *kind = k;
+    *text = start + 1;
+    return 1;
+  }
+  return 0;
+}
+
+void spec_reader_free(SpecReader *r) {
+  free(r->buf);
+  memset(r, 0, sizeof(*r));
+}
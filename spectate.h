@@ -0,0 +1,54 @@
+#ifndef QUIZRUSH_SPECTATE_H
+#define QUIZRUSH_SPECTATE_H
+
+#include <stddef.h>
+
+/* A relay connects to the game port and sends this instead of a name. */
+#define SPECTATE_HELLO "/relay"
+#define SPECTATE_PORT 5001
+
+/* What spectators see. The server sends each message to its relays once as a
+ * frame: the kind + 1 as one byte, the text, a '\0'. */
+enum {
+  SPEC_STATUS,    /* lobby news, the start of the game */
+  SPEC_QUESTION,  /* the question without the answer prompt */
+  SPEC_ROUND_END, /* correct answer and how the room answered */
+  SPEC_SCORES,
+  SPEC_FINAL,
+  SPEC_KINDS
+};
+
+/* The latest message of each kind, which is what a late joiner is sent to
+ * catch up. A new question drops the status and the previous round's end. */
+typedef struct {
+  char *text[SPEC_KINDS];
+  unsigned seq[SPEC_KINDS];
+  unsigned next_seq;
+} SpecState;
+
+void spec_update(SpecState *s, int kind, const char *text);
+void spec_free(SpecState *s);
+
+/* The state in the order it was published, as frames (for a relay) or as
+ * plain text (for a spectator). malloc'ed; NULL with *len 0 when empty. */
+char *spec_snapshot(const SpecState *s, int framed, size_t *len);
+
+/* One frame into *buf, which is grown as needed and kept by the caller for
+ * the next one. Returns the frame's length. */
+size_t spec_frame(char **buf, size_t *cap, int kind, const char *text);
+
+/* Splits a relay's byte stream into frames. */
+typedef struct {
+  char *buf;
+  size_t len;
+  size_t pos;
+  size_t cap;
+} SpecReader;
+
+void spec_feed(SpecReader *r, const char *data, size_t n);
+/* Returns 1 and the next complete frame, whose text stays valid until the
+ * next spec_feed(); 0 when there is none yet. Bad kinds are skipped. */
+int spec_next(SpecReader *r, int *kind, const char **text);
+void spec_reader_free(SpecReader *r);
+
+#endif
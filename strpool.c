@@ -0,0 +1,156 @@
+#include "strpool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FREE_ENTRY UINT32_MAX
+
+static void *xrealloc(void *ptr, size_t size) {
+  void *p = realloc(ptr, size);
+  if (!p) {
+    perror("realloc");
+    exit(1);
+  }
+  return p;
+}
+
+static uint32_t hash(const char *s, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)s[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+int strpool_reserve(StrPool *p, size_t bytes) {
+  if (bytes > STRPOOL_MAX - p->len)
+    return -1;
+  if (p->len + bytes <= p->cap)
+    return 0;
+  /* Doubling for names coming one by one, exact for a reservation made up
+   * front (the whole question file). */
+  size_t cap = p->cap ? p->cap * 2 : 4096;
+  if (cap < p->len + bytes)
+    cap = p->len + bytes;
+  if (cap > STRPOOL_MAX)
+    cap = STRPOOL_MAX;
+  p->buf = xrealloc(p->buf, cap);
+  p->cap = cap;
+  return 0;
+}
+
+int strpool_add(StrPool *p, const char *s, size_t len, StrRef *out) {
+  if (strpool_reserve(p, len + 1) < 0)
+    return -1;
+  out->off = (uint32_t)p->len;
+  out->len = (uint32_t)len;
+  memcpy(p->buf + p->len, s, len);
+  p->buf[p->len + len] = '\0';
+  p->len += len + 1;
+  return 0;
+}
+
+/* Texts in the pool end with their '\0', so strncmp() never reads past
+ * one. */
+static int entry_is(const StrPool *p, uint32_t off, const char *s,
+                    size_t len) {
+  return strncmp(p->buf + off, s, len) == 0 && p->buf[off + len] == '\0';
+}
+
+static size_t find_entry(const StrPool *p, const char *s, size_t len) {
+  size_t mask = p->table_cap - 1;
+  size_t i = hash(s, len) & mask;
+  while (p->table[i] != FREE_ENTRY && !entry_is(p, p->table[i], s, len))
+    i = (i + 1) & mask;
+  return i;
+}
+
+static size_t home_of(const StrPool *p, uint32_t off) {
+  const char *s = p->buf + off;
+  return hash(s, strlen(s)) & (p->table_cap - 1);
+}
+
+static void grow_table(StrPool *p) {
+  uint32_t *old = p->table;
+  size_t old_cap = p->table_cap;
+  p->table_cap = old_cap ? old_cap * 2 : 64;
+  p->table = xrealloc(NULL, p->table_cap * sizeof(*p->table));
+  memset(p->table, 0xff, p->table_cap * sizeof(*p->table));
+  size_t mask = p->table_cap - 1;
+  for (size_t i = 0; i < old_cap; i++) {
+    if (old[i] == FREE_ENTRY)
+      continue;
+    size_t j = home_of(p, old[i]);
+    while (p->table[j] != FREE_ENTRY)
+      j = (j + 1) & mask;
+    p->table[j] = old[i];
+  }
+  free(old);
+}
+
+int strpool_intern(StrPool *p, const char *s, size_t len, StrRef *out) {
+  if (4 * (p->table_count + 1) > 3 * p->table_cap)
+    grow_table(p);
+  size_t i = find_entry(p, s, len);
+  if (p->table[i] == FREE_ENTRY) {
+    if (strpool_add(p, s, len, out) < 0)
+      return -1;
+    p->table[i] = out->off;
+    p->table_count++;
+    return 0;
+  }
+  out->off = p->table[i];
+  out->len = (uint32_t)len;
+  return 0;
+}
+
+int strpool_find(const StrPool *p, const char *s, size_t len, StrRef *out) {
+  if (p->table_count == 0)
+    return 0;
+  size_t i = find_entry(p, s, len);
+  if (p->table[i] == FREE_ENTRY)
+    return 0;
+  out->off = p->table[i];
+  out->len = (uint32_t)len;
+  return 1;
+}
+
+/* Backward-shift deletion: entries after the hole that may live in it move
+ * up, so lookups never need tombstones. */
+void strpool_remove(StrPool *p, StrRef r) {
+  if (p->table_count == 0)
+    return;
+  size_t mask = p->table_cap - 1;
+  size_t i = find_entry(p, p->buf + r.off, r.len);
+  if (p->table[i] != r.off)
+    return;
+  p->table_count--;
+  p->dead += r.len + 1;
+  for (size_t j = (i + 1) & mask; p->table[j] != FREE_ENTRY;
+       j = (j + 1) & mask) {
+    size_t home = home_of(p, p->table[j]);
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      p->table[i] = p->table[j];
+      i = j;
+    }
+  }
+  p->table[i] = FREE_ENTRY;
+}
+
+const char *strpool_get(const StrPool *p, StrRef r) { return p->buf + r.off; }
+
+int strref_equal(StrRef a, StrRef b) {
+  return a.off == b.off && a.len == b.len;
+}
+
+size_t strpool_bytes(const StrPool *p) {
+  return p->cap + p->table_cap * sizeof(*p->table);
+}
+
+void strpool_free(StrPool *p) {
+  free(p->buf);
+  free(p->table);
+  memset(p, 0, sizeof(*p));
+}
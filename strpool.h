@@ -0,0 +1,47 @@
+#ifndef QUIZRUSH_STRPOOL_H
+#define QUIZRUSH_STRPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Offsets are 32-bit, and UINT32_MAX marks a free table entry: a pool never
+ * holds more bytes than this. */
+#define STRPOOL_MAX ((size_t)UINT32_MAX - 1)
+
+/* A string in a pool: where it starts and how long it is. Handles survive the
+ * pool growing; pointers from strpool_get() only last until the next add. */
+typedef struct {
+  uint32_t off;
+  uint32_t len;
+} StrRef;
+
+/* Strings appended to one buffer, each followed by a '\0', and freed all
+ * together. Interned strings are also kept in an open-addressing table of
+ * their offsets, so the same text is stored once and two interned handles are
+ * equal exactly when their texts are. A removed string leaves its bytes
+ * behind as `dead` until the owner rebuilds the pool. */
+typedef struct {
+  char *buf;
+  size_t len;
+  size_t cap;
+  size_t dead;
+  uint32_t *table;
+  size_t table_cap;
+  size_t table_count;
+} StrPool;
+
+/* These return -1 once the pool would pass STRPOOL_MAX. */
+int strpool_reserve(StrPool *p, size_t bytes);
+int strpool_add(StrPool *p, const char *s, size_t len, StrRef *out);
+int strpool_intern(StrPool *p, const char *s, size_t len, StrRef *out);
+/* The interned handle of the text, if it has been interned; never adds. */
+int strpool_find(const StrPool *p, const char *s, size_t len, StrRef *out);
+/* Takes an interned string out of the table; its bytes become dead. */
+void strpool_remove(StrPool *p, StrRef r);
+const char *strpool_get(const StrPool *p, StrRef r);
+int strref_equal(StrRef a, StrRef b);
+/* Bytes the pool holds: the buffer and the table. */
+size_t strpool_bytes(const StrPool *p);
+void strpool_free(StrPool *p);
+
+#endif